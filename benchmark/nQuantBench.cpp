@@ -0,0 +1,819 @@
+// nQuantBench.cpp
+//
+// Runs the quantizers over deterministic synthetic images and reports the wall time
+// of each phase together with the throughput in megapixels per second as JSON.
+// With /c it checks instead that quantizers running at once on many threads give
+// the palettes and indices of a run on one thread, byte for byte.
+// Only the raw ARGB buffer entry points are used, so it builds wherever the library does.
+
+#include "stdafx.h"
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "PnnQuantizer.h"
+#include "NeuQuantizer.h"
+#include "WuQuantizer.h"
+#include "PnnLABQuantizer.h"
+#include "EdgeAwareSQuantizer.h"
+#include "SpatialQuantizer.h"
+#include "DivQuantizer.h"
+#include "MoDEQuantizer.h"
+#include "MedianCut.h"
+#include "Dl3Quantizer.h"
+#include "bitmapUtilities.h"
+#include "PaletteScan.h"
+#include "PaletteTree.h"
+#include "NearestMap.h"
+
+using namespace std;
+
+const vector<string> algs = { "PNN", "PNNLAB", "NEU", "WU", "EAS", "SPA", "DIV", "MODE", "MMC", "DL3" };
+const vector<string> imageKinds = { "gradient", "noise", "photo", "flat", "sprite" };
+const vector<UINT> defaultColors = { 2, 16, 64, 256, 4096 };
+// the algorithms that take too long above slowMaxColors to be in the matrix unless /a names them
+const vector<string> slowAlgs = { "MODE", "SPA", "EAS" };
+const UINT slowMaxColors = 256;
+
+typedef function<bool(const SourceImage&, ColorPalette*, unsigned short*, UINT&, bool, QuantizeStats*, const unsigned long long seed, const DitherLookup& lookup, const size_t closestCacheSize, const UINT remapThreads, const bool nearestMap)> QuantizeFn;
+
+void PrintUsage()
+{
+	cerr << endl;
+	cerr << "usage: nQuantBench [options]" << endl;
+	cerr << endl;
+	cerr << "Valid options:" << endl;
+	cerr << "  /a : Comma separated algorithms from [PNN, PNNLAB, NEU, WU, EAS, SPA, DIV, MODE, MMC, DL3]. The default is all of them." << endl;
+	cerr << "  /i : Comma separated images from [gradient, noise, photo, flat, sprite]. The default is all of them." << endl;
+	cerr << "  /m : Comma separated max colors. The default is 2,16,64,256,4096." << endl;
+	cerr << "  /d : Dithering, one of y, n or both. The default is both." << endl;
+	cerr << "  /s : Image size as <width>x<height>. The default is 256x256." << endl;
+	cerr << "  /r : Repeats of each run, the fastest one is reported. The default is 3." << endl;
+	cerr << "  /x : Seed of the random generators of the quantizers. The default is 1." << endl;
+	cerr << "  /l : Build the dither lookup table up front on all cores, with 0 to 2 bits added to each channel. The default is to fill it lazily." << endl;
+	cerr << "  /w : Dither every row left to right in a wavefront on this many threads, 0 for one per logical processor, which /l then builds its table on as well. More than one builds the table of /l without it, except in NEU, PNNLAB, DIV and MMC at 32 colors or fewer, which stay on one thread, while 0 without /l stays on one thread too. dither_threads reports how many were used. The default is the serpentine scan on one thread." << endl;
+	cerr << "  /g : Diffuse the error in square tiles of this size, optionally followed by a comma and the overlap of the tiles, 32 by default. The tiles go to the threads of /w under the same rule. The default is one scan over the whole image." << endl;
+	cerr << "  /t : Dither by a pattern instead of diffusing the error, bayer or blue for the 8x8 Bayer matrix or the 64x64 blue noise mask. Its rows go to the threads of /w under the same rule. The default is diffusion." << endl;
+	cerr << "  /z : Records in the closest colour cache of PNN, PNNLAB, WU, MODE, MMC and DL3, rounded up to a power of 2. The default is 262144." << endl;
+	cerr << "  /p : Threads of the remap without dithering, 0 for one per logical processor. EAS and SPA ignore it. The default is 1." << endl;
+	cerr << "  /n : y to remap without dithering through a NearestMap in PNN, PNNLAB, NEU, DIV, MODE, MMC and DL3. The default is n." << endl;
+	cerr << "  /k : y to time the nearest colour lookups of a linear scan against PaletteScan, PaletteTree and NearestMap instead of quantizing. The default is n." << endl;
+	cerr << "  /c : Threads to run every combination on at once, each /r times, checking the output against a run on one thread instead of timing. Exits with 2 on a mismatch. The default is not to check." << endl;
+	cerr << "  /o : Output JSON file. The default is the standard output." << endl;
+	cerr << endl;
+	cerr << "Unless /a is given, MODE, SPA and EAS skip the max colors above 256, which take them too long. Name them with /a to run those." << endl;
+}
+
+vector<string> Split(const string& list)
+{
+	vector<string> tokens;
+	stringstream ss(list);
+	string token;
+	while (getline(ss, token, ',')) {
+		if (!token.empty())
+			tokens.emplace_back(token);
+	}
+	return tokens;
+}
+
+string ToUpper(string value)
+{
+	transform(value.begin(), value.end(), value.begin(), [](unsigned char c) { return (char) toupper(c); });
+	return value;
+}
+
+inline BYTE Clamp(const double value)
+{
+	if (value < 0)
+		return 0;
+	if (value > BYTE_MAX)
+		return BYTE_MAX;
+	return (BYTE) value;
+}
+
+// Smooth value noise in [0, 1) over a lattice of the given cell size
+double ValueNoise(const vector<double>& lattice, const int latticeSize, const double x, const double y)
+{
+	const int x0 = (int) x, y0 = (int) y;
+	const double fx = x - x0, fy = y - y0;
+	const double sx = fx * fx * (3 - 2 * fx), sy = fy * fy * (3 - 2 * fy);
+	auto at = [&](const int i, const int j) {
+		return lattice[(j % latticeSize) * latticeSize + (i % latticeSize)];
+	};
+	const double top = at(x0, y0) + sx * (at(x0 + 1, y0) - at(x0, y0));
+	const double bottom = at(x0, y0 + 1) + sx * (at(x0 + 1, y0 + 1) - at(x0, y0 + 1));
+	return top + sy * (bottom - top);
+}
+
+// Fills pixels with one of the synthetic test images, the same kind and size always give the same pixels
+void MakeImage(const string& kind, const UINT width, const UINT height, vector<ARGB>& pixels)
+{
+	pixels.resize(width * height);
+	mt19937 rng(0x6E51756E);
+	uniform_int_distribution<int> byteDist(0, BYTE_MAX);
+
+	if (kind == "gradient") {
+		for (UINT y = 0; y < height; ++y) {
+			for (UINT x = 0; x < width; ++x) {
+				const double u = (double) x / width, v = (double) y / height;
+				pixels[y * width + x] = Color::MakeARGB(BYTE_MAX, Clamp(u * 255), Clamp(v * 255), Clamp((1 - (u + v) / 2) * 255));
+			}
+		}
+	}
+	else if (kind == "noise") {
+		for (auto& pixel : pixels)
+			pixel = Color::MakeARGB(BYTE_MAX, byteDist(rng), byteDist(rng), byteDist(rng));
+	}
+	else if (kind == "photo") {
+		// a few octaves of value noise, tinted and lit from one corner, with a little grain on top
+		const int latticeSize = 64;
+		vector<double> lattice(latticeSize * latticeSize);
+		uniform_real_distribution<double> unitDist(0.0, 1.0);
+		for (auto& value : lattice)
+			value = unitDist(rng);
+
+		normal_distribution<double> grainDist(0.0, 4.0);
+		for (UINT y = 0; y < height; ++y) {
+			for (UINT x = 0; x < width; ++x) {
+				double texture = 0, amplitude = 0.5, frequency = 1.0 / 32;
+				for (int octave = 0; octave < 4; ++octave) {
+					texture += amplitude * ValueNoise(lattice, latticeSize, x * frequency, y * frequency);
+					amplitude /= 2;
+					frequency *= 2;
+				}
+				const double light = 0.55 + 0.45 * (1 - (double) (x + y) / (width + height));
+				const double grain = grainDist(rng);
+				pixels[y * width + x] = Color::MakeARGB(BYTE_MAX, Clamp((90 + 150 * texture) * light + grain),
+					Clamp((60 + 130 * texture * texture) * light + grain), Clamp((40 + 90 * (1 - texture)) * light + grain));
+			}
+		}
+	}
+	else if (kind == "flat") {
+		// a window with a title bar, buttons and a text-like pattern in a dozen flat colours
+		const ARGB swatches[] = { 0xFFF3F3F3, 0xFF2B579A, 0xFFFFFFFF, 0xFF1E1E1E, 0xFF0078D7, 0xFFE81123,
+			0xFF107C10, 0xFFFFB900, 0xFFCCCCCC, 0xFF5C2D91, 0xFF767676, 0xFF00B7C3 };
+		const UINT barHeight = max(height / 10, 1U);
+		for (UINT y = 0; y < height; ++y) {
+			for (UINT x = 0; x < width; ++x) {
+				ARGB pixel = swatches[0];
+				if (y < barHeight)
+					pixel = swatches[1];
+				else if (x % 64 < 56 && y % 48 >= 8 && y % 48 < 28 && (x / 64 + y / 48) % 3 == 0)
+					pixel = swatches[4 + (x / 64 + 2 * (y / 48)) % 8];
+				else if (y % 12 < 2 && x % 64 > 4 && (x * 7 + y) % 23 < 15)
+					pixel = swatches[3];
+				else if (x % 64 == 0 || y % 48 == 0)
+					pixel = swatches[8];
+				else if (x > width / 2 && y > height / 2)
+					pixel = swatches[2];
+				pixels[y * width + x] = pixel;
+			}
+		}
+	}
+	else if (kind == "sprite") {
+		// shaded discs on a transparent background with anti-aliased and translucent edges
+		fill(pixels.begin(), pixels.end(), (ARGB) Color::Transparent);
+		uniform_real_distribution<double> posDist(0.0, 1.0);
+		for (int disc = 0; disc < 12; ++disc) {
+			const double cx = posDist(rng) * width, cy = posDist(rng) * height;
+			const double radius = (0.05 + 0.15 * posDist(rng)) * min(width, height);
+			const BYTE r = byteDist(rng), g = byteDist(rng), b = byteDist(rng);
+			const double opacity = disc % 3 == 0 ? 0.6 : 1.0;
+			for (UINT y = 0; y < height; ++y) {
+				for (UINT x = 0; x < width; ++x) {
+					const double dist = sqrt((x - cx) * (x - cx) + (y - cy) * (y - cy));
+					const double coverage = min(max(radius - dist, 0.0), 1.0) * opacity;
+					if (coverage <= 0)
+						continue;
+
+					const double shade = 1 - 0.5 * dist / radius;
+					Color under(pixels[y * width + x]);
+					const double a = coverage + under.GetA() / 255.0 * (1 - coverage);
+					auto blend = [&](const BYTE top, const BYTE bottom) {
+						return Clamp((top * shade * coverage + bottom * under.GetA() / 255.0 * (1 - coverage)) / a);
+					};
+					pixels[y * width + x] = Color::MakeARGB(Clamp(a * 255), blend(r, under.GetR()), blend(g, under.GetG()), blend(b, under.GetB()));
+				}
+			}
+		}
+	}
+}
+
+template <class Quantizer>
+inline void SetSeed(Quantizer& quantizer, const unsigned long long seed)
+{
+	quantizer.SetSeed(seed);
+}
+
+// DivQuantizer draws no random numbers, there is no seed to pin
+inline void SetSeed(DivQuant::DivQuantizer& quantizer, const unsigned long long seed)
+{
+}
+
+template <class Quantizer>
+inline void SetClosestCacheSize(Quantizer& quantizer, const size_t nEntries)
+{
+	quantizer.SetClosestCacheSize(nEntries);
+}
+
+// these map without the two candidate closest colour cache
+inline void SetClosestCacheSize(NeuralNet::NeuQuantizer& quantizer, const size_t nEntries)
+{
+}
+
+inline void SetClosestCacheSize(EdgeAwareSQuant::EdgeAwareSQuantizer& quantizer, const size_t nEntries)
+{
+}
+
+inline void SetClosestCacheSize(SpatialQuant::SpatialQuantizer& quantizer, const size_t nEntries)
+{
+}
+
+inline void SetClosestCacheSize(DivQuant::DivQuantizer& quantizer, const size_t nEntries)
+{
+}
+
+template <class Quantizer>
+inline void SetRemapThreads(Quantizer& quantizer, const UINT nThreads)
+{
+	quantizer.SetRemapThreads(nThreads);
+}
+
+// EAS and SPA map the pixels in their own loops
+inline void SetRemapThreads(EdgeAwareSQuant::EdgeAwareSQuantizer& quantizer, const UINT nThreads)
+{
+}
+
+inline void SetRemapThreads(SpatialQuant::SpatialQuantizer& quantizer, const UINT nThreads)
+{
+}
+
+template <class Quantizer>
+inline void SetNearestMap(Quantizer& quantizer, const bool enabled)
+{
+	quantizer.SetNearestMap(enabled);
+}
+
+// WU maps through its closest colour search, EAS and SPA in their own loops
+inline void SetNearestMap(nQuant::WuQuantizer& quantizer, const bool enabled)
+{
+}
+
+inline void SetNearestMap(EdgeAwareSQuant::EdgeAwareSQuantizer& quantizer, const bool enabled)
+{
+}
+
+inline void SetNearestMap(SpatialQuant::SpatialQuantizer& quantizer, const bool enabled)
+{
+}
+
+template <class Quantizer>
+inline void SetDitherLookup(Quantizer& quantizer, const DitherLookup& lookup)
+{
+	quantizer.SetDitherLookup(lookup);
+}
+
+// EAS and SPA dither in their own loops, without a lookup table
+inline void SetDitherLookup(EdgeAwareSQuant::EdgeAwareSQuantizer& quantizer, const DitherLookup& lookup)
+{
+}
+
+inline void SetDitherLookup(SpatialQuant::SpatialQuantizer& quantizer, const DitherLookup& lookup)
+{
+}
+
+template <class Quantizer>
+QuantizeFn MakeQuantizeFn()
+{
+	return [](const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, QuantizeStats* pStats, const unsigned long long seed, const DitherLookup& lookup, const size_t closestCacheSize, const UINT remapThreads, const bool nearestMap) {
+		Quantizer quantizer;
+		quantizer.SetStats(pStats);
+		SetSeed(quantizer, seed);
+		SetDitherLookup(quantizer, lookup);
+		SetClosestCacheSize(quantizer, closestCacheSize);
+		SetRemapThreads(quantizer, remapThreads);
+		SetNearestMap(quantizer, nearestMap);
+		return quantizer.QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	};
+}
+
+QuantizeFn GetQuantizeFn(const string& algo)
+{
+	if (algo == "PNN")
+		return MakeQuantizeFn<PnnQuant::PnnQuantizer>();
+	if (algo == "PNNLAB")
+		return MakeQuantizeFn<PnnLABQuant::PnnLABQuantizer>();
+	if (algo == "NEU")
+		return MakeQuantizeFn<NeuralNet::NeuQuantizer>();
+	if (algo == "WU")
+		return MakeQuantizeFn<nQuant::WuQuantizer>();
+	if (algo == "EAS")
+		return MakeQuantizeFn<EdgeAwareSQuant::EdgeAwareSQuantizer>();
+	if (algo == "SPA")
+		return MakeQuantizeFn<SpatialQuant::SpatialQuantizer>();
+	if (algo == "DIV")
+		return MakeQuantizeFn<DivQuant::DivQuantizer>();
+	if (algo == "MODE")
+		return MakeQuantizeFn<MoDEQuant::MoDEQuantizer>();
+	if (algo == "MMC")
+		return MakeQuantizeFn<MedianCutQuant::MedianCut>();
+	return MakeQuantizeFn<Dl3Quant::Dl3Quantizer>();
+}
+
+// Only these quantizers read SourceImage::histogram, the others walk the pixels themselves
+inline bool UsesHistogram(const string& algo)
+{
+	return algo == "PNN" || algo == "DL3";
+}
+
+struct BenchResult
+{
+	double grabMs = 0.0, histogramMs = 0.0, paletteMs = 0.0, remapMs = 0.0, packMs = 0.0;
+	UINT paletteSize = 0;
+	QuantizeStats stats;
+
+	double TotalMs() const { return grabMs + histogramMs + paletteMs + remapMs + packMs; }
+};
+
+double ElapsedMs(const chrono::steady_clock::time_point& start)
+{
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+bool RunOnce(const string& algo, const vector<ARGB>& image, const UINT width, const UINT height, const UINT nColors, const bool dither, const unsigned long long seed, const DitherLookup& lookup, const size_t closestCacheSize, const UINT remapThreads, const bool nearestMap, BenchResult& result)
+{
+	auto start = chrono::steady_clock::now();
+	SourceImage source;
+	if (!GrabPixels(image.data(), width, height, width * sizeof(ARGB), source))
+		return false;
+	result.grabMs = ElapsedMs(start);
+
+	if (UsesHistogram(algo)) {
+		start = chrono::steady_clock::now();
+		FillHistogram(source);
+		result.histogramMs = ElapsedMs(start);
+	}
+
+	UINT nMaxColors = nColors;
+	auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + max(nMaxColors, 256U) * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) pPaletteBytes.get();
+	pPalette->Count = nMaxColors;
+	auto qPixels = make_unique<unsigned short[]>(width * height);
+
+	QuantizeStats stats;
+	if (!GetQuantizeFn(algo)(source, pPalette, qPixels.get(), nMaxColors, dither, &stats, seed, lookup, closestCacheSize, remapThreads, nearestMap))
+		return false;
+	result.paletteMs = stats.paletteMs;
+	result.remapMs = stats.remapMs;
+	result.stats = stats;
+	result.paletteSize = nMaxColors;
+
+	// the same target formats ProcessImagePixels picks for a bitmap of that many colours
+	UINT bpp = 32;
+	bool isARGB1555 = false;
+	if (nMaxColors <= 2)
+		bpp = 1;
+	else if (nMaxColors <= 16)
+		bpp = 4;
+	else if (nMaxColors <= 256)
+		bpp = 8;
+	else if (!source.hasSemiTransparency) {
+		bpp = 16;
+		isARGB1555 = source.transparentPixelIndex >= 0;
+	}
+
+	start = chrono::steady_clock::now();
+	const int strideDest = ((width * bpp + 31) & ~31) / 8;
+	vector<BYTE> packed(strideDest * height);
+	PackPixels(packed.data(), strideDest, width, height, bpp, pPalette, qPixels.get(), isARGB1555);
+	result.packMs = ElapsedMs(start);
+	return true;
+}
+
+// the scan the quantizers did before PaletteTree, the reference it is timed and checked against
+unsigned short LinearNearest(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+{
+	unsigned short k = 0;
+	Color c(argb);
+
+	double mindist = INT_MAX;
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c2(pPalette->Entries[i]);
+		double curdist = sqr(c2.GetA() - c.GetA());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetR() - c.GetR());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetG() - c.GetG());
+		if (curdist > mindist)
+			continue;
+
+		curdist += sqr(c2.GetB() - c.GetB());
+		if (curdist > mindist)
+			continue;
+
+		mindist = curdist;
+		k = i;
+	}
+	return k;
+}
+
+// the palette and indices a run gives, what the concurrency check compares
+struct QuantizeOutput
+{
+	vector<ARGB> palette;
+	vector<unsigned short> qPixels;
+	bool ok = false;
+
+	bool operator==(const QuantizeOutput& other) const { return ok == other.ok && palette == other.palette && qPixels == other.qPixels; }
+};
+
+void QuantizeOnce(const string& algo, const vector<ARGB>& image, const UINT width, const UINT height, const UINT nColors, const bool dither, const unsigned long long seed, const DitherLookup& lookup, const size_t closestCacheSize, const UINT remapThreads, const bool nearestMap, QuantizeOutput& output)
+{
+	output.ok = false;
+	SourceImage source;
+	if (!GrabPixels(image.data(), width, height, width * sizeof(ARGB), source))
+		return;
+	if (UsesHistogram(algo))
+		FillHistogram(source);
+
+	UINT nMaxColors = nColors;
+	auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + max(nMaxColors, 256U) * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) pPaletteBytes.get();
+	pPalette->Count = nMaxColors;
+	output.qPixels.assign((size_t) width * height, 0);
+	if (!GetQuantizeFn(algo)(source, pPalette, output.qPixels.data(), nMaxColors, dither, nullptr, seed, lookup, closestCacheSize, remapThreads, nearestMap))
+		return;
+	output.palette.assign(pPalette->Entries, pPalette->Entries + nMaxColors);
+	output.ok = true;
+}
+
+struct CheckJob
+{
+	string kind, algo;
+	UINT nColors;
+	bool dither;
+	QuantizeOutput reference;
+	atomic<UINT> mismatches;
+};
+
+// runs each job alone and then repeats copies of all of them at once on nThreads threads, returns the number of
+// the runs at once whose output differs from that of the job alone
+UINT CheckConcurrency(vector<unique_ptr<CheckJob> >& jobs, const map<string, vector<ARGB> >& images, const UINT width, const UINT height, const UINT repeats, const UINT nThreads, const unsigned long long seed, const DitherLookup& lookup, const size_t closestCacheSize, const UINT remapThreads, const bool nearestMap)
+{
+	for (auto& job : jobs) {
+		cerr << job->kind << " " << job->algo << " " << job->nColors << (job->dither ? " dither" : "") << endl;
+		QuantizeOnce(job->algo, images.at(job->kind), width, height, job->nColors, job->dither, seed, lookup, closestCacheSize, remapThreads, nearestMap, job->reference);
+		job->mismatches = 0;
+	}
+
+	cerr << jobs.size() * repeats << " runs on " << nThreads << " threads" << endl;
+	atomic<UINT> mismatches(0);
+	ParallelFor(jobs.size() * repeats, nThreads, [&](size_t i) {
+		// the copies of a job are spread apart, so that each thread mixes the algorithms
+		auto& job = *jobs[i % jobs.size()];
+		QuantizeOutput output;
+		QuantizeOnce(job.algo, images.at(job.kind), width, height, job.nColors, job.dither, seed, lookup, closestCacheSize, remapThreads, nearestMap, output);
+		if (!(output == job.reference)) {
+			++job.mismatches;
+			++mismatches;
+		}
+	});
+	return mismatches;
+}
+
+struct LookupResult
+{
+	double linearMs = 0.0, scanMs = 0.0, treeMs = 0.0, buildMs = 0.0, mapMs = 0.0, mapBuildMs = 0.0;
+	UINT mismatches = 0;
+};
+
+// looks up every pixel of the image in a palette of nColors pixels picked across it
+void RunLookups(const vector<ARGB>& image, const UINT nColors, LookupResult& result)
+{
+	auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nColors * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) pPaletteBytes.get();
+	pPalette->Count = nColors;
+	for (UINT i = 0; i < nColors; ++i)
+		pPalette->Entries[i] = image[(size_t) i * image.size() / nColors];
+
+	vector<unsigned short> linear(image.size()), scanned(image.size()), nearest(image.size()), mapped(image.size());
+	auto start = chrono::steady_clock::now();
+	for (size_t i = 0; i < image.size(); ++i)
+		linear[i] = LinearNearest(pPalette, nColors, image[i]);
+	result.linearMs = ElapsedMs(start);
+
+	start = chrono::steady_clock::now();
+	PaletteScan scan;
+	scan.Build(pPalette, nColors);
+	for (size_t i = 0; i < image.size(); ++i)
+		scanned[i] = scan.Nearest(image[i]);
+	result.scanMs = ElapsedMs(start);
+
+	start = chrono::steady_clock::now();
+	PaletteTree tree;
+	tree.Build(pPalette, nColors);
+	result.buildMs = ElapsedMs(start);
+	for (size_t i = 0; i < image.size(); ++i)
+		nearest[i] = tree.Nearest(image[i]);
+	result.treeMs = ElapsedMs(start);
+
+	// each pixel starts from the match of the one before, as in the remap
+	start = chrono::steady_clock::now();
+	NearestMap map;
+	map.Build(pPalette, nColors);
+	result.mapBuildMs = ElapsedMs(start);
+	MatchPixels(map, pPalette, nColors, image.data(), image.size(), mapped.data());
+	result.mapMs = ElapsedMs(start);
+
+	result.mismatches = 0;
+	for (size_t i = 0; i < image.size(); ++i) {
+		if (linear[i] != scanned[i] || linear[i] != nearest[i] || linear[i] != mapped[i])
+			++result.mismatches;
+	}
+}
+
+bool ProcessArgs(int argc, char** argv, vector<string>& algos, vector<string>& images, vector<UINT>& colors,
+	vector<bool>& dithers, UINT& width, UINT& height, UINT& repeats, unsigned long long& seed, DitherLookup& ditherLookup, size_t& closestCacheSize, UINT& remapThreads, bool& nearestMap, bool& lookups, UINT& checkThreads, string& outputPath, bool& pickedAlgos)
+{
+	for (int index = 1; index < argc; ++index) {
+		const string currentArg = ToUpper(argv[index]);
+		if (currentArg.length() != 2 || (currentArg[0] != '-' && currentArg[0] != '/') || index >= argc - 1) {
+			PrintUsage();
+			return false;
+		}
+
+		const string value = argv[++index];
+		switch (currentArg[1]) {
+			case 'A':
+				algos = Split(ToUpper(value));
+				pickedAlgos = true;
+				for (const auto& algo : algos) {
+					if (find(algs.begin(), algs.end(), algo) == algs.end()) {
+						PrintUsage();
+						return false;
+					}
+				}
+				break;
+			case 'I':
+				images = Split(value);
+				for (const auto& image : images) {
+					if (find(imageKinds.begin(), imageKinds.end(), image) == imageKinds.end()) {
+						PrintUsage();
+						return false;
+					}
+				}
+				break;
+			case 'M':
+				colors.clear();
+				for (const auto& token : Split(value)) {
+					const int nColors = atoi(token.c_str());
+					colors.emplace_back(min(max(nColors, 2), 65536));
+				}
+				break;
+			case 'D':
+				if (ToUpper(value) == "Y")
+					dithers = { true };
+				else if (ToUpper(value) == "N")
+					dithers = { false };
+				else
+					dithers = { true, false };
+				break;
+			case 'S':
+				if (sscanf(value.c_str(), "%ux%u", &width, &height) != 2 || width < 1 || height < 1) {
+					PrintUsage();
+					return false;
+				}
+				break;
+			case 'R':
+				repeats = max(atoi(value.c_str()), 1);
+				break;
+			case 'X':
+				seed = strtoull(value.c_str(), nullptr, 10);
+				break;
+			case 'L':
+				ditherLookup.eager = true;
+				ditherLookup.extraBits = min(max(atoi(value.c_str()), 0), 2);
+				break;
+			case 'W':
+				ditherLookup.wavefront = true;
+				ditherLookup.nThreads = max(atoi(value.c_str()), 0);
+				break;
+			case 'G':
+				if (sscanf(value.c_str(), "%u,%u", &ditherLookup.tileSize, &ditherLookup.tileOverlap) < 1 || ditherLookup.tileSize < 1) {
+					PrintUsage();
+					return false;
+				}
+				break;
+			case 'T':
+				if (ToUpper(value) == "BAYER")
+					ditherLookup.pattern = DitherPattern::Bayer;
+				else if (ToUpper(value) == "BLUE")
+					ditherLookup.pattern = DitherPattern::BlueNoise;
+				else if (ToUpper(value) == "DIFFUSION")
+					ditherLookup.pattern = DitherPattern::Diffusion;
+				else {
+					PrintUsage();
+					return false;
+				}
+				break;
+			case 'Z':
+				closestCacheSize = strtoull(value.c_str(), nullptr, 10);
+				break;
+			case 'P':
+				remapThreads = max(atoi(value.c_str()), 0);
+				break;
+			case 'N':
+				nearestMap = ToUpper(value) == "Y";
+				break;
+			case 'K':
+				lookups = ToUpper(value) == "Y";
+				break;
+			case 'C':
+				checkThreads = max(atoi(value.c_str()), 1);
+				break;
+			case 'O':
+				outputPath = value;
+				break;
+			default:
+				PrintUsage();
+				return false;
+		}
+	}
+	return !algos.empty() && !images.empty() && !colors.empty();
+}
+
+int main(int argc, char** argv)
+{
+	vector<string> algos = algs, images = imageKinds;
+	vector<UINT> colors = defaultColors;
+	vector<bool> dithers = { true, false };
+	UINT width = 256, height = 256, repeats = 3;
+	unsigned long long seed = 1;
+	DitherLookup ditherLookup;
+	size_t closestCacheSize = 0;
+	UINT remapThreads = 1;
+	bool nearestMap = false, lookups = false;
+	UINT checkThreads = 0;
+	string outputPath;
+	bool pickedAlgos = false;
+	if (!ProcessArgs(argc, argv, algos, images, colors, dithers, width, height, repeats, seed, ditherLookup, closestCacheSize, remapThreads, nearestMap, lookups, checkThreads, outputPath, pickedAlgos))
+		return 1;
+
+	auto skipped = [&](const string& algo, const UINT nColors) {
+		return !pickedAlgos && nColors > slowMaxColors && find(slowAlgs.begin(), slowAlgs.end(), algo) != slowAlgs.end();
+	};
+
+	ofstream outputFile;
+	if (!outputPath.empty()) {
+		outputFile.open(outputPath);
+		if (!outputFile) {
+			cerr << "Cannot write " << outputPath << endl;
+			return 1;
+		}
+	}
+	// MODE prints its progress to cout, which joins the other progress on stderr so that stdout only holds the JSON
+	ostream standardOutput(cout.rdbuf());
+	cout.rdbuf(cerr.rdbuf());
+	ostream& out = outputPath.empty() ? standardOutput : outputFile;
+
+	const double megapixels = (double) width * height / 1e6;
+	out << "{" << endl;
+	out << "  \"width\": " << width << ", \"height\": " << height << ", \"repeats\": " << repeats << ", \"seed\": " << seed;
+	if (ditherLookup.eager)
+		out << ", \"eager_lookup_bits\": " << ditherLookup.extraBits;
+	if (ditherLookup.wavefront)
+		out << ", \"wavefront_threads\": " << ditherLookup.nThreads;
+	if (ditherLookup.tileSize)
+		out << ", \"tile_size\": " << ditherLookup.tileSize << ", \"tile_overlap\": " << ditherLookup.tileOverlap;
+	if (ditherLookup.pattern != DitherPattern::Diffusion)
+		out << ", \"dither_pattern\": \"" << (ditherLookup.pattern == DitherPattern::Bayer ? "bayer" : "blue") << "\"";
+	if (closestCacheSize > 0)
+		out << ", \"closest_cache_size\": " << closestCacheSize;
+	if (remapThreads != 1)
+		out << ", \"remap_threads\": " << remapThreads;
+	if (nearestMap)
+		out << ", \"nearest_map\": true";
+	if (lookups)
+		out << ", \"kernel\": \"" << PaletteScan::KernelName() << "\"";
+	if (checkThreads)
+		out << ", \"check_threads\": " << checkThreads;
+	out << "," << endl;
+	out << "  \"results\": [";
+
+	if (checkThreads) {
+		map<string, vector<ARGB> > checkImages;
+		vector<unique_ptr<CheckJob> > jobs;
+		for (const auto& kind : images) {
+			MakeImage(kind, width, height, checkImages[kind]);
+			for (const auto& algo : algos) {
+				for (const auto nColors : colors) {
+					if (skipped(algo, nColors))
+						continue;
+					for (const auto dither : dithers)
+						jobs.emplace_back(new CheckJob{ kind, algo, nColors, dither, QuantizeOutput(), {} });
+				}
+			}
+		}
+
+		const UINT mismatches = CheckConcurrency(jobs, checkImages, width, height, repeats, checkThreads, seed, ditherLookup, closestCacheSize, remapThreads, nearestMap);
+		bool allOk = true;
+		for (size_t i = 0; i < jobs.size(); ++i) {
+			const auto& job = *jobs[i];
+			allOk = allOk && job.reference.ok;
+			out << (i ? "," : "") << endl;
+			out << "    { \"image\": \"" << job.kind << "\", \"algorithm\": \"" << job.algo << "\", \"colors\": " << job.nColors
+				<< ", \"dither\": " << (job.dither ? "true" : "false") << ", \"ok\": " << (job.reference.ok ? "true" : "false")
+				<< ", \"runs\": " << repeats << ", \"mismatches\": " << job.mismatches << " }";
+		}
+		out << endl << "  ]," << endl << "  \"mismatches\": " << mismatches << endl << "}" << endl;
+		return mismatches ? 2 : (allOk ? 0 : 1);
+	}
+
+	bool first = true;
+	vector<ARGB> image;
+	for (const auto& kind : images) {
+		MakeImage(kind, width, height, image);
+		if (lookups) {
+			for (const auto nColors : colors) {
+				cerr << kind << " lookups " << nColors << endl;
+				LookupResult best;
+				for (UINT run = 0; run < repeats; ++run) {
+					LookupResult result;
+					RunLookups(image, nColors, result);
+					if (run == 0 || result.linearMs + result.scanMs + result.treeMs + result.mapMs < best.linearMs + best.scanMs + best.treeMs + best.mapMs)
+						best = result;
+				}
+
+				out << (first ? "" : ",") << endl;
+				first = false;
+				out << "    { \"image\": \"" << kind << "\", \"colors\": " << nColors
+					<< ", \"linear_ms\": " << best.linearMs << ", \"scan_ms\": " << best.scanMs << ", \"tree_ms\": " << best.treeMs
+					<< ", \"tree_build_ms\": " << best.buildMs << ", \"map_ms\": " << best.mapMs << ", \"map_build_ms\": " << best.mapBuildMs
+					<< ", \"scan_speedup\": " << (best.scanMs > 0 ? best.linearMs / best.scanMs : 0.0)
+					<< ", \"tree_speedup\": " << (best.treeMs > 0 ? best.linearMs / best.treeMs : 0.0)
+					<< ", \"map_speedup\": " << (best.mapMs > 0 ? best.linearMs / best.mapMs : 0.0)
+					<< ", \"mismatches\": " << best.mismatches << " }";
+				out.flush();
+			}
+			continue;
+		}
+
+		for (const auto& algo : algos) {
+			for (const auto nColors : colors) {
+				if (skipped(algo, nColors)) {
+					cerr << kind << " " << algo << " " << nColors << " skipped, name " << algo << " with /a to run it" << endl;
+					continue;
+				}
+				for (const auto dither : dithers) {
+					cerr << kind << " " << algo << " " << nColors << (dither ? " dither" : "") << endl;
+					BenchResult best;
+					bool ok = false;
+					for (UINT run = 0; run < repeats; ++run) {
+						BenchResult result;
+						if (!RunOnce(algo, image, width, height, nColors, dither, seed, ditherLookup, closestCacheSize, remapThreads, nearestMap, result))
+							break;
+						if (!ok || result.TotalMs() < best.TotalMs())
+							best = result;
+						ok = true;
+					}
+
+					out << (first ? "" : ",") << endl;
+					first = false;
+					out << "    { \"image\": \"" << kind << "\", \"algorithm\": \"" << algo << "\", \"colors\": " << nColors
+						<< ", \"dither\": " << (dither ? "true" : "false") << ", \"ok\": " << (ok ? "true" : "false");
+					if (ok) {
+						out << ", \"palette_size\": " << best.paletteSize
+							<< ", \"grab_ms\": " << best.grabMs << ", \"histogram_ms\": " << best.histogramMs
+							<< ", \"palette_ms\": " << best.paletteMs << ", \"remap_ms\": " << best.remapMs
+							<< ", \"pack_ms\": " << best.packMs << ", \"total_ms\": " << best.TotalMs()
+							<< ", \"mpixels_per_sec\": " << (best.TotalMs() > 0 ? megapixels * 1000 / best.TotalMs() : 0.0)
+							<< ", \"unique_colors\": " << best.stats.uniqueColors << ", \"nn_searches\": " << best.stats.nnSearches
+							<< ", \"merges\": " << best.stats.merges << ", \"closest_hits\": " << best.stats.closestHits
+							<< ", \"closest_misses\": " << best.stats.closestMisses
+							<< ", \"closest_hit_rate\": " << (best.stats.closestHits + best.stats.closestMisses > 0 ? (double) best.stats.closestHits / (best.stats.closestHits + best.stats.closestMisses) : 0.0)
+							<< ", \"dither_hits\": " << best.stats.ditherHits
+							<< ", \"dither_fills\": " << best.stats.ditherFills << ", \"iterations\": " << best.stats.iterations
+							<< ", \"levels\": " << best.stats.levels << ", \"dither_threads\": " << best.stats.ditherThreads;
+					}
+					out << " }";
+					out.flush();
+				}
+			}
+		}
+	}
+	out << endl << "  ]" << endl << "}" << endl;
+	return 0;
+}
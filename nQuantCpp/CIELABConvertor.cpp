@@ -3,33 +3,72 @@
 
 #define _USE_MATH_DEFINES
 #include <math.h>
+#include <cstring>
 
 #ifdef _DEBUG
 #define new DEBUG_NEW
 #endif	
 	
-void CIELABConvertor::RGB2LAB(const Color& c1, Lab& lab)
+// sRGB companding undone for each 8 bit channel value, as pow gives it
+static const struct LinearTable
 {
-	double r = c1.GetR() / 255.0, g = c1.GetG() / 255.0, b = c1.GetB() / 255.0;
-	double x, y, z;
+	double values[256];
+
+	LinearTable() {
+		for (int i = 0; i < 256; ++i) {
+			const double v = i / 255.0;
+			values[i] = (v > 0.04045) ? pow((v + 0.055) / 1.055, 2.4) : v / 12.92;
+		}
+	}
+} linearTable;
+
+// cube root of the XYZ ratios above the 0.008856 knee, a guess from the exponent bits
+// refined twice by Halley and once by Newton to within a few ulp of cbrt
+static inline double fast_cbrt(const double x)
+{
+	unsigned long long bits;
+	memcpy(&bits, &x, sizeof(bits));
+	bits = bits / 3 + 0x2A9F7893782DA1CEull;
+	double y;
+	memcpy(&y, &bits, sizeof(y));
 
-	r = (r > 0.04045) ? pow((r + 0.055) / 1.055, 2.4) : r / 12.92;
-	g = (g > 0.04045) ? pow((g + 0.055) / 1.055, 2.4) : g / 12.92;
-	b = (b > 0.04045) ? pow((b + 0.055) / 1.055, 2.4) : b / 12.92;
+	double y3 = y * y * y;
+	y *= (y3 + 2 * x) / (2 * y3 + x);
+	y3 = y * y * y;
+	y *= (y3 + 2 * x) / (2 * y3 + x);
+	return y - (y * y * y - x) / (3 * y * y);
+}
+
+static inline void ToLab(const Color& c1, CIELABConvertor::Lab& lab)
+{
+	const double* linear = linearTable.values;
+	const double r = linear[c1.GetR()], g = linear[c1.GetG()], b = linear[c1.GetB()];
+	double x, y, z;
 
 	x = (r * 0.4124 + g * 0.3576 + b * 0.1805) / 0.95047;
 	y = (r * 0.2126 + g * 0.7152 + b * 0.0722) / 1.00000;
 	z = (r * 0.0193 + g * 0.1192 + b * 0.9505) / 1.08883;
 
-	x = (x > 0.008856) ? cbrt(x) : (7.787 * x) + 16.0 / 116.0;
-	y = (y > 0.008856) ? cbrt(y) : (7.787 * y) + 16.0 / 116.0;
-	z = (z > 0.008856) ? cbrt(z) : (7.787 * z) + 16.0 / 116.0;
+	x = (x > 0.008856) ? fast_cbrt(x) : (7.787 * x) + 16.0 / 116.0;
+	y = (y > 0.008856) ? fast_cbrt(y) : (7.787 * y) + 16.0 / 116.0;
+	z = (z > 0.008856) ? fast_cbrt(z) : (7.787 * z) + 16.0 / 116.0;
 
 	lab.alpha = c1.GetA();
 	lab.L = (116 * y) - 16;
 	lab.A = 500 * (x - y);
 	lab.B = 200 * (y - z);
 }
+
+void CIELABConvertor::RGB2LAB(const Color& c1, Lab& lab)
+{
+	ToLab(c1, lab);
+}
+
+void CIELABConvertor::RGB2LAB(const ARGB* pixels, const UINT count, Lab* labs)
+{
+	for (UINT i = 0; i < count; ++i)
+		ToLab(Color(pixels[i]), labs[i]);
+}
 	
 ARGB CIELABConvertor::LAB2RGB(const Lab& lab){
 	double y = (lab.L + 16) / 116;
@@ -71,23 +110,25 @@ double CIELABConvertor::L_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2)
 	const double k_L = 1.0;
 	double deltaLPrime = lab2.L - lab1.L;	
 	double barLPrime = (lab1.L + lab2.L) / 2.0;
-	double S_L = 1 + ((0.015 * pow(barLPrime - 50.0, 2.0)) / _sqrt(20 + pow(barLPrime - 50.0, 2.0)));
+	const double barLPrimeSqr = pow(barLPrime - 50.0, 2.0);
+	double S_L = 1 + ((0.015 * barLPrimeSqr) / _sqrt(20 + barLPrimeSqr));
 	return deltaLPrime / (k_L * S_L);
 }
 
-double CIELABConvertor::C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
+// the chroma terms of a pair from the chroma and B squared of each colour
+static inline double C_prime_div(const double A1, const double C1, const double B1Sqr, const double A2, const double C2, const double B2Sqr,
+	double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
 {
 	const double k_C = 1.0;
 	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
-	double C1 = _sqrt((lab1.A * lab1.A) + (lab1.B * lab1.B));
-	double C2 = _sqrt((lab2.A * lab2.A) + (lab2.B * lab2.B));
 	double barC = (C1 + C2) / 2.0;
-	double G = 0.5 * (1 - _sqrt(pow(barC, 7) / (pow(barC, 7) + pow25To7)));
-	a1Prime = (1.0 + G) * lab1.A;
-	a2Prime = (1.0 + G) * lab2.A;
+	const double barCPow7 = pow(barC, 7);
+	double G = 0.5 * (1 - _sqrt(barCPow7 / (barCPow7 + pow25To7)));
+	a1Prime = (1.0 + G) * A1;
+	a2Prime = (1.0 + G) * A2;
 
-	CPrime1 = _sqrt((a1Prime * a1Prime) + (lab1.B * lab1.B));
-	CPrime2 = _sqrt((a2Prime * a2Prime) + (lab2.B * lab2.B));
+	CPrime1 = _sqrt((a1Prime * a1Prime) + B1Sqr);
+	CPrime2 = _sqrt((a2Prime * a2Prime) + B2Sqr);
 	double deltaCPrime = CPrime2 - CPrime1;
 	double barCPrime = (CPrime1 + CPrime2) / 2.0;
 	
@@ -95,6 +136,18 @@ double CIELABConvertor::C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, do
 	return deltaCPrime / (k_C * S_C);
 }
 
+double CIELABConvertor::C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
+{
+	double C1 = _sqrt((lab1.A * lab1.A) + (lab1.B * lab1.B));
+	double C2 = _sqrt((lab2.A * lab2.A) + (lab2.B * lab2.B));
+	return C_prime_div(lab1.A, C1, lab1.B * lab1.B, lab2.A, C2, lab2.B * lab2.B, a1Prime, a2Prime, CPrime1, CPrime2);
+}
+
+double CIELABConvertor::C_prime_div_k_L_S_L(const PreparedLab& lab1, const PreparedLab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2)
+{
+	return C_prime_div(lab1.lab.A, lab1.C, lab1.BSqr, lab2.lab.A, lab2.C, lab2.BSqr, a1Prime, a2Prime, CPrime1, CPrime2);
+}
+
 double CIELABConvertor::H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2, double& barCPrime, double& barhPrime)
 {
 	const double k_H = 1.0;
@@ -162,11 +215,30 @@ double CIELABConvertor::H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, co
 	return deltaHPrime / (k_H * S_H);
 }
 
+double CIELABConvertor::H_prime_sqr_lower_bound(const PreparedLab& lab1, const PreparedLab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2)
+{
+	// 4 C'1 C'2 sin^2(dh'/2) is 2 (C'1 C'2 - a'1 a'2 - b1 b2), and T is at most 1 + 0.17 + 0.24 + 0.32 + 0.20,
+	// the margins keep the bound under what H_prime_div_k_L_S_L rounds to for close hue angles
+	double deltaHPrimeSqr = 2.0 * ((CPrime1 * CPrime2) - (a1Prime * a2Prime) - (lab1.lab.B * lab2.lab.B));
+	double S_H = 1 + (0.015 * ((CPrime1 + CPrime2) / 2.0) * 1.93);
+	return deltaHPrimeSqr / (S_H * S_H) * (1 - 1e-9) - 1e-6;
+}
+
+double CIELABConvertor::CH_prime_sqr_lower_bound(const PreparedLab& lab1, const PreparedLab& lab2)
+{
+	// dC'^2 + dH'^2 is (a'2 - a'1)^2 + (b2 - b1)^2, no less than with G at 0, and S_H never exceeds S_C,
+	// which is largest with G at 0.5 where C' is at most 1.5 C
+	double deltaABSqr = ((lab2.lab.A - lab1.lab.A) * (lab2.lab.A - lab1.lab.A)) + ((lab2.lab.B - lab1.lab.B) * (lab2.lab.B - lab1.lab.B));
+	double S_C = 1 + (0.045 * 1.5 * ((lab1.C + lab2.C) / 2.0));
+	return deltaABSqr / (S_C * S_C) * (1 - 1e-9) - 1e-6;
+}
+
 double CIELABConvertor::R_T(const double barCPrime, const double barhPrime, const double C_prime_div_k_L_S_L, const double H_prime_div_k_L_S_L)
 {
 	const double pow25To7 = 6103515625.0; /* pow(25, 7) */
 	double deltaTheta = deg2Rad(30.0) * exp(-pow((barhPrime - deg2Rad(275.0)) / deg2Rad(25.0), 2.0));
-	double R_C = 2.0 * _sqrt(pow(barCPrime, 7.0) / (pow(barCPrime, 7.0) + pow25To7));
+	const double barCPrimePow7 = pow(barCPrime, 7.0);
+	double R_C = 2.0 * _sqrt(barCPrimePow7 / (barCPrimePow7 + pow25To7));
 	double R_T = (-sin(2.0 * deltaTheta)) * R_C;
 	return R_T * C_prime_div_k_L_S_L * H_prime_div_k_L_S_L;
 }
@@ -185,3 +257,34 @@ double CIELABConvertor::CIEDE2000(const Lab& lab1, const Lab& lab2)
 		pow(deltaH_prime_div_k_L_S_L, 2.0) +
 		deltaR_T;
 }
+
+void CIELABConvertor::Prepare(const Lab& lab, PreparedLab& prepared)
+{
+	prepared.lab = lab;
+	prepared.BSqr = lab.B * lab.B;
+	prepared.C = _sqrt((lab.A * lab.A) + prepared.BSqr);
+}
+
+void CIELABConvertor::Prepare(const ARGB* pixels, const UINT count, PreparedLab* prepared)
+{
+	for (UINT i = 0; i < count; ++i) {
+		Lab lab;
+		ToLab(Color(pixels[i]), lab);
+		Prepare(lab, prepared[i]);
+	}
+}
+
+double CIELABConvertor::CIEDE2000(const PreparedLab& lab1, const PreparedLab& lab2)
+{
+	double deltaL_prime_div_k_L_S_L = L_prime_div_k_L_S_L(lab1.lab, lab2.lab);
+	double a1Prime, a2Prime, CPrime1, CPrime2;
+	double deltaC_prime_div_k_L_S_L = C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+	double barCPrime, barhPrime;
+	double deltaH_prime_div_k_L_S_L = H_prime_div_k_L_S_L(lab1.lab, lab2.lab, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+	double deltaR_T = R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
+	return
+		pow(deltaL_prime_div_k_L_S_L, 2.0) +
+		pow(deltaC_prime_div_k_L_S_L, 2.0) +
+		pow(deltaH_prime_div_k_L_S_L, 2.0) +
+		deltaR_T;
+}
@@ -10,12 +10,27 @@ public:
 		double B = 0.0;
 		double L = 0.0;
 	};
+
+	// a Lab value with the terms of CIEDE2000 that depend on it alone, worked out once
+	// for a palette entry or a pixel matched against many others
+	struct PreparedLab {
+		Lab lab;
+		double C = 0.0;	// chroma, before the a axis is scaled by G
+		double BSqr = 0.0;
+	};
 	
 	static ARGB LAB2RGB(const Lab& lab);
 	static void RGB2LAB(const Color& c1, Lab& lab);
+	// count colours at a time
+	static void RGB2LAB(const ARGB* pixels, const UINT count, Lab* labs);
 	static double L_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2);
 	static double C_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2);
+	static double C_prime_div_k_L_S_L(const PreparedLab& lab1, const PreparedLab& lab2, double& a1Prime, double& a2Prime, double& CPrime1, double& CPrime2);
 	static double H_prime_div_k_L_S_L(const Lab& lab1, const Lab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2, double& barCPrime, double& barhPrime);
+	// never above sqr(H_prime_div_k_L_S_L) and without its atan2, sin and cos calls
+	static double H_prime_sqr_lower_bound(const PreparedLab& lab1, const PreparedLab& lab2, const double a1Prime, const double a2Prime, const double CPrime1, const double CPrime2);
+	// never above sqr(C_prime_div_k_L_S_L) + sqr(H_prime_div_k_L_S_L), from the a and b differences before G is known
+	static double CH_prime_sqr_lower_bound(const PreparedLab& lab1, const PreparedLab& lab2);
 	static double R_T(const double barCPrime, const double barhPrime, const double C_prime_div_k_L_S_L, const double H_prime_div_k_L_S_L);
 	
 	/* From the paper "The CIEDE2000 Color-Difference Formula: Implementation Notes, */
@@ -24,4 +39,9 @@ public:
 	/* Color Res. Appl., vol. 30, no. 1, pp. 21-30, Feb. 2005. */
 	/* Return the CIEDE2000 Delta E color difference measure squared, for two Lab values */
 	static double CIEDE2000(const Lab& lab1, const Lab& lab2);
+	static double CIEDE2000(const PreparedLab& lab1, const PreparedLab& lab2);
+
+	static void Prepare(const Lab& lab, PreparedLab& prepared);
+	// count colours at a time, converted to Lab and prepared
+	static void Prepare(const ARGB* pixels, const UINT count, PreparedLab* prepared);
 };
\ No newline at end of file
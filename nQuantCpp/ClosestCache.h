@@ -0,0 +1,122 @@
+#pragma once
+#include <vector>
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// ClosestCache
+//
+// The two nearest palette entries closestColorIndex found for a colour and
+// their distances, kept inline in a table of fixed size rather than a heap
+// vector per colour. A colour is looked for in the MAX_PROBES slots from
+// its hash on. When all of them hold other colours a new one replaces the
+// colour at its hash, so memory stays at the capacity however many colours
+// the image has. Clear only moves on to a new stamp, the slots stored
+// before it count as free. A copy has the same capacity but starts empty,
+// the records being no more than a memo of the palette searches, so that
+// copies of a quantizer for other threads are cheap to make.
+//
+
+template <typename T>
+class ClosestCache
+{
+	private:
+		struct Record
+		{
+			ARGB argb;
+			UINT stamp;	// of the Clear the record was stored after, 0 when never used
+			unsigned short index[2];
+			T distance[2];
+		};
+
+		static const UINT MAX_PROBES = 8;
+		static const UINT DEFAULT_BITS = 18;
+
+		vector<Record> m_records;
+		UINT m_bits = DEFAULT_BITS;
+		UINT m_stamp = 1;
+
+		inline size_t getSlot(const ARGB argb) const {
+			return (size_t) ((argb * 0x9E3779B97F4A7C15ull) >> (64 - m_bits));
+		}
+
+	public:
+		ClosestCache() = default;
+		ClosestCache(const ClosestCache& other) : m_bits(other.m_bits) {}
+
+		ClosestCache& operator=(const ClosestCache& other)
+		{
+			m_bits = other.m_bits;
+			m_records.clear();
+			m_stamp = 1;
+			return *this;
+		}
+
+		// rounded up to a power of 2, 0 for the default of 2^18 records
+		void SetCapacity(const size_t nEntries)
+		{
+			m_bits = DEFAULT_BITS;
+			if (nEntries > 0) {
+				for (m_bits = 3; m_bits < 30 && ((size_t) 1 << m_bits) < nEntries; ++m_bits)
+					;
+			}
+			m_records.clear();
+			m_stamp = 1;
+		}
+
+		inline size_t Capacity() const { return (size_t) 1 << m_bits; }
+
+		// closest receives the two indices and then their distances as closestColorIndex keeps them
+		bool Find(const ARGB argb, T* closest) const
+		{
+			if (m_records.empty())
+				return false;
+
+			const size_t mask = m_records.size() - 1, slot = getSlot(argb);
+			for (UINT probe = 0; probe < MAX_PROBES; ++probe) {
+				const Record& record = m_records[(slot + probe) & mask];
+				if (record.stamp != m_stamp)
+					return false;
+				if (record.argb != argb)
+					continue;
+
+				closest[0] = record.index[0];
+				closest[1] = record.index[1];
+				closest[2] = record.distance[0];
+				closest[3] = record.distance[1];
+				return true;
+			}
+			return false;
+		}
+
+		void Insert(const ARGB argb, const T* closest)
+		{
+			if (m_records.empty())
+				m_records.assign(Capacity(), Record{ 0, 0, { 0, 0 }, { 0, 0 } });
+
+			const size_t mask = m_records.size() - 1, slot = getSlot(argb);
+			Record* pRecord = &m_records[slot];
+			for (UINT probe = 0; probe < MAX_PROBES; ++probe) {
+				Record& record = m_records[(slot + probe) & mask];
+				if (record.stamp != m_stamp || record.argb == argb) {
+					pRecord = &record;
+					break;
+				}
+			}
+
+			pRecord->argb = argb;
+			pRecord->stamp = m_stamp;
+			pRecord->index[0] = (unsigned short) closest[0];
+			pRecord->index[1] = (unsigned short) closest[1];
+			pRecord->distance[0] = closest[2];
+			pRecord->distance[1] = closest[3];
+		}
+
+		void Clear()
+		{
+			if (++m_stamp == 0) {
+				m_records.clear();
+				m_stamp = 1;
+			}
+		}
+};
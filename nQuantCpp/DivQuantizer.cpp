@@ -18,19 +18,11 @@
 #include "stdafx.h"
 #include "DivQuantizer.h"
 #include "bitmapUtilities.h"
-#include "CIELABConvertor.h"
 #include <algorithm>
-#include <unordered_map>
-#include <type_traits>
 
 namespace DivQuant
 {
-	double PR = .2126, PG = .7152, PB = .0722;
 	const int COLOR_HASH_SIZE = 20023;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
 
 	struct Bucket
 	{
@@ -38,28 +30,6 @@ namespace DivQuant
 		ARGB argb = Color::Transparent;
 		shared_ptr<Bucket> next;
 	};
-	
-	template <
-		typename T, //real type
-		typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type
-	> struct Pixel
-	{
-		T alpha = BYTE_MAX;
-		double L = 0, A = 0, B = 0;
-		ARGB argb = 0;
-		T weight = 0;
-	};
-
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
-	{
-		auto got = pixelMap.find(c.GetValue());
-		if (got == pixelMap.end()) {
-			CIELABConvertor::RGB2LAB(c, lab1);
-			pixelMap[c.GetValue()] = lab1;
-		}
-		else
-			lab1 = got->second;
-	}
 
 	// This method will dedup unique pixels and subsample pixels
 	// based on dec_factor. When dec_factor is 1 then this method
@@ -152,7 +122,7 @@ namespace DivQuant
 			cmap[i] = pixelVec[i];
 	}
 
-	bool map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, ARGB* qPixels, ColorPalette* pPalette)
+	bool DivQuantizer::map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, unsigned short* qPixels, ColorPalette* pPalette)
 	{
 		const UINT colormapSize = pPalette->Count;
 		const int size_lut_init = 4 * BYTE_MAX + 1;
@@ -164,7 +134,7 @@ namespace DivQuant
 		for (UINT i = 0; i < colormapSize; ++i) {
 			Color c(pPalette->Entries[i]);
 			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
+			CIELABConvertor::RGB2LAB(c, lab1);
 			
 			auto& pi = cmap[i];
 			pi.alpha = c.GetA();
@@ -215,7 +185,7 @@ namespace DivQuant
 			int index = lut_init[sum];		
 		
 			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
+			CIELABConvertor::RGB2LAB(c, lab1);
 			// Calculate the squared Euclidean distance between cp and cinit
 			UINT min_dist = abs(c.GetA() - cmap[index].alpha) + abs(lab1.L - cmap[index].L) + abs(lab1.A - cmap[index].A) + abs(lab1.B - cmap[index].B);
 			int upi = index, downi = index;
@@ -250,23 +220,21 @@ namespace DivQuant
 				}
 			}
 
-			Color c2(pPalette->Entries[index]);			
-			qPixels[ik] = hasSemiTransparency ? c2.GetValue() : GetARGBIndex(c2, hasSemiTransparency);
+			qPixels[ik] = index;
 		}
 		return true;
 	}
 
 	// MT  : type of the member attribute, either BYTE or UINT
 	template <typename MT>
-	void DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var)
+	void DivQuantizer::DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const CIELABConvertor::Lab* labs, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var)
 	{
 		double mean_alpha = 0.0, mean_L = 0.0, mean_A = 0.0, mean_B = 0.0;
 		double var_alpha = 0.0, var_L = 0.0, var_A = 0.0, var_B = 0.0;
   
 		for (int ip = 0; ip < num_points; ++ip) {
 			Color c(data[ip]);
-			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
+			const auto& lab1 = labs[ip];
     
 			if (weightsPtr == nullptr) {
 				mean_alpha += c.GetA();
@@ -330,7 +298,7 @@ namespace DivQuant
 
 	// MT  : type of the member attribute, either BYTE or UINT
 	template <typename MT>
-	void DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
+	void DivQuantizer::DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
 		const int num_bits, const int max_iters, ColorPalette* pPalette, UINT& nMaxColors)
 	{
 		const UINT num_colors = nMaxColors;
@@ -343,6 +311,10 @@ namespace DivQuant
 		// The member array is either BYTE or UINT.
 		auto member = make_unique<MT[]>(num_points);
 
+		// every split goes over the points again, convert each of them once
+		auto labs = make_unique<CIELABConvertor::Lab[]>(num_points);
+		CIELABConvertor::RGB2LAB(data, num_points, labs.get());
+
 
 		unique_ptr<int[]> point_index;
 
@@ -396,7 +368,7 @@ namespace DivQuant
 			total_weight = weight[old_index];
 
 			if (new_index == 1)
-				DivQuantClusterInitMeanAndVar<MT>(num_points, data, data_weight, weightsPtr, total_mean, total_var);
+				DivQuantClusterInitMeanAndVar<MT>(num_points, data, labs.get(), data_weight, weightsPtr, total_mean, total_var);
 			else {
 				// Cluster mean/variance has already been calculated
 				total_mean.alpha = mean[old_index].alpha;
@@ -460,8 +432,7 @@ namespace DivQuant
 
 				for (; ip < maxLoopOffset; ++ip) {
 					Color c(tmp_data[ip]);
-					CIELABConvertor::Lab lab1;
-					getLab(c, lab1);
+					const auto& lab1 = labs[point_index.get() ? point_index[ip] : ip];
 
 					double proj_val = c.GetA();
 					if (cut_axis == 1)
@@ -604,8 +575,7 @@ namespace DivQuant
 
 					for (; ip < maxLoopOffset; ++ip) {
 						Color c(tmp_data[ip]);
-						CIELABConvertor::Lab lab1;
-						getLab(c, lab1);
+						const auto& lab1 = labs[point_index.get() ? point_index[ip] : ip];
 
 						int pointindex = ip;
 						if (point_index.get())
@@ -911,14 +881,26 @@ namespace DivQuant
 			DivQuantCluster<UINT>(numPixels, inputPixels.get(), tmpPixels.get(), weightUniform, weightsPtr.get(), num_bits, max_iters, pPalette, nMaxColors);
 	}
 	
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short DivQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
+		if (nMaxColors > 32) {
+			if (!m_paletteTree.IsBuilt())
+				m_paletteTree.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+			return m_paletteTree.Nearest(argb);
+		}
+
 		unsigned short k = 0;
 		Color c(argb);
 
 		double mindist = INT_MAX;
-		CIELABConvertor::Lab lab1, lab2;
-		getLab(c, lab1);
+		CIELABConvertor::Lab lab;
+		CIELABConvertor::RGB2LAB(c, lab);
+		CIELABConvertor::PreparedLab lab1;
+		CIELABConvertor::Prepare(lab, lab1);
+		if (m_paletteLabs.empty()) {
+			m_paletteLabs.resize(nMaxColors);
+			CIELABConvertor::Prepare(pPalette->Entries, nMaxColors, m_paletteLabs.data());
+		}
 
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			Color c2(pPalette->Entries[i]);
@@ -926,39 +908,29 @@ namespace DivQuant
 			if (curdist > mindist)
 				continue;
 
-			if (nMaxColors > 32) {
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
+			const auto& lab2 = m_paletteLabs[i];
 
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
+			double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1.lab, lab2.lab);
+			curdist += sqr(deltaL_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
 
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-			}
-			else {
-				getLab(c2, lab2);
-
-				double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
-				curdist += sqr(deltaL_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-				curdist += sqr(deltaC_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				double barCPrime, barhPrime;
-				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-				curdist += sqr(deltaH_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
-
-				curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);		
-			}
+			double a1Prime, a2Prime, CPrime1, CPrime2;
+			double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+			curdist += sqr(deltaC_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
+			// skip the hue angles when even the least the hue term can add is too much
+			if (curdist + CIELABConvertor::H_prime_sqr_lower_bound(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2) > mindist)
+				continue;
+
+			double barCPrime, barhPrime;
+			double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1.lab, lab2.lab, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+			curdist += sqr(deltaH_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
+
+			curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);		
 			
 			if (curdist > mindist)
 				continue;
@@ -968,40 +940,72 @@ namespace DivQuant
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool DivQuantizer::quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);		
-
-		UINT pixelIndex = 0;
-		for (UINT j = 0; j < height; ++j) {
-			for (UINT i = 0; i < width; ++i, ++pixelIndex)
-				qPixels[pixelIndex] = nearestColorIndex(pPalette, nMaxColors, pixels[pixelIndex]);
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			// at 32 colors or fewer the match is not a distance the colormap can hold
+			auto pColormap = nMaxColors > 32 ? MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB) : nullptr;
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
+
+		// the first match builds what the lookups read, the threads then share this quantizer
+		const size_t count = (size_t) width * height;
+		if (count > 0)
+			qPixels[0] = nearestColorIndex(pPalette, nMaxColors, pixels[0]);
+		// over 32 colors the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && nMaxColors > 32)
+			nearestMap.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+		RemapBlocks(this, count, m_remapThreads, m_pStats, [&](DivQuantizer*, const size_t, const size_t first, const size_t last) {
+			if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			else
+				MatchPixels(ditherFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+		});
 		return true;
 	}
 
-	bool DivQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool DivQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
 
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool DivQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
 			quant_varpart_fast(pixels.data(), pixels.size(), pPalette);
-			if (dither)
-				dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
+			timer.PaletteBuilt();
+			m_paletteTree.Clear();
+			m_paletteLabs.clear();
+			if (dither) {
+				auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return nearestColorIndex(pPalette, nMaxColors, argb);
+				};
+				auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB);
+				dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+			}
 			else
-				map_colors_mps(pixels.data(), pixels.size(), qPixels.get(), pPalette);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+				map_colors_mps(pixels.data(), pixels.size(), qPixels, pPalette);
+			return true;
 		}		
 
 		if (nMaxColors > 2)
@@ -1017,11 +1021,13 @@ namespace DivQuant
 			}
 		}
 
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+		m_paletteLabs.clear();
 		if (hasSemiTransparency || nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -1031,7 +1037,29 @@ namespace DivQuant
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+#ifdef _WIN32
+	bool DivQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool DivQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
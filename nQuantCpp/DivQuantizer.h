@@ -1,8 +1,16 @@
 #pragma once
+#include "CIELABConvertor.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 #include <memory>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
+struct QuantizeStats;
+struct SourceImage;
+
 namespace DivQuant
 {
 	// =============================================================
@@ -21,12 +29,56 @@ namespace DivQuant
 	// Use at your own risk!
 	// =============================================================
 
+	template <
+		typename T, //real type
+		typename = typename std::enable_if<std::is_arithmetic<T>::value, T>::type
+	> struct Pixel
+	{
+		T alpha = BYTE_MAX;
+		double L = 0, A = 0, B = 0;
+		ARGB argb = 0;
+		T weight = 0;
+	};
+
 	class DivQuantizer
 	{
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			PaletteTree m_paletteTree;
+			vector<CIELABConvertor::PreparedLab> m_paletteLabs;	// of the palette entries, for the CIEDE2000 scans
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			bool m_useNearestMap = false;
+
+			bool map_colors_mps(const ARGB* inPixelsPtr, UINT numPixels, unsigned short* qPixels, ColorPalette* pPalette);
+			// MT  : type of the member attribute, either BYTE or UINT
+			template <typename MT>
+			void DivQuantClusterInitMeanAndVar(const int num_points, const ARGB* data, const CIELABConvertor::Lab* labs, const double data_weight, double* weightsPtr, Pixel<double>& total_mean, Pixel<double>& total_var);
+			template <typename MT>
+			void DivQuantCluster(const int num_points, ARGB* data, ARGB* tmp_buffer, const double data_weight, double* weightsPtr,
+				const int num_bits, const int max_iters, ColorPalette* pPalette, UINT& nMaxColors);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+			inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
 			void quant_varpart_fast(const ARGB* inPixels, const UINT numPixels, ColorPalette* pPalette,
 				const UINT numRows = 1, const bool allPixelsUnique = true,
 				const int num_bits = 8, const int dec_factor = 1, const int max_iters = 10);
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
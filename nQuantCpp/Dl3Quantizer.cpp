@@ -44,39 +44,33 @@
 #include "stdafx.h"
 #include "Dl3Quantizer.h"
 #include "bitmapUtilities.h"
-#include <unordered_map>
 
 namespace Dl3Quant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-
 	using namespace std;
 
 	struct CUBE3 {
-		int a, r, g, b;
+		long long a, r, g, b;
 		int aa, rr, gg, bb;
 		UINT cc;
-		UINT pixel_count = 0;
+		size_t pixel_count = 0;
 		double err;
 	};
 
 	void setARGB(CUBE3& rec)
 	{
-		UINT v = rec.pixel_count, v2 = v >> 1;
-		rec.aa = (rec.a + v2) / v;
-		rec.rr = (rec.r + v2) / v;
-		rec.gg = (rec.g + v2) / v;
-		rec.bb = (rec.b + v2) / v;
+		size_t v = rec.pixel_count, v2 = v >> 1;
+		rec.aa = (int) ((rec.a + v2) / v);
+		rec.rr = (int) ((rec.r + v2) / v);
+		rec.gg = (int) ((rec.g + v2) / v);
+		rec.bb = (int) ((rec.b + v2) / v);
 	}
 
 	double calc_err(CUBE3* rgb_table3, const int* squares3, const UINT& c1, const UINT& c2)
 	{
-		UINT P1 = rgb_table3[c1].pixel_count;
-		UINT P2 = rgb_table3[c2].pixel_count;
-		UINT P3 = P1 + P2;
+		size_t P1 = rgb_table3[c1].pixel_count;
+		size_t P2 = rgb_table3[c2].pixel_count;
+		size_t P3 = P1 + P2;
 
 		int A3 = (rgb_table3[c1].a + rgb_table3[c2].a + (P3 >> 1)) / P3;
 		int R3 = (rgb_table3[c1].r + rgb_table3[c2].r + (P3 >> 1)) / P3;
@@ -102,22 +96,27 @@ namespace Dl3Quant
 		return (dist1 + dist2);
 	}
 
-	void build_table3(CUBE3* rgb_table3, ARGB argb)
+	void Dl3Quantizer::build_table3(CUBE3* rgb_table3, ARGB argb, size_t count)
 	{
 		Color c(argb);
 		int index = GetARGBIndex(c, hasSemiTransparency);
 
-		rgb_table3[index].a += c.GetA();
-		rgb_table3[index].r += c.GetR();
-		rgb_table3[index].g += c.GetG();
-		rgb_table3[index].b += c.GetB();
-		rgb_table3[index].pixel_count++;
+		rgb_table3[index].a += c.GetA() * count;
+		rgb_table3[index].r += c.GetR() * count;
+		rgb_table3[index].g += c.GetG() * count;
+		rgb_table3[index].b += c.GetB() * count;
+		rgb_table3[index].pixel_count += count;
 	}
 
-	UINT build_table3(CUBE3* rgb_table3, vector<ARGB>& pixels)
+	UINT Dl3Quantizer::build_table3(CUBE3* rgb_table3, const SourceImage& source)
 	{
-		for (const auto & pixel : pixels)
-			build_table3(rgb_table3, pixel);
+		for (const auto& entry : source.histogram)
+			build_table3(rgb_table3, entry.first, entry.second);
+
+		if (source.histogram.empty()) {
+			for (const auto & pixel : source.pixels)
+				build_table3(rgb_table3, pixel, 1);
+		}
 
 		UINT tot_colors = 0;
 		for (int i = 0; i < 65536; ++i) {
@@ -207,43 +206,22 @@ namespace Dl3Quant
 		}
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short Dl3Quantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		double mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			double curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		if (!m_paletteTree.IsBuilt())
+			m_paletteTree.Build(pPalette, nMaxColors);
+		return m_paletteTree.Nearest(argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short Dl3Quantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		unsigned short k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		const bool found = closestMap.Find(argb, closest);
+		if (m_pStats)
+			(found ? m_pStats->closestHits : m_pStats->closestMisses)++;
+		if (!found) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -263,58 +241,96 @@ namespace Dl3Quant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
 
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool Dl3Quantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
-
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
-		UINT pixelIndex = 0;
-		for (int j = 0; j < height; ++j) {
-			for (int i = 0; i < width; ++i, ++pixelIndex)
-				qPixels[pixelIndex] = ditherFn(pPalette, nMaxColors, pixels[pixelIndex]);
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
 
+		// a block draws its tie-breaks from a seed of its own, whichever thread maps it
+		const bool closest = m_transparentPixelIndex < 0 && nMaxColors >= 256;
+		const UINT seed = closest ? m_random.Next() : 0;
+		// the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && !closest)
+			nearestMap.Build(pPalette, nMaxColors);
+		RemapBlocks(*this, (size_t) width * height, m_remapThreads, m_pStats, [&](Dl3Quantizer& worker, const size_t block, const size_t first, const size_t last) {
+			if (closest) {
+				worker.m_random.Seed(seed + block);
+				auto closestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(closestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+			else if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			else {
+				auto nearestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.nearestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(nearestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+		});
+
 		return true;
 	}
 
 	void GetQuantizedPalette(ColorPalette* pPalette, const CUBE3* rgb_table3)
 	{
 		for (UINT k = 0; k < pPalette->Count; ++k) {
-			UINT sum = rgb_table3[k].pixel_count;
+			size_t sum = rgb_table3[k].pixel_count;
 			if (sum > 0)
 				pPalette->Entries[k] = Color::MakeARGB(rgb_table3[k].aa, rgb_table3[k].rr, rgb_table3[k].gg, rgb_table3[k].bb);
 		}
 	}
 
-	bool Dl3Quantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool Dl3Quantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
 
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	void Dl3Quantizer::build_palette(const SourceImage& source, ColorPalette* pPalette, UINT& nMaxColors)
+	{
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
 		if (nMaxColors > 2) {
+			string key;
+			if (m_pPaletteCache) {
+				key = PaletteKey("DL3", source, nMaxColors);
+				if (m_pPaletteCache->Find(key, pPalette, nMaxColors))
+					return;
+			}
+
 			auto rgb_table3 = make_unique<CUBE3[]>(65536);
-			UINT tot_colors = build_table3(rgb_table3.get(), pixels);
+			UINT tot_colors = build_table3(rgb_table3.get(), source);
+			if (m_pStats) {
+				m_pStats->uniqueColors += tot_colors;
+				if (tot_colors > nMaxColors)
+					m_pStats->merges += tot_colors - nMaxColors;
+			}
 			int sqr_tbl[BYTE_MAX + BYTE_MAX + 1];
 
 			for (int i = (-BYTE_MAX); i <= BYTE_MAX; ++i)
@@ -325,6 +341,8 @@ namespace Dl3Quant
 			reduce_table3(rgb_table3.get(), squares3, tot_colors, nMaxColors);
 
 			GetQuantizedPalette(pPalette, rgb_table3.get());
+			if (m_pPaletteCache)
+				m_pPaletteCache->Store(key, pPalette);
 		}
 		else {
 			if (m_transparentPixelIndex >= 0) {
@@ -336,17 +354,30 @@ namespace Dl3Quant
 				pPalette->Entries[1] = Color::White;
 			}
 		}
+	}
 
+	bool Dl3Quantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		build_palette(source, pPalette, nMaxColors);
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			closestMap.clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return nearestColorIndex(pPalette, nMaxColors, argb);
+			};
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+			closestMap.Clear();
+			return true;
 		}
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
-		closestMap.clear();
+		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);
+		closestMap.Clear();
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -355,7 +386,118 @@ namespace Dl3Quant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+	bool Dl3Quantizer::QuantizeImage(const ReadBandFn& readBand, const UINT width, const UINT height, ColorPalette* pPalette, const WriteBandFn& writeBand, UINT& nMaxColors, bool dither, const UINT bandHeight)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage source;
+		if (!ScanBands(readBand, width, height, bandHeight, source))
+			return false;
+
+		build_palette(source, pPalette, nMaxColors);
+		source.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+
+		// the same choice of mapping as quantize_image, more than 256 colours are always dithered
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		// reseeded at the blocks of quantize_image, so that bands map as the whole image does
+		const UINT seed = m_random.Next();
+		size_t pixelIndex = 0;
+		auto closestFn = [this, seed, &pixelIndex](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			if (pixelIndex % REMAP_BLOCK == 0)
+				m_random.Seed(seed + pixelIndex / REMAP_BLOCK);
+			++pixelIndex;
+			return closestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (nMaxColors > 256)
+			dither = true;
+
+		int k = -1;
+		auto pColormap = dither ? MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency) : nullptr;
+		bool result;
+		if (!dither && m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, closestFn, dither, hasSemiTransparency, nMaxColors, k, m_pStats);
+		else if (!dither && m_useNearestMap) {
+			NearestMap nearestMap;
+			nearestMap.Build(pPalette, nMaxColors);
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, nearestMap, dither, hasSemiTransparency, nMaxColors, k, m_pStats);
+		}
+		else
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, ditherFn, dither, hasSemiTransparency, nMaxColors, k, m_pStats, pColormap.get(), m_ditherLookup);
+		if (result && k >= 0 && nMaxColors <= 256) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		closestMap.Clear();
+
+		return result;
+	}
+
+	bool Dl3Quantizer::QuantizeImages(const vector<const SourceImage*>& sources, ColorPalette* pPalette, const vector<unsigned short*>& qPixels, UINT& nMaxColors, bool dither, UINT nThreads)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage merged;
+		if (qPixels.size() != sources.size() || !MergeHistograms(sources, merged))
+			return false;
+
+		build_palette(merged, pPalette, nMaxColors);
+		merged.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+		closestMap.Clear();
+
+		// each image is mapped by its own copy of this quantizer, taken with the tree and the caches empty so
+		// that it holds the settings and none of the lookups, which each thread then builds for itself
+		ParallelFor(sources.size(), nThreads, [&](size_t i) {
+			auto worker = *this;
+			worker.m_pStats = nullptr;
+			const auto& source = *sources[i];
+			worker.quantize_image(source.pixels.data(), pPalette, nMaxColors, qPixels[i], source.width, source.height, dither || nMaxColors > 256);
+		});
+
+		for (size_t i = sources.size(); i-- > 0 && nMaxColors <= 256; ) {
+			if (sources[i]->transparentPixelIndex < 0)
+				continue;
+
+			UINT k = qPixels[i][sources[i]->transparentPixelIndex];
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+			break;
+		}
+		closestMap.Clear();
+
+		return true;
+	}
+
+#ifdef _WIN32
+	bool Dl3Quantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool Dl3Quantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
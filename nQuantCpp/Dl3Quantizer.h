@@ -1,6 +1,11 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 using namespace std;
 
 namespace Dl3Quant
@@ -21,9 +26,47 @@ namespace Dl3Quant
 	// Use at your own risk!
 	// =============================================================
 
+	struct CUBE3;
+
 	class Dl3Quantizer
 	{
+		private:
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			PaletteCache* m_pPaletteCache = nullptr;
+			FastRandom m_random;
+			PaletteTree m_paletteTree;
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			bool m_useNearestMap = false;
+			ClosestCache<unsigned short> closestMap;
+
+			void build_table3(CUBE3* rgb_table3, ARGB argb, size_t count);
+			UINT build_table3(CUBE3* rgb_table3, const SourceImage& source);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+			void build_palette(const SourceImage& source, ColorPalette* pPalette, UINT& nMaxColors);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			inline void SetClosestCacheSize(const size_t nEntries) { closestMap.SetCapacity(nEntries); }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+			inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
+			inline void SetPaletteCache(PaletteCache* pPaletteCache) { m_pPaletteCache = pPaletteCache; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const ReadBandFn& readBand, const UINT width, const UINT height, ColorPalette* pPalette, const WriteBandFn& writeBand, UINT& nMaxColors, bool dither = true, const UINT bandHeight = 256);
+			bool QuantizeImages(const vector<const SourceImage*>& sources, ColorPalette* pPalette, const vector<unsigned short*>& qPixels, UINT& nMaxColors, bool dither = true, UINT nThreads = 0);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
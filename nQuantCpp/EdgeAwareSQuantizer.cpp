@@ -40,11 +40,6 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 namespace EdgeAwareSQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-
 	const int DECOMP_SVD = 1;
 
 	static bool mycmp(pair<float, int> p1, pair<float, int> p2)
@@ -104,10 +99,10 @@ namespace EdgeAwareSQuant
 		return result;
 	}
 
-	void fill_random_icm(Mat<BYTE>& indexImg8, int palette_size) {
+	void fill_random_icm(Mat<BYTE>& indexImg8, int palette_size, FastRandom& random) {
 		for (int i = 0; i < indexImg8.get_height(); ++i) {
 			for (int j = 0; j < indexImg8.get_width(); ++j) {
-				int ran_val = float(rand()) / RAND_MAX * (palette_size - 1);
+				int ran_val = random.NextDouble() * (palette_size - 1);
 				if (ran_val < 0)
 					ran_val = 0;
 				if (ran_val >= palette_size)
@@ -127,21 +122,10 @@ namespace EdgeAwareSQuant
 	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result) {
 		vector<int> perm1d;
 		random_permutation(width * height, perm1d);
-		for (auto& it = perm1d.cbegin(); it != perm1d.cend(); ++it)
+		for (auto it = perm1d.cbegin(); it != perm1d.cend(); ++it)
 			result.emplace_front(*it % width, *it / width);
 	}
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
-	{
-		auto got = pixelMap.find(c.GetValue());
-		if (got == pixelMap.end()) {
-			CIELABConvertor::RGB2LAB(c, lab1);
-			pixelMap[c.GetValue()] = lab1;
-		}
-		else
-			lab1 = got->second;
-	}
-
 	void compute_b_array_ea_saliency(Mat<Mat<float> >& weightMaps, Mat<Mat<float> >& b, int filterRadius, Mat<float>& saliencyMap)
 	{
 		int imgHeight = weightMaps.get_height();
@@ -195,7 +179,7 @@ namespace EdgeAwareSQuant
 		return b_yx(k_y, k_x);
 	}
 
-	void compute_a_image_ea(const vector<ARGB>& image, Mat<Mat<float> >& b, array2d<vector_fixed<float, 4> >& a)
+	void compute_a_image_ea(const PixelSpan& image, Mat<Mat<float> >& b, array2d<vector_fixed<float, 4> >& a)
 	{
 		int extendedFilterRadius = (b(0, 0).get_width() - 1) / 2;
 		for (int i_y = 0; i_y < a.get_height(); ++i_y) {
@@ -278,7 +262,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b)
+	void EdgeAwareSQuantizer::compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		int palette_size = s.get_width();
@@ -318,7 +302,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
+	void EdgeAwareSQuantizer::refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
 		const array2d<vector_fixed<float, 4> >& a, vector<vector_fixed<float, 4> >& palette, int& palatte_changed)
 	{
 		// We only computed the half of S above the diagonal - reflect it
@@ -339,9 +323,9 @@ namespace EdgeAwareSQuant
 		float max_palette_delta = 0.0f, min_palette_delta = 1.0f;
 		const int length = hasSemiTransparency ? 4 : 3;
 		for (short k = 0; k < length; k++) {
-			auto& S_k = extract_vector_layer_2d(s, k);
-			auto& R_k = extract_vector_layer_1d(r, k);
-			auto& palette_channel = (-2.0f * S_k).matrix_inverse() * R_k;
+			auto S_k = extract_vector_layer_2d(s, k);
+			auto R_k = extract_vector_layer_1d(r, k);
+			auto palette_channel = (-2.0f * S_k).matrix_inverse() * R_k;
 			UINT v = 0;
 			for (; v < palette.size(); ++v) {
 				auto val = palette_channel[v];
@@ -368,9 +352,9 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void spatial_color_quant_ea_icm_saliency(const vector<ARGB>& image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
+	void EdgeAwareSQuantizer::spatial_color_quant_ea_icm_saliency(const PixelSpan& image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
 		unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette,
-		const float initial_temperature = 1.0, const float final_temperature = 0.00001, const int temps_per_level = 1, const int repeats_per_temp = 1, const int filter_radius = 1)
+		const float initial_temperature, const float final_temperature, const int temps_per_level, const int repeats_per_temp, const int filter_radius)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		const int bitmapWidth = weightMaps.get_width();
@@ -380,7 +364,7 @@ namespace EdgeAwareSQuant
 		int neiSize = 10;
 
 		auto pIndexImg8 = make_unique<Mat<BYTE> >(bitmapHeight >> max_coarse_level, bitmapWidth >> max_coarse_level);
-		fill_random_icm(*pIndexImg8, palette.size());
+		fill_random_icm(*pIndexImg8, palette.size(), m_random);
 
 		// Compute a_I^l, b_{IJ}^l according to  Puzicha's (18)
 		auto a_array = make_unique<array2d<vector_fixed<float, 4> >[]>(max_coarse_level + 1);
@@ -459,21 +443,27 @@ namespace EdgeAwareSQuant
 		float paletteSize = palette.size() * 1.0f;
 		const double divisor = 1.0 / (255.0 * 255.0);
 		while (coarse_level >= 0) {
+			if (m_pStats)
+				++m_pStats->levels;
+
 			// calculate the distance between centroids
+			vector<ARGB> centroids(palette.size());
+			for (int l = 0; l < palette.size(); l++) {
+				Color c(hasSemiTransparency ? static_cast<BYTE>(BYTE_MAX * palette[l][3]) : BYTE_MAX, static_cast<BYTE>(BYTE_MAX * palette[l][0]), static_cast<BYTE>(BYTE_MAX * palette[l][1]), static_cast<BYTE>(BYTE_MAX * palette[l][2]));
+				centroids[l] = c.GetValue();
+			}
+			vector<CIELABConvertor::Lab> centroidLabs(palette.size());
+			CIELABConvertor::RGB2LAB(centroids.data(), centroids.size(), centroidLabs.data());
+
 			vector<vector<pair<float, int> > > centroidDist(paletteSize, vector<pair<float, int> >(paletteSize, pair<float, int>(0.0f, -1)));
 			for (int l1 = 0; l1 < palette.size(); l1++) {
 				for (int l2 = l1; l2 < palette.size(); l2++) {
-					Color c(hasSemiTransparency ? static_cast<BYTE>(BYTE_MAX * palette[l1][3]) : BYTE_MAX, static_cast<BYTE>(BYTE_MAX * palette[l1][0]), static_cast<BYTE>(BYTE_MAX * palette[l1][1]), static_cast<BYTE>(BYTE_MAX * palette[l1][2]));
-					CIELABConvertor::Lab lab1;
-					getLab(c, lab1);
-
-					Color c2(hasSemiTransparency ? static_cast<BYTE>(BYTE_MAX * palette[l2][3]) : BYTE_MAX, static_cast<BYTE>(BYTE_MAX * palette[l2][0]), static_cast<BYTE>(BYTE_MAX * palette[l2][1]), static_cast<BYTE>(BYTE_MAX * palette[l2][2]));
-					CIELABConvertor::Lab lab2;
-					getLab(c2, lab2);
+					const auto& lab1 = centroidLabs[l1];
+					const auto& lab2 = centroidLabs[l2];
 
 					float curDist = CIELABConvertor::CIEDE2000(lab1, lab2);
 					if (hasSemiTransparency)
-						curDist += sqr(c.GetA() - c2.GetA());
+						curDist += sqr(lab1.alpha - lab2.alpha);
 
 					centroidDist[l1][l2] = pair<float, int>(curDist, l2);
 					centroidDist[l2][l1] = pair<float, int>(curDist, l1);
@@ -495,6 +485,8 @@ namespace EdgeAwareSQuant
 			while (repeat_outter == 0 || palette_changed > palette.size() * 0.1) {
 				palette_changed = 0;
 				++repeat_outter;
+				if (m_pStats)
+					++m_pStats->iterations;
 				//----update labeling
 				int pixels_changed = 0, pixels_visited = 0;
 				int repeat_inner = 0;
@@ -596,7 +588,7 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	void filter_bila(const vector<ARGB>& img, Mat<Mat<float> >& weightMaps, const float sigma_s = 1.0f, const float sigma_r = 2.0f)
+	void filter_bila(const PixelSpan& img, Mat<Mat<float> >& weightMaps, const float sigma_s = 1.0f, const float sigma_r = 2.0f)
 	{
 		// pixel-wise filter		
 		int radius = 1;
@@ -634,15 +626,25 @@ namespace EdgeAwareSQuant
 		}
 	}
 
-	bool EdgeAwareSQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool EdgeAwareSQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
+
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool EdgeAwareSQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
 
-		m_transparentPixelIndex = -1;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 
 		// see equation (7) in the paper
 		Mat<float> saliencyMap(bitmapHeight, bitmapWidth);
@@ -655,13 +657,8 @@ namespace EdgeAwareSQuant
 		if (nMaxColors > 256)
 			nMaxColors = 256;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(pDest->GetPaletteSize());
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
-
 		DivQuant::DivQuantizer divQuantizer;
 		divQuantizer.quant_varpart_fast(pixels.data(), pixels.size(), pPalette);
 
@@ -677,9 +674,9 @@ namespace EdgeAwareSQuant
 
 		Mat<Mat<float> > weightMaps(bitmapHeight, bitmapWidth);
 		filter_bila(pixels, weightMaps);
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		spatial_color_quant_ea_icm_saliency(pixels, weightMaps, saliencyMap, qPixels.get(), palette);
-		pixelMap.clear();
+		spatial_color_quant_ea_icm_saliency(pixels, weightMaps, saliencyMap, qPixels, palette);
+		// the palette and the indices are optimised together
+		timer.PaletteBuilt();
 
 		if (nMaxColors > 2) {
 			/* Fill palette */
@@ -705,7 +702,29 @@ namespace EdgeAwareSQuant
 			}
 		}
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+#ifdef _WIN32
+	bool EdgeAwareSQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool EdgeAwareSQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
@@ -1,6 +1,9 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
 
 using namespace std;
 
@@ -356,7 +359,28 @@ namespace EdgeAwareSQuant
 
 	class EdgeAwareSQuantizer
 	{
+		private:
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			FastRandom m_random;
+
+			void compute_initial_s_ea_icm(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8, Mat<Mat<float> >& b);
+			void refine_palette_icm_mat(array2d<vector_fixed<float, 4> >& s, const Mat<BYTE>& indexImg8,
+				const array2d<vector_fixed<float, 4> >& a, vector<vector_fixed<float, 4> >& palette, int& palatte_changed);
+			void spatial_color_quant_ea_icm_saliency(const PixelSpan& image, Mat<Mat<float> >& weightMaps, Mat<float> saliencyMap,
+				unsigned short* quantized_image, vector<vector_fixed<float, 4> >& palette,
+				const float initial_temperature = 1.0, const float final_temperature = 0.00001, const int temps_per_level = 1, const int repeats_per_temp = 1, const int filter_radius = 1);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "stdafx.h"
+#include "InverseColormap.h"
+#include "bitmapUtilities.h"
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+
+// cells per channel of the blocks handed to the threads are 1 << BLOCK_BITS
+const UINT BLOCK_BITS = 3;
+// a box keeps being halved while more entries than this are left in it
+const size_t LEAF_ENTRIES = 16;
+
+// the 8 bit value of a cell, its bits repeated so that 0 and 255 stay themselves
+static inline double CellValue(const UINT value, const UINT bits)
+{
+	return value * 255.0 / ((1 << bits) - 1);
+}
+
+// a little slack, so that rounding never drops the nearest entry
+static inline bool Within(const double dist, const double bound)
+{
+	return dist <= bound * (1 + 1e-9) + 1e-9;
+}
+
+void InverseColormap::fill(const UINT* first, const UINT* last, const vector<unsigned short>& entries)
+{
+	double lo[4], hi[4];
+	for (int j = 0; j < 4; ++j) {
+		lo[j] = CellValue(first[j], m_bits[j]);
+		hi[j] = CellValue(last[j], m_bits[j]);
+	}
+
+	// no cell of the box is further than bound from the entry that sets it
+	vector<pair<double, unsigned short> > nearDists;
+	nearDists.reserve(entries.size());
+	double bound = (numeric_limits<double>::max)();
+	for (const auto i : entries) {
+		const double* entry = &m_points[i * 4];
+		double nearDist = 0, farDist = 0;
+		for (int j = 0; j < 4; ++j) {
+			if (entry[j] < lo[j])
+				nearDist += m_weights[j] * sqr(lo[j] - entry[j]);
+			else if (entry[j] > hi[j])
+				nearDist += m_weights[j] * sqr(entry[j] - hi[j]);
+			farDist += m_weights[j] * sqr(max(entry[j] - lo[j], hi[j] - entry[j]));
+		}
+		nearDists.emplace_back(nearDist, i);
+		bound = min(bound, farDist);
+	}
+	nearDists.erase(remove_if(nearDists.begin(), nearDists.end(), [bound](const pair<double, unsigned short>& nearDist) {
+		return !Within(nearDist.first, bound);
+	}), nearDists.end());
+
+	// halve the box across its widest weighted side
+	if (nearDists.size() > LEAF_ENTRIES) {
+		int axis = -1;
+		double maxSpread = 0;
+		for (int j = 0; j < 4; ++j) {
+			const double spread = m_weights[j] * sqr(hi[j] - lo[j]);
+			if (first[j] < last[j] && spread > maxSpread) {
+				maxSpread = spread;
+				axis = j;
+			}
+		}
+
+		if (axis >= 0) {
+			vector<unsigned short> kept;
+			kept.reserve(nearDists.size());
+			for (const auto& nearDist : nearDists)
+				kept.emplace_back(nearDist.second);
+
+			const UINT mid = (first[axis] + last[axis]) / 2;
+			UINT split[4] = { last[0], last[1], last[2], last[3] };
+			split[axis] = mid;
+			fill(first, split, kept);
+
+			copy(first, first + 4, split);
+			split[axis] = mid + 1;
+			fill(split, last, kept);
+			return;
+		}
+	}
+
+	// closest to the box first, a cell can stop at the first entry whose box distance is past its best
+	sort(nearDists.begin(), nearDists.end());
+
+	double point[4];
+	for (UINT a = first[0]; a <= last[0]; ++a) {
+		point[0] = CellValue(a, m_bits[0]);
+		for (UINT r = first[1]; r <= last[1]; ++r) {
+			point[1] = CellValue(r, m_bits[1]);
+			for (UINT g = first[2]; g <= last[2]; ++g) {
+				point[2] = CellValue(g, m_bits[2]);
+				for (UINT b = first[3]; b <= last[3]; ++b) {
+					point[3] = CellValue(b, m_bits[3]);
+
+					// the same sums as the scans of the quantizers, of equal distances the last entry wins
+					unsigned short k = 0;
+					double mindist = INT_MAX;
+					for (const auto& nearDist : nearDists) {
+						if (!Within(nearDist.first, mindist))
+							break;
+
+						const unsigned short i = nearDist.second;
+						const double* entry = &m_points[i * 4];
+						double curdist = m_weights[0] * sqr(entry[0] - point[0]);
+						if (curdist > mindist)
+							continue;
+
+						curdist += m_weights[1] * sqr(entry[1] - point[1]);
+						if (curdist > mindist)
+							continue;
+
+						curdist += m_weights[2] * sqr(entry[2] - point[2]);
+						if (curdist > mindist)
+							continue;
+
+						curdist += m_weights[3] * sqr(entry[3] - point[3]);
+						if (curdist > mindist || (curdist == mindist && i < k))
+							continue;
+
+						mindist = curdist;
+						k = i;
+					}
+					m_table[getIndex(a, r, g, b)] = k;
+				}
+			}
+		}
+	}
+}
+
+void InverseColormap::Build(const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency,
+	const double wA, const double wR, const double wG, const double wB, const UINT extraBits, const UINT nThreads)
+{
+	const UINT extra = min(extraBits, 2U);
+	if (hasSemiTransparency) {
+		for (int j = 0; j < 4; ++j)
+			m_bits[j] = 4 + extra;
+	}
+	else {
+		m_bits[0] = 1;
+		m_bits[1] = 5 + extra;
+		m_bits[2] = 6 + extra;
+		m_bits[3] = 5 + extra;
+	}
+	m_table.assign((size_t) 1 << (m_bits[0] + m_bits[1] + m_bits[2] + m_bits[3]), 0);
+
+	m_weights[0] = wA, m_weights[1] = wR, m_weights[2] = wG, m_weights[3] = wB;
+	m_points.resize(nMaxColors * 4);
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c(pPalette->Entries[i]);
+		m_points[i * 4] = c.GetA();
+		m_points[i * 4 + 1] = c.GetR();
+		m_points[i * 4 + 2] = c.GetG();
+		m_points[i * 4 + 3] = c.GetB();
+	}
+
+	// of repeated colours only the last can win a tie, the others would never be pruned
+	unordered_map<ARGB, unsigned short> lastIndices;
+	for (UINT i = 0; i < nMaxColors; ++i)
+		lastIndices[pPalette->Entries[i]] = i;
+	vector<unsigned short> entries;
+	entries.reserve(lastIndices.size());
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		if (lastIndices[pPalette->Entries[i]] == i)
+			entries.emplace_back(i);
+	}
+
+	UINT blockBits[4], blocks[4];
+	size_t nBlocks = 1;
+	for (int j = 0; j < 4; ++j) {
+		blockBits[j] = min(m_bits[j], BLOCK_BITS);
+		blocks[j] = 1 << (m_bits[j] - blockBits[j]);
+		nBlocks *= blocks[j];
+	}
+
+	// the blocks write disjoint cells of the table
+	ParallelFor(nBlocks, nThreads, [&](size_t blockIndex) {
+		UINT first[4], last[4];
+		for (int j = 3; j >= 0; --j) {
+			first[j] = (blockIndex % blocks[j]) << blockBits[j];
+			last[j] = first[j] + (1 << blockBits[j]) - 1;
+			blockIndex /= blocks[j];
+		}
+		fill(first, last, entries);
+	});
+	m_points.clear();
+}
+
+unique_ptr<InverseColormap> MakeInverseColormap(const DitherLookup& lookup, const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency,
+	const double wA, const double wR, const double wG, const double wB)
+{
+	if (!lookup.eager && !lookup.Threaded())
+		return nullptr;
+
+	auto pColormap = make_unique<InverseColormap>();
+	pColormap->Build(pPalette, nMaxColors, hasSemiTransparency, wA, wR, wG, wB, lookup.extraBits, lookup.nThreads);
+	return pColormap;
+}
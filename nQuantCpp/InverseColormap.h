@@ -0,0 +1,93 @@
+#pragma once
+#include <memory>
+#include <vector>
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// DitherLookup
+//
+// How dither_image maps a dithered colour to a palette entry. By default
+// it fills its 65536 entry table lazily through the ditherFn, one palette
+// search on the dithering thread per new entry. When eager is set the
+// quantizers build an InverseColormap for the palette up front instead,
+// on nThreads threads (0 for all of them), and the dither loop only reads it.
+// The serpentine scan of the dither makes each pixel wait for the one before,
+// so it runs on one thread. With wavefront set every row runs left to right
+// instead, two pixels behind the row above, and the rows are spread over
+// the same nThreads threads. That gives other indices than the serpentine
+// scan but the same ones on any number of threads. The lazy table is filled
+// in the order of the pixels, so without eager an nThreads of 0 keeps the
+// rows on one thread, and only an nThreads above 1 builds the InverseColormap
+// for them, which gives the indices of eager. Where a quantizer keeps the
+// lazy table anyway the rows stay on one thread, QuantizeStats::ditherThreads
+// tells how many they went to.
+// A pattern other than Diffusion replaces the error diffusion with the
+// ordered dither of OrderedDither, whose rows go to the nThreads threads
+// in any order under the same rule. A tileSize above 0 diffuses the error
+// in square tiles instead, each over its own rows of errors, which the
+// nThreads threads take in turn under that rule too. A tile starts
+// tileOverlap pixels before its edges, at most half its size, and the
+// pixels on either side of a seam come from one tile or the other.
+//
+
+enum class DitherPattern { Diffusion, Bayer, BlueNoise };
+
+struct DitherLookup
+{
+	bool eager = false;
+	UINT extraBits = 0;	// bits added to each channel of the table, 0 to 2
+	UINT nThreads = 0;
+	bool wavefront = false;
+	DitherPattern pattern = DitherPattern::Diffusion;
+	UINT tileSize = 0;
+	UINT tileOverlap = 32;
+
+	// whether the rows of the dither were asked to go to more than one thread
+	inline bool Threaded() const { return nThreads > 1 && (wavefront || pattern != DitherPattern::Diffusion || tileSize > 0); }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// InverseColormap
+//
+// Table of the nearest palette entry for every colour at the resolution of
+// the dither lookup, RGB565 with one bit of alpha or ARGB4444 for images
+// with semi-transparency, widened by extraBits per channel. Each cell holds
+// the entry nearest its own colour, its bits widened to 8, under the
+// weighted squared distance of PaletteTree. The table is filled in blocks
+// of cells: a palette entry whose distance to the block's box is above the
+// smallest distance any entry reaches across the whole box cannot be
+// nearest to any of its cells. A block with many entries left is halved
+// and pruned again, the cells then only scan the few entries that remain.
+//
+
+class InverseColormap
+{
+	private:
+		UINT m_bits[4] = { 0, 0, 0, 0 };	// of alpha, red, green and blue
+		double m_weights[4] = { 1, 1, 1, 1 };
+		vector<double> m_points;
+		vector<unsigned short> m_table;
+
+		void fill(const UINT* first, const UINT* last, const vector<unsigned short>& entries);
+
+		inline size_t getIndex(const UINT a, const UINT r, const UINT g, const UINT b) const {
+			return (((size_t) a << m_bits[1] | r) << m_bits[2] | g) << m_bits[3] | b;
+		}
+
+	public:
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency,
+			const double wA = 1, const double wR = 1, const double wG = 1, const double wB = 1, const UINT extraBits = 0, const UINT nThreads = 0);
+
+		inline unsigned short Nearest(const ARGB argb) const {
+			Color c(argb);
+			return m_table[getIndex(c.GetA() >> (8 - m_bits[0]), c.GetR() >> (8 - m_bits[1]), c.GetG() >> (8 - m_bits[2]), c.GetB() >> (8 - m_bits[3]))];
+		}
+		inline bool IsBuilt() const { return !m_table.empty(); }
+		inline size_t Size() const { return m_table.size(); }
+};
+
+// an InverseColormap of the palette when lookup asks for one or spreads the dither over several threads, nullptr otherwise
+unique_ptr<InverseColormap> MakeInverseColormap(const DitherLookup& lookup, const ColorPalette* pPalette, const UINT nMaxColors, const bool hasSemiTransparency,
+	const double wA = 1, const double wR = 1, const double wG = 1, const double wB = 1);
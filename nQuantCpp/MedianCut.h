@@ -34,19 +34,59 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <memory>
 #include <vector>
 #include <limits>
+#include <unordered_map>
+#include "CIELABConvertor.h"
+#include "ClosestCache.h"
 #include "EdgeAwareSQuantizer.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 
 using namespace std;
 using namespace EdgeAwareSQuant;
 
 //#define VITER_CACHE_LINE_GAP ((64+sizeof(viter_state)-1)/sizeof(viter_state))
 
+struct PixelSpan;
+struct QuantizeStats;
+struct SourceImage;
+
 namespace MedianCutQuant
 {
 	class MedianCut
 	{
+	private:
+		double PR = .2126, PG = .7152, PB = .0722;
+		bool hasSemiTransparency = false;
+		long long m_transparentPixelIndex = -1;
+		ARGB m_transparentColor = Color::Transparent;
+		QuantizeStats* m_pStats = nullptr;
+		FastRandom m_random;
+		PaletteTree m_paletteTree;
+		vector<CIELABConvertor::PreparedLab> m_paletteLabs;	// of the palette entries, for the CIEDE2000 scans
+		DitherLookup m_ditherLookup;
+		UINT m_remapThreads = 1;
+		bool m_useNearestMap = false;
+		ClosestCache<unsigned short> closestMap;
+
+		unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+		unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+		bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+
 	public:
-		virtual int quantizeImg(const vector<ARGB>& pixels, const UINT& width, Mat<float>& saliencyMap_float, ColorPalette* pPalette, UINT& newcolors);
+		inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+		inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+		inline void SetClosestCacheSize(const size_t nEntries) { closestMap.SetCapacity(nEntries); }
+		// threads of the remap without dithering, 0 for one per logical processor
+		inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+		// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+		inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
+		inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+		virtual int quantizeImg(const PixelSpan& pixels, const UINT& width, Mat<float>& saliencyMap_float, ColorPalette* pPalette, UINT& newcolors);
+		bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+		bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+		bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 		bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
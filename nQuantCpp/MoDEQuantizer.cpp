@@ -13,7 +13,6 @@ Copyright (c) 2018 - 2019 Miller Cy Chan
 #include "bitmapUtilities.h"
 #include <ctime>
 #include <iomanip>      // std::setprecision
-#include <unordered_map>
 
 namespace MoDEQuant
 {
@@ -25,22 +24,12 @@ namespace MoDEQuant
 	const BYTE high = BYTE_MAX;
 	const BYTE low = 0;        // the initial bounding region
 	const int my_gens = 200;   //the generation number
-	const int LOOP = 5;        //loop number
-	const int seed[50] = { 20436,18352,10994,26845,24435,29789,28299,11375,10222,9885,25855,4282,22102,29385,16014,32018,3200,11252,6227,5939,8712,12504,25965,6101,30359,1295,29533,19841,14690,2695,3503,16802,18931,28464,1245,13279,5676,8951,7280,24488,6537,27128,9320,16399,24997,24303,16862,17882,15360,31216 };
 
-	BYTE SIDE = 3;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-
-	inline double rand1()
+	unsigned short MoDEQuantizer::find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis)
 	{
-		return (double)rand() / (RAND_MAX + 1.0);
-	}
+		if (m_pStats)
+			++m_pStats->nnSearches;
 
-	unsigned short find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis)
-	{
 		auto argb = c.GetValue();
 		auto got = cacheMap.find(argb);
 		if (got == cacheMap.end()) {
@@ -78,7 +67,7 @@ namespace MoDEQuant
 		return k;
 	}
 
-	void updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number)
+	void MoDEQuantizer::updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 
@@ -93,7 +82,7 @@ namespace MoDEQuant
 		}
 	}
 
-	double evaluate1(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
+	double MoDEQuantizer::evaluate1(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		UINT nSize = pixels.size();
@@ -117,7 +106,7 @@ namespace MoDEQuant
 	}
 
 	// Adaptation function designed for multiple targets (1): the minimum value of each inner class distance is the smallest
-	double evaluate1_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate1_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		UINT nSize = pixels.size();
@@ -165,7 +154,7 @@ namespace MoDEQuant
 		return dis_sum;
 	}
 
-	double evaluate2(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num = 1)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate2(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		UINT nSize = pixels.size();
@@ -216,13 +205,13 @@ namespace MoDEQuant
 	}
 
 	// designed for multi objective application function(2)：to maximize the minimum distance of class
-	double evaluate2_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate2_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
 		return evaluate2(pixels, cacheMap, data, K_number);
 	}
 
 	//designed for multi objective application function(3) MSE
-	double evaluate3(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
+	double MoDEQuantizer::evaluate3(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data)
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		double dis_sum = 0.0;
@@ -238,7 +227,7 @@ namespace MoDEQuant
 		return dis_sum / nSize;
 	}
 
-	double evaluate3_K(const vector<ARGB>& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
+	double MoDEQuantizer::evaluate3_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data)  //Adaptive value function with K-means variation
 	{
 		const unsigned short nMaxColors = data.size() / SIDE;
 		UINT nSize = pixels.size();
@@ -277,7 +266,7 @@ namespace MoDEQuant
 		return dis_sum / nSize;
 	}
 
-	int moDEquan(const vector<ARGB>& pixels, ColorPalette* pPalette, const unsigned short nMaxColors)
+	int MoDEQuantizer::moDEquan(const PixelSpan& pixels, ColorPalette* pPalette, const unsigned short nMaxColors)
 	{
 		const BYTE INCR_STEP = 1;
 		const float INCR_PERC = INCR_STEP * 100.0f / my_gens;
@@ -297,16 +286,14 @@ namespace MoDEQuant
 		auto bestx = make_unique<double[]>(D);
 
 		float percCompleted = 0;
-		const int ii = LOOP - 1;
 
 		double F = 0.5, CR = 0.6, BVATG = INT_MAX;
-		srand(seed[ii]);
 		auto pCacheMap = make_unique<unordered_map<ARGB, unsigned short>[]>(N);
 		for (int i = 0; i < N; ++i) {            //the initial population 
 			auto& cacheMap = pCacheMap[i];
 			cacheMap.clear();
 			for (UINT j = 0; j < D; j += SIDE) {
-				int TempInit = int(rand1() * nSizeInit);
+				int TempInit = int(m_random.NextDouble() * nSizeInit);
 				Color c(pixels[TempInit]);
 				x1[i][j] = c.GetB();
 				x1[i][j + 1] = c.GetG();
@@ -327,6 +314,9 @@ namespace MoDEQuant
 		}
 
 		for (int g = 0; g < my_gens; ++g) { //generation loop				
+			if (m_pStats)
+				++m_pStats->iterations;
+
 			if (g % INCR_STEP == 0) {
 				int elapsed_secs = int(clock() - begin) / CLOCKS_PER_SEC;
 				cout << "\rMultiobjective CQ ALGO Based on Self-Adaptive Hybrid DE: " << percCompleted << "% COMPL (" << elapsed_secs << " sec)" << std::flush;
@@ -336,7 +326,7 @@ namespace MoDEQuant
 			for (int i = 0; i < N; ++i) {
 				auto& cacheMap = pCacheMap[i];
 
-				if (rand1() < K_probability) { // individual according to probability to perform clustering
+				if (m_random.NextDouble() < K_probability) { // individual according to probability to perform clustering
 					double temp_costx1 = cost[i];
 					cost[i] = a1 * evaluate1_K(pixels, cacheMap, x1[i]);
 					cost[i] -= a2 * evaluate2_K(pixels, cacheMap, x1[i]);
@@ -354,20 +344,20 @@ namespace MoDEQuant
 				else { // Differential Evolution
 					int d, b;
 					do {
-						d = (int)(rand1() * N);
+						d = (int)(m_random.NextDouble() * N);
 					} while (d == i);
 					do {
-						b = (int)(rand1() * N);
+						b = (int)(m_random.NextDouble() * N);
 					} while (b == d || b == i);
 
-					int jr = (int)(rand1() * D); // every individual update control parameters
-					if (rand1() < 0.1) {
-						F = 0.1 + rand1() * 0.9;
-						CR = rand1();
+					int jr = (int)(m_random.NextDouble() * D); // every individual update control parameters
+					if (m_random.NextDouble() < 0.1) {
+						F = 0.1 + m_random.NextDouble() * 0.9;
+						CR = m_random.NextDouble();
 					}
 
 					for (UINT j = 0; j < D; ++j) {
-						if (rand1() <= CR || j == jr) {
+						if (m_random.NextDouble() <= CR || j == jr) {
 							double diff = (x1[d][j] - x1[b][j]);
 							if (diff > Max_diff)
 								diff -= Max_diff;
@@ -424,43 +414,22 @@ namespace MoDEQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short MoDEQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		UINT mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			UINT curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		if (!m_paletteTree.IsBuilt())
+			m_paletteTree.Build(pPalette, nMaxColors);
+		return m_paletteTree.Nearest(argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short MoDEQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		const bool found = closestMap.Find(argb, closest);
+		if (m_pStats)
+			(found ? m_pStats->closestHits : m_pStats->closestMisses)++;
+		if (!found) {
 			closest[2] = closest[3] = INT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -480,49 +449,77 @@ namespace MoDEQuant
 
 			if (closest[3] == INT_MAX)
 				closest[2] = 0;
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
 
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool MoDEQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
-
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
-		UINT pixelIndex = 0;
-		for (int j = 0; j < height; ++j) {
-			for (int i = 0; i < width; ++i)
-				qPixels[pixelIndex++] = ditherFn(pPalette, nMaxColors, pixels[pixelIndex]);
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
 
+		// a block draws its tie-breaks from a seed of its own, whichever thread maps it
+		const bool closest = m_transparentPixelIndex < 0 && nMaxColors >= 256;
+		const UINT seed = closest ? m_random.Next() : 0;
+		// the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && !closest)
+			nearestMap.Build(pPalette, nMaxColors);
+		RemapBlocks(*this, (size_t) width * height, m_remapThreads, m_pStats, [&](MoDEQuantizer& worker, const size_t block, const size_t first, const size_t last) {
+			if (closest) {
+				worker.m_random.Seed(seed + block);
+				auto closestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(closestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+			else if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			else {
+				auto nearestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.nearestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(nearestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+		});
+
 		return true;
 	}
 
-	bool MoDEQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool MoDEQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		UINT bitmapWidth = pSource->GetWidth();
-		UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
 
-		hasSemiTransparency = false;
-		m_transparentPixelIndex = -1;
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool MoDEQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
 
 		SIDE = hasSemiTransparency ? 4 : 3;
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
 		if (nMaxColors > 2)
@@ -538,15 +535,19 @@ namespace MoDEQuant
 			}
 		}
 
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			closestMap.clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return nearestColorIndex(pPalette, nMaxColors, argb);
+			};
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+			closestMap.Clear();
+			return true;
 		}
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -555,9 +556,31 @@ namespace MoDEQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
+		closestMap.Clear();
+
+		return true;
+	}
+
+#ifdef _WIN32
+	bool MoDEQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool MoDEQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
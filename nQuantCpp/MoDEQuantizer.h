@@ -1,6 +1,11 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 using namespace std;
 
 namespace MoDEQuant
@@ -23,7 +28,46 @@ namespace MoDEQuant
 
 	class MoDEQuantizer
 	{
+		private:
+			BYTE SIDE = 3;
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			FastRandom m_random;
+			PaletteTree m_paletteTree;
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			bool m_useNearestMap = false;
+			ClosestCache<unsigned short> closestMap;
+
+			unsigned short find_nn(const vector<double>& data, const Color& c, unordered_map<ARGB, unsigned short>& cacheMap, double& idis);
+			void updateCentroids(vector<double>& data, double* temp_x, const int* temp_x_number);
+			double evaluate1(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data);
+			double evaluate1_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			double evaluate2(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data, const int K_num = 1);
+			double evaluate2_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			double evaluate3(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, const vector<double>& data);
+			double evaluate3_K(const PixelSpan& pixels, unordered_map<ARGB, unsigned short>& cacheMap, vector<double>& data);
+			int moDEquan(const PixelSpan& pixels, ColorPalette* pPalette, const unsigned short nMaxColors);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			inline void SetClosestCacheSize(const size_t nEntries) { closestMap.SetCapacity(nEntries); }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+			inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
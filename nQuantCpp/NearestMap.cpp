@@ -0,0 +1,187 @@
+#include "stdafx.h"
+#include "NearestMap.h"
+#include <algorithm>
+
+// the radii are taken a little short, so that the rounding of the distances never lets a colour through
+const double MARGIN = 1 - 1e-9;
+// entries kept around each one for the colours that miss it narrowly
+const UINT NEIGHBOURS = 32;
+// centres tried in turn before the heads take over
+const UINT HOPS = 4;
+
+void NearestMap::Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA, const double wR, const double wG, const double wB)
+{
+	vector<double> points(nMaxColors * 4);
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c(pPalette->Entries[i]);
+		points[i * 4] = c.GetA();
+		points[i * 4 + 1] = c.GetR();
+		points[i * 4 + 2] = c.GetG();
+		points[i * 4 + 3] = c.GetB();
+	}
+	Build(points.data(), nMaxColors, wA, wR, wG, wB);
+}
+
+void NearestMap::Build(const double* points, const UINT count, const double wA, const double w1, const double w2, const double w3)
+{
+	Clear();
+	if (count == 0)
+		return;
+
+	m_weights[0] = wA, m_weights[1] = w1, m_weights[2] = w2, m_weights[3] = w3;
+	m_points.assign(points, points + count * 4);
+
+	// of equal entries the scans give the last one, so only that one takes part
+	vector<UINT> entries(count);
+	for (UINT i = 0; i < count; ++i)
+		entries[i] = i;
+	stable_sort(entries.begin(), entries.end(), [&](const UINT i, const UINT j) {
+		return lexicographical_compare(&points[i * 4], &points[i * 4 + 4], &points[j * 4], &points[j * 4 + 4]);
+	});
+	m_last.resize(count);
+	for (UINT i = 0, last = 0; i < count; i = last) {
+		for (last = i + 1; last < count && equal(&points[entries[i] * 4], &points[entries[i] * 4 + 4], &points[entries[last] * 4]); ++last)
+			;
+		for (UINT k = i; k < last; ++k)
+			m_last[entries[k]] = entries[last - 1];
+	}
+	entries.clear();
+	for (UINT i = 0; i < count; ++i) {
+		if (m_last[i] == i)
+			entries.emplace_back(i);
+	}
+
+	// the neighbours of each entry, nearest first, and how far each of them and the first one left out lie
+	const UINT nEntries = entries.size();
+	vector<pair<double, UINT> > order(nEntries);
+	m_neighbours.assign(count * NEIGHBOURS, 0);
+	m_reach.assign(count * (NEIGHBOURS + 1), INT_MAX);
+	for (const auto i : entries) {
+		order.clear();
+		for (const auto j : entries) {
+			if (j != i)
+				order.emplace_back(distance(&m_points[i * 4], j), j);
+		}
+		const UINT nReach = min((UINT) order.size(), NEIGHBOURS + 1);
+		partial_sort(order.begin(), order.begin() + nReach, order.end());
+		for (UINT n = 0; n < nReach; ++n) {
+			m_reach[i * (NEIGHBOURS + 1) + n] = sqrt(order[n].first);
+			if (n < NEIGHBOURS)
+				m_neighbours[i * NEIGHBOURS + n] = order[n].second;
+		}
+	}
+	order.resize(nEntries);
+
+	// each head takes more candidates than the one before, as pngquant does, until one would take them all
+	const UINT nVantagePoints = nEntries > 16 ? nEntries / 4 : 0;
+	for (UINT h = 0; h < nVantagePoints; ++h) {
+		const UINT nCandidates = 1 + nEntries / ((1 + nVantagePoints - h) / 2);
+		if (nCandidates >= nEntries)
+			break;
+
+		for (UINT j = 0; j < nEntries; ++j)
+			order[j] = make_pair(distance(&m_points[entries[h] * 4], entries[j]), entries[j]);
+		m_heads.emplace_back();
+		makeHead(m_heads.back(), entries[h], order, nCandidates);
+	}
+
+	Head last;
+	makeHead(last, entries[0], order, nEntries);
+	m_heads.emplace_back(move(last));
+}
+
+void NearestMap::makeHead(Head& head, const UINT vantagePoint, vector<pair<double, UINT> >& order, const UINT nCandidates) const
+{
+	head.vantagePoint = vantagePoint;
+	head.radius = INT_MAX;
+	head.candidates.resize(nCandidates);
+	if (nCandidates < order.size()) {
+		// any entry left out is at least as far as order[nCandidates], so a colour within half of that
+		// is nearer to the vantage point, itself an entry, than to any of them
+		nth_element(order.begin(), order.begin() + nCandidates, order.end());
+		head.radius = order[nCandidates].first / 4 * MARGIN;
+	}
+	for (UINT k = 0; k < nCandidates; ++k)
+		head.candidates[k] = order[k].second;
+	sort(head.candidates.begin(), head.candidates.end());
+}
+
+double NearestMap::distance(const double* point, const UINT index) const
+{
+	const double* entry = &m_points[index * 4];
+	double dist = m_weights[0] * sqr(entry[0] - point[0]);
+	dist += m_weights[1] * sqr(entry[1] - point[1]);
+	dist += m_weights[2] * sqr(entry[2] - point[2]);
+	dist += m_weights[3] * sqr(entry[3] - point[3]);
+	return dist;
+}
+
+unsigned short NearestMap::Nearest(const ARGB argb, const UINT likely) const
+{
+	Color c(argb);
+	const double point[4] = { (double) c.GetA(), (double) c.GetR(), (double) c.GetG(), (double) c.GetB() };
+	return Nearest(point, likely);
+}
+
+unsigned short NearestMap::Nearest(const double* point, UINT likely, double* pDistance) const
+{
+	if (!IsBuilt())
+		return 0;
+
+	if (likely < m_last.size()) {
+		// an entry farther from the centre than the colour is by more than the nearest distance so far
+		// is farther from the colour than that too, and the neighbours come nearest first; when they run
+		// out the nearest of them becomes the centre, starting from the likely entry
+		UINT centre = m_last[likely];
+		unsigned short k = centre;
+		double mindist = distance(point, centre);
+		for (UINT hop = 0; hop < HOPS; ++hop) {
+			const double span = sqrt(distance(point, centre));
+			double bound = span + sqrt(mindist);
+			const double* reach = &m_reach[centre * (NEIGHBOURS + 1)];
+			const unsigned short* neighbours = &m_neighbours[centre * NEIGHBOURS];
+			for (UINT n = 0; ; ++n) {
+				if (reach[n] * MARGIN > bound) {
+					if (pDistance)
+						*pDistance = mindist;
+					return k;
+				}
+				if (n == NEIGHBOURS)
+					break;
+
+				// of equal distances the last index wins as in the scalar scans
+				const unsigned short index = neighbours[n];
+				const double curdist = distance(point, index);
+				if (curdist < mindist || (curdist == mindist && index > k)) {
+					mindist = curdist;
+					k = index;
+					bound = span + sqrt(mindist);
+				}
+			}
+			if (k == centre)
+				break;
+			centre = k;
+		}
+	}
+
+	const Head* pHead = nullptr;
+	for (size_t h = 0; !pHead; ++h) {
+		if (h + 1 == m_heads.size() || distance(point, m_heads[h].vantagePoint) < m_heads[h].radius)
+			pHead = &m_heads[h];
+	}
+
+	// the candidates come in ascending order, so of equal distances the last one wins as in the scalar scans
+	unsigned short k = 0;
+	double mindist = INT_MAX;
+	for (const auto index : pHead->candidates) {
+		const double curdist = distance(point, index);
+		if (curdist > mindist)
+			continue;
+
+		mindist = curdist;
+		k = index;
+	}
+	if (pDistance)
+		*pDistance = mindist;
+	return k;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <vector>
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// NearestMap
+//
+// Vantage point search for the nearest palette entry after the one of
+// pngquant, under the same weighted squared distance as PaletteTree.
+// A head keeps the entries nearest to its vantage point as candidates and
+// the radius within which a colour is sure to have its nearest entry among
+// them. A lookup first tries the likely index it is given and its 32
+// nearest neighbours in order, and stops as soon as the next one is farther
+// from the likely entry than the colour is by more than the best distance
+// found, which no entry past it can beat. When the neighbours run out first,
+// the nearest entry found takes over as the centre, up to 4 times. Failing
+// that, the first of the heads on the first quarter of the entries whose
+// radius holds the colour hands over its candidates, and the last head
+// holds every entry.
+// Unlike pngquant it keeps the entries near earlier vantage points in the
+// later heads and only the last of equal entries, so it gives the index of
+// the linear scans, ties included. It pays off when the likely index is
+// mostly near, as the match of the previous pixel is in images with runs of
+// like colours. Building it takes count^2 distances. Lookups only read it.
+//
+
+class NearestMap
+{
+	private:
+		struct Head
+		{
+			UINT vantagePoint = 0;
+			double radius = 0;	// squared, a colour nearer than it to the vantage point has its nearest entry among the candidates
+			vector<unsigned short> candidates;	// in ascending order
+		};
+
+		double m_weights[4] = { 1, 1, 1, 1 };
+		vector<double> m_points;
+		vector<UINT> m_last;	// of the entries equal to each one
+		vector<unsigned short> m_neighbours;	// the entries nearest to each one, nearest first
+		vector<double> m_reach;	// not squared, to each of the neighbours and then the nearest one left out
+		vector<Head> m_heads;
+
+		double distance(const double* point, const UINT index) const;
+		void makeHead(Head& head, const UINT vantagePoint, vector<pair<double, UINT> >& order, const UINT nCandidates) const;
+
+	public:
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA = 1, const double wR = 1, const double wG = 1, const double wB = 1);
+		// points holds count entries of 4 coordinates each
+		void Build(const double* points, const UINT count, const double wA = 1, const double w1 = 1, const double w2 = 1, const double w3 = 1);
+		// likely is the index tried first, pDistance receives the distance to the entry found
+		unsigned short Nearest(const ARGB argb, const UINT likely = 0) const;
+		unsigned short Nearest(const double* point, const UINT likely = 0, double* pDistance = nullptr) const;
+
+		// a matcher of the remap, MatchPixels carries the match of each pixel over to the next
+		inline unsigned short operator()(const ColorPalette*, const UINT, const ARGB argb) const { return Nearest(argb); }
+
+		inline bool IsBuilt() const { return !m_heads.empty(); }
+		inline void Clear() { m_heads.clear(); }
+};
@@ -3,8 +3,6 @@
 #include "stdafx.h"
 #include "NeuQuantizer.h"
 #include "bitmapUtilities.h"
-#include "CIELABConvertor.h"
-#include <unordered_map>
 
 namespace NeuralNet
 {
@@ -33,16 +31,11 @@ namespace NeuralNet
 	* that this copyright notice remain intact.
 	*/
 
-	double PR = .2126, PG = .7152, PB = .0722;
 	const short specials = 3;		// number of reserved colours used
 	const int ncycles = 115;			// no. of learning cycles
 	const int radiusbiasshift = 8;
 	const int radiusbias = 1 << radiusbiasshift;
 
-	int netsize = 256;		// number of colours used	
-	int maxnetpos = netsize - 1;
-	int initrad = netsize >> 3;   // for 256 cols, radius starts at 32
-	double initradius = initrad * 1.0;
 	const int radiusdec = 30; // factor of 1/30 each cycle
 
 	const short normal_learning_extension_factor = 2; /* normally learn twice as long */
@@ -58,7 +51,6 @@ namespace NeuralNet
 	const short REPEL_THRESHOLD = 16;          /* See repel_coincident()... */
 	const short REPEL_STEP_DOWN = 1;              /* ... for an explanation of... */
 	const short REPEL_STEP_UP = 4;                 /* ... how these points work. */
-	unique_ptr<unsigned short[]> repel_points;
 
 	/* defs for freq and bias */
 	const int gammashift = 10;                  /* gamma = 1024 */
@@ -67,26 +59,8 @@ namespace NeuralNet
 	const double beta = (1.0 / (double)(1 << betashift));/* beta = 1/1024 */
 	const double betagamma = (double)(1 << (gammashift - betashift));
 
-	struct nq_pixel
-	{
-		double al, L, A, B;
-	};
-
-	unique_ptr<nq_pixel[]> network; // the network itself
-
-	unique_ptr<unsigned short[]> netindex; // for network lookup - really 256
-
-	unique_ptr<double[]> bias;  // bias and freq arrays for learning
-	unique_ptr<double[]> freq;
-	unique_ptr<double[]> radpower;
-
 	double gamma_correction = 1.0;         // 1.0/2.2 usually
 
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-
 	inline double colorimportance(double al)
 	{
 		double transparency = 1.0 - al / 255.0;
@@ -103,7 +77,7 @@ namespace NeuralNet
 		return 1.0;
 	}
 
-	void SetUpArrays() {
+	void NeuQuantizer::SetUpArrays() {
 		network = make_unique<nq_pixel[]>(netsize);
 		netindex = make_unique<unsigned short[]>(max(netsize, 256));
 		repel_points = make_unique<unsigned short[]>(max(netsize, 256));
@@ -124,17 +98,6 @@ namespace NeuralNet
 		}
 	}
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
-	{
-		auto got = pixelMap.find(c.GetValue());
-		if (got == pixelMap.end()) {
-			CIELABConvertor::RGB2LAB(c, lab1);
-			pixelMap[c.GetValue()] = lab1;
-		}
-		else
-			lab1 = got->second;
-	}
-
 	inline UINT round_biased(double temp)
 	{
 		if (temp < 0)
@@ -146,7 +109,7 @@ namespace NeuralNet
 		return (UINT)temp;
 	}
 
-	void Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B) {
+	void NeuQuantizer::Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B) {
 		double colorimp = 1.0;//0.5;// + 0.7 * colorimportance(al);
 
 		alpha /= initalpha;
@@ -158,7 +121,7 @@ namespace NeuralNet
 		network[i].B -= colorimp * alpha * (network[i].B - B);
 	}
 
-	void Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B) {
+	void NeuQuantizer::Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B) {
 		int lo = i - rad;
 		if (lo < 0)
 			lo = 0;
@@ -197,7 +160,7 @@ namespace NeuralNet
 	 * Eventually the number of repel points will eventually oscillate around the threshold.  With current settings, that means
 	 * that only every 4th function call will result in a full pass.
  	*/
-	void Repelcoincident(int i) {
+	void NeuQuantizer::Repelcoincident(int i) {
 		/* Use brute force to precompute the distance vectors between our neuron and each neuron. */
 
 		if (repel_points[i] > REPEL_THRESHOLD) {
@@ -243,7 +206,7 @@ namespace NeuralNet
 		repel_points[i] += REPEL_STEP_UP;
 	}
 
-	int Contest(BYTE al, double L, double A, double B) {
+	int NeuQuantizer::Contest(BYTE al, double L, double A, double B) {
 		/* Calculate the component-wise differences between target_pix colour and every colour in the network, and weight according
 		* to component relevance.
 		*/
@@ -324,7 +287,7 @@ namespace NeuralNet
 		return bestbiaspos;
 	}
 
-	void Learn(const int samplefac, const vector<ARGB>& pixels) {
+	void NeuQuantizer::Learn(const int samplefac, const PixelSpan& pixels) {
 		UINT stepIndex = 0;
 
 		int pos = 0;
@@ -346,7 +309,7 @@ namespace NeuralNet
 		for (UINT i = 0; i < rad; ++i)
 			radpower[i] = floor(alpha * (((sqr(rad) - sqr(i)) * radiusbias) / sqr(rad)));
 
-		UINT step = ((float)rand() / (float)RAND_MAX) * lengthcount;
+		UINT step = m_random.NextDouble() * lengthcount;
 
 		int learning_extension = normal_learning_extension_factor;
 		if (netsize < extra_long_colour_threshold)
@@ -358,7 +321,7 @@ namespace NeuralNet
 
 			BYTE al = c.GetA();
 			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
+			CIELABConvertor::RGB2LAB(c, lab1);
 
 			auto j = Contest(al, lab1.L, lab1.A, lab1.B);
 
@@ -386,9 +349,12 @@ namespace NeuralNet
 					radpower[j] = floor(alpha * (((sqr(rad) - sqr(j)) * radiusbias) / sqr(rad)));
 			}
 		}
+
+		if (m_pStats)
+			m_pStats->iterations += i;
 	}
 
-	void Inxbuild(ColorPalette* pPalette) {
+	void NeuQuantizer::Inxbuild(ColorPalette* pPalette) {
 		UINT nMaxColors = pPalette->Count;		
 
 		int previouscol = 0;
@@ -431,98 +397,93 @@ namespace NeuralNet
 		}
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short NeuQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		double mindist = INT_MAX;
-		CIELABConvertor::Lab lab1, lab2;
-		getLab(c, lab1);
-
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			if (nMaxColors > 32) {
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-				if (curdist > mindist)
-					continue;
-
-				mindist = curdist;
-			}
-			else {
-				getLab(c2, lab2);
-
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
-
-				curdist += sqr(lab2.L - lab1.L);
-				if (curdist > mindist)
-					continue;
-
-				curdist += sqr(lab2.A - lab1.A);
-				if (curdist > mindist)
-					continue;
-
-				curdist += sqr(lab2.B - lab1.B);
-				if (curdist > mindist)
-					continue;
+		if (nMaxColors > 32) {
+			if (!m_paletteTree.IsBuilt())
+				m_paletteTree.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+			return m_paletteTree.Nearest(argb);
+		}
 
-				mindist = curdist;
+		Color c(argb);
+		if (!m_paletteTree.IsBuilt()) {
+			vector<CIELABConvertor::Lab> labs(nMaxColors);
+			CIELABConvertor::RGB2LAB(pPalette->Entries, nMaxColors, labs.data());
+			vector<double> points(nMaxColors * 4);
+			for (UINT i = 0; i < nMaxColors; ++i) {
+				points[i * 4] = labs[i].alpha;
+				points[i * 4 + 1] = labs[i].L;
+				points[i * 4 + 2] = labs[i].A;
+				points[i * 4 + 3] = labs[i].B;
 			}
-			
-			k = i;
+			m_paletteTree.Build(points.data(), nMaxColors);
 		}
-		return k;
+
+		CIELABConvertor::Lab lab1;
+		CIELABConvertor::RGB2LAB(c, lab1);
+		const double point[4] = { (double) c.GetA(), lab1.L, lab1.A, lab1.B };
+		return m_paletteTree.Nearest(point);
 	}
 
-	bool quantize_image(const vector<ARGB>& pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool NeuQuantizer::quantize_image(const PixelSpan& pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
-
-		UINT pixelIndex = 0;
-		for (UINT j = 0; j < height; ++j) {
-			for (UINT i = 0; i < width; ++i, ++pixelIndex)
-				qPixels[pixelIndex] = nearestColorIndex(pPalette, nMaxColors, pixels[pixelIndex]);
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			// at 32 colors or fewer the match is not a distance the colormap can hold
+			auto pColormap = nMaxColors > 32 ? MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB) : nullptr;
+			return dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
 
+		// the first match builds what the lookups read, the threads then share this quantizer
+		const size_t count = (size_t) width * height;
+		if (count > 0)
+			qPixels[0] = nearestColorIndex(pPalette, nMaxColors, pixels[0]);
+		// over 32 colors the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && nMaxColors > 32)
+			nearestMap.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+		RemapBlocks(this, count, m_remapThreads, m_pStats, [&](NeuQuantizer*, const size_t, const size_t first, const size_t last) {
+			if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels.data() + first, last - first, qPixels + first);
+			else
+				MatchPixels(ditherFn, pPalette, nMaxColors, pixels.data() + first, last - first, qPixels + first);
+		});
+
 		return true;
 	}
 
-	void Clear() {
+	void NeuQuantizer::Clear() {
 		network.reset();
 		netindex.reset();
 		bias.reset();
 		freq.reset();
 		radpower.reset();
 
-		pixelMap.clear();
 	}
 
 	// The work horse for NeuralNet color quantizing.
-	bool NeuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool NeuQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
 
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool NeuQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
 		netsize = nMaxColors;		// number of colours used
@@ -530,22 +491,34 @@ namespace NeuralNet
 		initrad = netsize < 8 ? 1 : (netsize >> 3);
 		initradius = initrad * 1.0;
 
-		SetUpArrays();
-		Learn(dither ? 5 : 1, pixels);
-		Inxbuild(pPalette);
+		// the network learns from a sample of the pixels in order, so the order is part of the key
+		string key;
+		if (m_pPaletteCache)
+			key = PaletteKey("NEU", source, nMaxColors, { dither }, true);
+		if (!m_pPaletteCache || !m_pPaletteCache->Find(key, pPalette, nMaxColors)) {
+			SetUpArrays();
+			Learn(dither ? 5 : 1, pixels);
+			Inxbuild(pPalette);
+			if (m_pPaletteCache)
+				m_pPaletteCache->Store(key, pPalette);
+		}
 
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
+			auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return nearestColorIndex(pPalette, nMaxColors, argb);
+			};
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB);
+			dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
 			Clear();
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			return true;
 		}
 
 		if (hasSemiTransparency || nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels, pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);		if (m_transparentPixelIndex >= 0) {
+		quantize_image(pixels, pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
 			if (nMaxColors > 2)
 				pPalette->Entries[k] = m_transparentColor;
@@ -554,6 +527,28 @@ namespace NeuralNet
 		}
 
 		Clear();
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+#ifdef _WIN32
+	bool NeuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool NeuQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 }
@@ -1,6 +1,11 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 using namespace std;
 
 namespace NeuralNet
@@ -21,9 +26,64 @@ namespace NeuralNet
 	// Use at your own risk!
 	// =============================================================
 
+	struct nq_pixel
+	{
+		double al, L, A, B;
+	};
+
 	class NeuQuantizer
 	{
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+
+			int netsize = 256;		// number of colours used	
+			int maxnetpos = netsize - 1;
+			int initrad = netsize >> 3;   // for 256 cols, radius starts at 32
+			double initradius = initrad * 1.0;
+
+			unique_ptr<unsigned short[]> repel_points;
+			unique_ptr<nq_pixel[]> network; // the network itself
+			unique_ptr<unsigned short[]> netindex; // for network lookup - really 256
+			unique_ptr<double[]> bias;  // bias and freq arrays for learning
+			unique_ptr<double[]> freq;
+			unique_ptr<double[]> radpower;
+
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			PaletteCache* m_pPaletteCache = nullptr;
+			FastRandom m_random;
+			PaletteTree m_paletteTree;
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			bool m_useNearestMap = false;
+
+			void SetUpArrays();
+			void Altersingle(double alpha, UINT i, BYTE al, double L, double A, double B);
+			void Alterneigh(UINT rad, UINT i, BYTE al, double L, double A, double B);
+			void Repelcoincident(int i);
+			int Contest(BYTE al, double L, double A, double B);
+			void Learn(const int samplefac, const PixelSpan& pixels);
+			void Inxbuild(ColorPalette* pPalette);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const PixelSpan& pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+			void Clear();
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+			inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
+			inline void SetPaletteCache(PaletteCache* pPaletteCache) { m_pPaletteCache = pPaletteCache; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap *pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
@@ -0,0 +1,160 @@
+#include "stdafx.h"
+#include "OrderedDither.h"
+#include "bitmapUtilities.h"
+#include <cmath>
+
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define ORDERED_SSE2
+#include <emmintrin.h>
+#endif
+
+// of the mask sides as powers of 2
+const UINT BAYER_BITS = 3;
+const UINT BLUE_NOISE_BITS = 6;
+// of the gaussian the void and cluster method weighs the neighbours of a cell by
+const double BLUE_NOISE_SIGMA = 1.5;
+
+// the recursive matrix of Bayer, its lowest bits of x and y choose among the largest quarters
+static vector<UINT> BayerRanks(const UINT bits)
+{
+	const UINT size = 1 << bits;
+	vector<UINT> ranks(size * size);
+	for (UINT y = 0; y < size; ++y) {
+		for (UINT x = 0; x < size; ++x) {
+			UINT rank = 0;
+			for (UINT bit = 0; bit < bits; ++bit) {
+				const UINT xb = (x >> bit) & 1, yb = (y >> bit) & 1;
+				rank |= ((xb ^ yb) << 1 | yb) << (2 * (bits - 1 - bit));
+			}
+			ranks[y * size + x] = rank;
+		}
+	}
+	return ranks;
+}
+
+// void and cluster on the torus: a random tenth of the cells is spread evenly by moving the point
+// in the tightest cluster to the largest void, then the points are taken out tightest first and
+// the cells filled largest void first, which ranks every cell
+static vector<UINT> BlueNoiseRanks(const UINT bits)
+{
+	const UINT size = 1 << bits, count = size * size, mask = size - 1;
+	vector<double> kernel(count);
+	for (UINT dy = 0; dy < size; ++dy) {
+		for (UINT dx = 0; dx < size; ++dx) {
+			const double x = min(dx, size - dx), y = min(dy, size - dy);
+			kernel[dy * size + dx] = exp(-(x * x + y * y) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+		}
+	}
+
+	vector<double> energy(count);
+	vector<bool> points(count);
+	auto toggle = [&](const UINT cell) {
+		points[cell] = !points[cell];
+		const double sign = points[cell] ? 1 : -1;
+		const UINT cx = cell & mask, cy = cell >> bits;
+		for (UINT i = 0; i < count; ++i)
+			energy[i] += sign * kernel[(((i >> bits) - cy) & mask) * size + (((i & mask) - cx) & mask)];
+	};
+	auto extreme = [&](const bool cluster) {
+		UINT best = 0;
+		double bestEnergy = cluster ? -1 : (numeric_limits<double>::max)();
+		for (UINT i = 0; i < count; ++i) {
+			if (points[i] == cluster && (cluster ? energy[i] > bestEnergy : energy[i] < bestEnergy)) {
+				best = i;
+				bestEnergy = energy[i];
+			}
+		}
+		return best;
+	};
+
+	FastRandom random;
+	const UINT nPoints = count / 10;
+	for (UINT placed = 0; placed < nPoints; ) {
+		const UINT cell = random.Next(count);
+		if (!points[cell]) {
+			toggle(cell);
+			++placed;
+		}
+	}
+	for (;;) {
+		const UINT cluster = extreme(true);
+		toggle(cluster);
+		const UINT largestVoid = extreme(false);
+		toggle(largestVoid);
+		if (largestVoid == cluster)
+			break;
+	}
+
+	vector<UINT> ranks(count);
+	const auto initialEnergy = energy;
+	const auto initialPoints = points;
+	for (UINT rank = nPoints; rank-- > 0; ) {
+		const UINT cluster = extreme(true);
+		toggle(cluster);
+		ranks[cluster] = rank;
+	}
+	energy = initialEnergy;
+	points = initialPoints;
+	for (UINT rank = nPoints; rank < count; ++rank) {
+		const UINT largestVoid = extreme(false);
+		toggle(largestVoid);
+		ranks[largestVoid] = rank;
+	}
+	return ranks;
+}
+
+OrderedDither::OrderedDither(const DitherPattern pattern, const UINT nMaxColors, const bool hasSemiTransparency)
+{
+	// the blue noise mask takes a while to make, so it is made once for good
+	static const vector<UINT> blueNoise = BlueNoiseRanks(BLUE_NOISE_BITS);
+	m_bits = pattern == DitherPattern::BlueNoise ? BLUE_NOISE_BITS : BAYER_BITS;
+	const vector<UINT> ranks = pattern == DitherPattern::BlueNoise ? blueNoise : BayerRanks(BAYER_BITS);
+
+	const double spread = 256.0 / cbrt((double) max(nMaxColors, 2U));
+	m_offsets.resize(ranks.size() * 4);
+	for (size_t i = 0; i < ranks.size(); ++i) {
+		const auto offset = (short) lround(((ranks[i] + .5) / ranks.size() - .5) * spread);
+		m_offsets[i * 4] = m_offsets[i * 4 + 1] = m_offsets[i * 4 + 2] = offset;
+		m_offsets[i * 4 + 3] = hasSemiTransparency ? offset : 0;
+	}
+}
+
+void OrderedDither::DitherRow(const ARGB* pixels, const size_t y, const UINT x, const UINT count, ARGB* dithered) const
+{
+	const UINT mask = (1 << m_bits) - 1;
+	const short* offsets = &m_offsets[(y & mask) << m_bits << 2];
+	UINT i = 0;
+#ifdef ORDERED_SSE2
+	// four pixels of the same row of the mask, their bytes widened to 16 bits, moved and saturated back
+	if ((x & 3) == 0) {
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i alphaMask = _mm_set1_epi32((int) 0xFF000000);
+		for (; i + 4 <= count; i += 4) {
+			const __m128i pixel = _mm_loadu_si128((const __m128i*) (pixels + i));
+			const short* offset = &offsets[((x + i) & mask) << 2];
+			const __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(pixel, zero), _mm_loadu_si128((const __m128i*) offset));
+			const __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(pixel, zero), _mm_loadu_si128((const __m128i*) (offset + 8)));
+			__m128i result = _mm_packus_epi16(lo, hi);
+
+			const __m128i alpha = _mm_and_si128(pixel, alphaMask);
+			const __m128i transparent = _mm_cmpeq_epi32(alpha, zero);
+			const __m128i opaque = _mm_cmpeq_epi32(alpha, alphaMask);
+			result = _mm_or_si128(_mm_and_si128(transparent, pixel), _mm_andnot_si128(transparent, result));
+			result = _mm_or_si128(result, _mm_and_si128(opaque, alphaMask));
+			_mm_storeu_si128((__m128i*) (dithered + i), result);
+		}
+	}
+#endif
+	for (; i < count; ++i) {
+		Color c(pixels[i]);
+		if (c.GetA() == 0) {
+			dithered[i] = pixels[i];
+			continue;
+		}
+
+		const short* offset = &offsets[((x + i) & mask) << 2];
+		auto clamp = [](const int value) { return (BYTE) min(max(value, 0), BYTE_MAX); };
+		const BYTE a = c.GetA() == BYTE_MAX ? BYTE_MAX : clamp(c.GetA() + offset[3]);
+		dithered[i] = Color::MakeARGB(a, clamp(c.GetR() + offset[2]), clamp(c.GetG() + offset[1]), clamp(c.GetB() + offset[0]));
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <vector>
+#include "InverseColormap.h"
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// OrderedDither
+//
+// Moves each colour by the threshold a tiled mask holds at its position
+// rather than by the error of the pixels before it, so every pixel maps on
+// its own: the rows can go to any number of threads in any order and the
+// offsets go on four pixels at a time with SSE2. The 8x8 Bayer matrix
+// shows its cross hatch, the 64x64 blue noise mask, made once by the void
+// and cluster method of Ulichney, has no pattern the eye picks up. The
+// thresholds span the step between the colours of a uniform palette of
+// nMaxColors, the alpha only moves with semi-transparency. A fully
+// transparent pixel keeps its colour and an opaque one stays opaque, so
+// they map to the same entries as without dithering.
+//
+
+class OrderedDither
+{
+	private:
+		UINT m_bits;	// the mask is 2^bits pixels square
+		vector<short> m_offsets;	// of the B, G, R and A bytes of each cell, row by row
+
+		static const UINT CHUNK = 256;
+
+	public:
+		OrderedDither(const DitherPattern pattern, const UINT nMaxColors, const bool hasSemiTransparency);
+
+		// the colours of count pixels of row y from column x on, moved by the mask
+		void DitherRow(const ARGB* pixels, const size_t y, const UINT x, const UINT count, ARGB* dithered) const;
+
+		// qPixels of the width pixels of row y, indexFn(argb) gives the entry of each dithered colour
+		template <typename IndexFn>
+		void MapRow(const ARGB* pixels, const size_t y, const UINT width, unsigned short* qPixels, const IndexFn& indexFn) const
+		{
+			ARGB dithered[CHUNK];
+			for (UINT x = 0; x < width; x += CHUNK) {
+				const UINT count = min(width - x, (UINT) CHUNK);
+				DitherRow(pixels + x, y, x, count, dithered);
+				for (UINT i = 0; i < count; ++i)
+					qPixels[x + i] = indexFn(dithered[i]);
+			}
+		}
+};
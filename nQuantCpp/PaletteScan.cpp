@@ -0,0 +1,252 @@
+#include "stdafx.h"
+#include "PaletteScan.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+// far enough from any colour that a padding entry never comes near the minimum
+const float PADDING = 1e9f;
+
+// fills distances for count entries, a multiple of the lane width, and gives candidates
+// the indices whose float distance is within rounding of the smallest one
+typedef UINT (*ScanKernel)(const float* const* channels, const float* weights, const float* point, const UINT count, float* distances, unsigned short* candidates);
+
+// bound on the float error of two distances, the coordinates are rounded to float and
+// each of the terms and sums once more
+static inline float ScanLimit(const float minDist, const float* weights)
+{
+	const float wsum = weights[0] + weights[1] + weights[2] + weights[3];
+	return minDist + minDist * 1e-5f + wsum * .05f;
+}
+
+static UINT scan_scalar(const float* const* channels, const float* weights, const float* point, const UINT count, float* distances, unsigned short* candidates)
+{
+	float minDist = PADDING;
+	for (UINT i = 0; i < count; ++i) {
+		const float d0 = channels[0][i] - point[0], d1 = channels[1][i] - point[1];
+		const float d2 = channels[2][i] - point[2], d3 = channels[3][i] - point[3];
+		distances[i] = weights[0] * d0 * d0 + weights[1] * d1 * d1 + weights[2] * d2 * d2 + weights[3] * d3 * d3;
+		minDist = min(minDist, distances[i]);
+	}
+
+	const float limit = ScanLimit(minDist, weights);
+	UINT nCandidates = 0;
+	for (UINT i = 0; i < count; ++i) {
+		if (distances[i] <= limit)
+			candidates[nCandidates++] = i;
+	}
+	return nCandidates;
+}
+
+#ifdef SCAN_X86
+TARGET_SSE2 static UINT scan_sse2(const float* const* channels, const float* weights, const float* point, const UINT count, float* distances, unsigned short* candidates)
+{
+	__m128 p[4], w[4];
+	for (int j = 0; j < 4; ++j) {
+		p[j] = _mm_set1_ps(point[j]);
+		w[j] = _mm_set1_ps(weights[j]);
+	}
+
+	__m128 minDist = _mm_set1_ps(PADDING);
+	for (UINT i = 0; i < count; i += 4) {
+		__m128 sum = _mm_setzero_ps();
+		for (int j = 0; j < 4; ++j) {
+			const __m128 diff = _mm_sub_ps(_mm_loadu_ps(channels[j] + i), p[j]);
+			sum = _mm_add_ps(sum, _mm_mul_ps(w[j], _mm_mul_ps(diff, diff)));
+		}
+		_mm_storeu_ps(distances + i, sum);
+		minDist = _mm_min_ps(minDist, sum);
+	}
+	minDist = _mm_min_ps(minDist, _mm_shuffle_ps(minDist, minDist, _MM_SHUFFLE(1, 0, 3, 2)));
+	minDist = _mm_min_ps(minDist, _mm_shuffle_ps(minDist, minDist, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	const __m128 limit = _mm_set1_ps(ScanLimit(_mm_cvtss_f32(minDist), weights));
+	UINT nCandidates = 0;
+	for (UINT i = 0; i < count; i += 4) {
+		int mask = _mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(distances + i), limit));
+		for (UINT k = i; mask; ++k, mask >>= 1) {
+			if (mask & 1)
+				candidates[nCandidates++] = k;
+		}
+	}
+	return nCandidates;
+}
+
+TARGET_AVX2 static UINT scan_avx2(const float* const* channels, const float* weights, const float* point, const UINT count, float* distances, unsigned short* candidates)
+{
+	__m256 p[4], w[4];
+	for (int j = 0; j < 4; ++j) {
+		p[j] = _mm256_set1_ps(point[j]);
+		w[j] = _mm256_set1_ps(weights[j]);
+	}
+
+	__m256 minDist = _mm256_set1_ps(PADDING);
+	for (UINT i = 0; i < count; i += 8) {
+		__m256 sum = _mm256_setzero_ps();
+		for (int j = 0; j < 4; ++j) {
+			const __m256 diff = _mm256_sub_ps(_mm256_loadu_ps(channels[j] + i), p[j]);
+			sum = _mm256_fmadd_ps(w[j], _mm256_mul_ps(diff, diff), sum);
+		}
+		_mm256_storeu_ps(distances + i, sum);
+		minDist = _mm256_min_ps(minDist, sum);
+	}
+	__m128 minHalf = _mm_min_ps(_mm256_castps256_ps128(minDist), _mm256_extractf128_ps(minDist, 1));
+	minHalf = _mm_min_ps(minHalf, _mm_shuffle_ps(minHalf, minHalf, _MM_SHUFFLE(1, 0, 3, 2)));
+	minHalf = _mm_min_ps(minHalf, _mm_shuffle_ps(minHalf, minHalf, _MM_SHUFFLE(2, 3, 0, 1)));
+
+	const __m256 limit = _mm256_set1_ps(ScanLimit(_mm_cvtss_f32(minHalf), weights));
+	UINT nCandidates = 0;
+	for (UINT i = 0; i < count; i += 8) {
+		int mask = _mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(distances + i), limit, _CMP_LE_OQ));
+		for (UINT k = i; mask; ++k, mask >>= 1) {
+			if (mask & 1)
+				candidates[nCandidates++] = k;
+		}
+	}
+	return nCandidates;
+}
+
+static bool HasAvx2()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+
+	// the OS has to save the ymm registers as well
+	__cpuid(info, 1);
+	const bool osxsave = (info[2] & (1 << 27)) != 0, fma = (info[2] & (1 << 12)) != 0;
+	if (!osxsave || !fma || (_xgetbv(0) & 6) != 6)
+		return false;
+
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+static bool HasSse2()
+{
+#if defined(_MSC_VER) || defined(__x86_64__)
+	return true;
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#endif
+}
+#endif
+
+static ScanKernel GetKernel(const char** pName = nullptr)
+{
+	static const char* name = "scalar";
+	static const ScanKernel kernel = [] {
+#ifdef SCAN_X86
+		if (HasAvx2()) {
+			name = "avx2";
+			return scan_avx2;
+		}
+		if (HasSse2()) {
+			name = "sse2";
+			return scan_sse2;
+		}
+#endif
+		return scan_scalar;
+	}();
+	if (pName)
+		*pName = name;
+	return kernel;
+}
+
+const char* PaletteScan::KernelName()
+{
+	const char* name;
+	GetKernel(&name);
+	return name;
+}
+
+void PaletteScan::Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA, const double wR, const double wG, const double wB)
+{
+	vector<double> points(nMaxColors * 4);
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c(pPalette->Entries[i]);
+		points[i * 4] = c.GetA();
+		points[i * 4 + 1] = c.GetR();
+		points[i * 4 + 2] = c.GetG();
+		points[i * 4 + 3] = c.GetB();
+	}
+	Build(points.data(), nMaxColors, wA, wR, wG, wB);
+}
+
+void PaletteScan::Build(const double* points, const UINT count, const double wA, const double w1, const double w2, const double w3)
+{
+	m_weights[0] = wA, m_weights[1] = w1, m_weights[2] = w2, m_weights[3] = w3;
+	m_points.assign(points, points + count * 4);
+
+	const UINT paddedCount = (count + 7) & ~7;
+	for (int j = 0; j < 4; ++j) {
+		m_channels[j].assign(paddedCount, PADDING);
+		for (UINT i = 0; i < count; ++i)
+			m_channels[j][i] = (float) points[i * 4 + j];
+	}
+	m_count = count;
+}
+
+unsigned short PaletteScan::Nearest(const ARGB argb) const
+{
+	Color c(argb);
+	const double point[4] = { (double) c.GetA(), (double) c.GetR(), (double) c.GetG(), (double) c.GetB() };
+	return Nearest(point);
+}
+
+unsigned short PaletteScan::Nearest(const double* point) const
+{
+	if (!IsBuilt())
+		return 0;
+
+	static thread_local vector<float> distances;
+	static thread_local vector<unsigned short> candidates;
+	const size_t paddedCount = m_channels[0].size();
+	if (distances.size() < paddedCount) {
+		distances.resize(paddedCount);
+		candidates.resize(paddedCount);
+	}
+
+	const float* channels[4] = { m_channels[0].data(), m_channels[1].data(), m_channels[2].data(), m_channels[3].data() };
+	const float weights[4] = { (float) m_weights[0], (float) m_weights[1], (float) m_weights[2], (float) m_weights[3] };
+	const float fPoint[4] = { (float) point[0], (float) point[1], (float) point[2], (float) point[3] };
+	const UINT nCandidates = GetKernel()(channels, weights, fPoint, (UINT) paddedCount, distances.data(), candidates.data());
+
+	// the candidates come in ascending order, so of equal distances the last one wins as in the scalar scans
+	unsigned short k = 0;
+	double mindist = INT_MAX;
+	for (UINT n = 0; n < nCandidates; ++n) {
+		const unsigned short index = candidates[n];
+		if (index >= m_count)
+			break;
+
+		const double* entry = &m_points[index * 4];
+		double curdist = m_weights[0] * sqr(entry[0] - point[0]);
+		curdist += m_weights[1] * sqr(entry[1] - point[1]);
+		curdist += m_weights[2] * sqr(entry[2] - point[2]);
+		curdist += m_weights[3] * sqr(entry[3] - point[3]);
+		if (curdist > mindist)
+			continue;
+
+		mindist = curdist;
+		k = index;
+	}
+	return k;
+}
@@ -0,0 +1,43 @@
+#pragma once
+#include <vector>
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PaletteScan
+//
+// Vectorised scan of every palette entry for the nearest colour, under the
+// same weighted squared distance as PaletteTree. Each channel is kept as
+// its own float array, so AVX2 takes 8 distances per instruction and SSE2
+// takes 4; the kernel is picked by what the CPU reports at run time.
+// The entries within float rounding of the smallest distance are scored
+// again in double, which keeps the index of the scalar scans, ties included.
+// The scratch buffers of a lookup belong to the calling thread, so once
+// built one instance may serve several threads.
+//
+
+class PaletteScan
+{
+	private:
+		double m_weights[4] = { 1, 1, 1, 1 };
+		vector<double> m_points;
+		vector<float> m_channels[4];	// padded to a multiple of 8 entries
+		UINT m_count = 0;
+
+	public:
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA = 1, const double wR = 1, const double wG = 1, const double wB = 1);
+		// points holds count entries of 4 coordinates each
+		void Build(const double* points, const UINT count, const double wA = 1, const double w1 = 1, const double w2 = 1, const double w3 = 1);
+		unsigned short Nearest(const ARGB argb) const;
+		unsigned short Nearest(const double* point) const;
+
+		inline bool IsBuilt() const { return m_count > 0; }
+		inline void Clear() {
+			m_count = 0;
+			m_points.clear();
+			for (auto& channel : m_channels)
+				channel.clear();
+		}
+		// avx2, sse2 or scalar
+		static const char* KernelName();
+};
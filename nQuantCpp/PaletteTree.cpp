@@ -0,0 +1,138 @@
+#include "stdafx.h"
+#include "PaletteTree.h"
+#include <algorithm>
+
+// up to this many entries are scanned in turn rather than split further
+const UINT LEAF_SIZE = 8;
+// up to this many entries the vectorised scan of the whole palette beats the tree
+const UINT SCAN_SIZE = 256;
+
+void PaletteTree::Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA, const double wR, const double wG, const double wB)
+{
+	vector<double> points(nMaxColors * 4);
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c(pPalette->Entries[i]);
+		points[i * 4] = c.GetA();
+		points[i * 4 + 1] = c.GetR();
+		points[i * 4 + 2] = c.GetG();
+		points[i * 4 + 3] = c.GetB();
+	}
+	Build(points.data(), nMaxColors, wA, wR, wG, wB);
+}
+
+void PaletteTree::Build(const double* points, const UINT count, const double wA, const double w1, const double w2, const double w3)
+{
+	Clear();
+	if (count <= SCAN_SIZE) {
+		m_scan.Build(points, count, wA, w1, w2, w3);
+		return;
+	}
+
+	m_weights[0] = wA, m_weights[1] = w1, m_weights[2] = w2, m_weights[3] = w3;
+	m_points.assign(points, points + count * 4);
+	m_order.resize(count);
+	for (UINT i = 0; i < count; ++i)
+		m_order[i] = i;
+
+	m_nodes.reserve(2 * (count / LEAF_SIZE + 1));
+	build(0, count);
+}
+
+UINT PaletteTree::build(const UINT begin, const UINT end)
+{
+	const UINT nodeIndex = m_nodes.size();
+	m_nodes.emplace_back();
+	if (end - begin <= LEAF_SIZE) {
+		m_nodes[nodeIndex].left = begin;
+		m_nodes[nodeIndex].right = end;
+		return nodeIndex;
+	}
+
+	// split across the axis of the widest weighted spread
+	int axis = 0;
+	double maxSpread = -1;
+	for (int j = 0; j < 4; ++j) {
+		double minValue = m_points[m_order[begin] * 4 + j], maxValue = minValue;
+		for (UINT i = begin + 1; i < end; ++i) {
+			const double value = m_points[m_order[i] * 4 + j];
+			minValue = min(minValue, value);
+			maxValue = max(maxValue, value);
+		}
+		const double spread = m_weights[j] * sqr(maxValue - minValue);
+		if (spread > maxSpread) {
+			maxSpread = spread;
+			axis = j;
+		}
+	}
+
+	// entries before mid are not greater than split, those from mid on are not less
+	const UINT mid = begin + (end - begin) / 2;
+	nth_element(m_order.begin() + begin, m_order.begin() + mid, m_order.begin() + end, [&](const unsigned short a, const unsigned short b) {
+		return m_points[a * 4 + axis] < m_points[b * 4 + axis];
+	});
+
+	const double split = m_points[m_order[mid] * 4 + axis];
+	const UINT left = build(begin, mid);
+	const UINT right = build(mid, end);
+	auto& node = m_nodes[nodeIndex];
+	node.axis = axis;
+	node.split = split;
+	node.left = left;
+	node.right = right;
+	return nodeIndex;
+}
+
+void PaletteTree::search(const UINT nodeIndex, const double* point, double& mindist, unsigned short& k) const
+{
+	const auto& node = m_nodes[nodeIndex];
+	if (node.axis < 0) {
+		for (UINT i = node.left; i < node.right; ++i) {
+			const unsigned short index = m_order[i];
+			const double* entry = &m_points[index * 4];
+			double curdist = m_weights[0] * sqr(entry[0] - point[0]);
+			if (curdist > mindist)
+				continue;
+
+			curdist += m_weights[1] * sqr(entry[1] - point[1]);
+			if (curdist > mindist)
+				continue;
+
+			curdist += m_weights[2] * sqr(entry[2] - point[2]);
+			if (curdist > mindist)
+				continue;
+
+			curdist += m_weights[3] * sqr(entry[3] - point[3]);
+			if (curdist > mindist || (curdist == mindist && index < k))
+				continue;
+
+			mindist = curdist;
+			k = index;
+		}
+		return;
+	}
+
+	// the far side is only skipped when its plane alone is further than the best, ties are still looked at
+	const double diff = point[node.axis] - node.split;
+	search(diff < 0 ? node.left : node.right, point, mindist, k);
+	if (m_weights[node.axis] * sqr(diff) <= mindist)
+		search(diff < 0 ? node.right : node.left, point, mindist, k);
+}
+
+unsigned short PaletteTree::Nearest(const ARGB argb) const
+{
+	Color c(argb);
+	const double point[4] = { (double) c.GetA(), (double) c.GetR(), (double) c.GetG(), (double) c.GetB() };
+	return Nearest(point);
+}
+
+unsigned short PaletteTree::Nearest(const double* point) const
+{
+	if (m_scan.IsBuilt())
+		return m_scan.Nearest(point);
+
+	unsigned short k = 0;
+	double mindist = INT_MAX;
+	if (!m_nodes.empty())
+		search(0, point, mindist, k);
+	return k;
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <vector>
+#include "PaletteScan.h"
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PaletteTree
+//
+// k-d tree over the entries of a palette, answering the nearest colour
+// under the weighted squared distance of the quantizers,
+// w[0] * dA^2 + w[1] * dR^2 + w[2] * dG^2 + w[3] * dB^2.
+// The terms are added in that order as the linear scans do and of equal
+// distances the last entry wins, so it gives the index they would give.
+// Points of alpha, L, A, B may be given instead for a Euclidean Lab metric.
+// Build it once the palette and the weights are final. Palettes up to
+// 256 entries are not split but handed to PaletteScan, which is faster there.
+// Lookups only read the tree, so a built one may be shared by threads.
+//
+
+class PaletteTree
+{
+	private:
+		struct Node {
+			int axis = -1;	// -1 for a leaf
+			double split = 0;
+			UINT left = 0, right = 0;	// children, or the range of m_order for a leaf
+		};
+
+		double m_weights[4] = { 1, 1, 1, 1 };
+		vector<double> m_points;
+		vector<unsigned short> m_order;
+		vector<Node> m_nodes;
+		PaletteScan m_scan;
+
+		UINT build(const UINT begin, const UINT end);
+		void search(const UINT nodeIndex, const double* point, double& mindist, unsigned short& k) const;
+
+	public:
+		void Build(const ColorPalette* pPalette, const UINT nMaxColors, const double wA = 1, const double wR = 1, const double wG = 1, const double wB = 1);
+		// points holds count entries of 4 coordinates each
+		void Build(const double* points, const UINT count, const double wA = 1, const double w1 = 1, const double w2 = 1, const double w3 = 1);
+		unsigned short Nearest(const ARGB argb) const;
+		unsigned short Nearest(const double* point) const;
+
+		inline bool IsBuilt() const { return !m_nodes.empty() || m_scan.IsBuilt(); }
+		inline void Clear() { m_points.clear(); m_order.clear(); m_nodes.clear(); m_scan.Clear(); }
+};
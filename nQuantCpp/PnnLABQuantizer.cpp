@@ -7,43 +7,20 @@ Copyright (c) 2018-2019 Miller Cy Chan
 #include "stdafx.h"
 #include "PnnLABQuantizer.h"
 #include "bitmapUtilities.h"
-#include "CIELABConvertor.h"
-#include <ctime>
-#include <unordered_map>
 
 namespace PnnLABQuant
 {
-	double PR = .2126, PG = .7152, PB = .0722;
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	double ratio = 1.0;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, CIELABConvertor::Lab> pixelMap;
-	unordered_map<ARGB, vector<double> > closestMap;
-
-	inline double rand_gen() {
-		return ((double)rand() / (RAND_MAX));
-	}
-
 	struct pnnbin {
 		double ac = 0, Lc = 0, Ac = 0, Bc = 0, err = 0;
-		int cnt = 0;
+		size_t cnt = 0;
 		int nn = 0, fw = 0, bk = 0, tm = 0, mtm = 0;
 	};
 
-	void getLab(const Color& c, CIELABConvertor::Lab& lab1)
+	void PnnLABQuantizer::find_nn(pnnbin* bins, int idx, const UINT& nMaxColors)
 	{
-		auto got = pixelMap.find(c.GetValue());
-		if (got == pixelMap.end()) {
-			CIELABConvertor::RGB2LAB(c, lab1);
-			pixelMap[c.GetValue()] = lab1;
-		}
-		else
-			lab1 = got->second;
-	}
+		if (m_pStats)
+			++m_pStats->nnSearches;
 
-	void find_nn(pnnbin* bins, int idx, const UINT& nMaxColors)
-	{
 		int nn = 0;
 		double err = INT_MAX;
 
@@ -51,7 +28,10 @@ namespace PnnLABQuant
 		auto n1 = bin1.cnt;
 		CIELABConvertor::Lab lab1;
 		lab1.alpha = bin1.ac, lab1.L = bin1.Lc, lab1.A = bin1.Ac, lab1.B = bin1.Bc;
-		bool crossover = rand_gen() < ratio;
+		bool crossover = m_random.NextDouble() < ratio;
+		CIELABConvertor::PreparedLab prepared1;
+		if (crossover)
+			CIELABConvertor::Prepare(lab1, prepared1);
 		for (int i = bin1.fw; i; i = bins[i].fw) {
 			double n2 = bins[i].cnt;
 			double nerr2 = (n1 * n2) / (n1 + n2);
@@ -71,12 +51,21 @@ namespace PnnLABQuant
 				if (nerr >= err)
 					continue;
 
+				// the chroma and hue terms are only summed up to err when the bound on both of them stays under it
+				CIELABConvertor::PreparedLab prepared2;
+				CIELABConvertor::Prepare(lab2, prepared2);
+				if (nerr + nerr2 * CIELABConvertor::CH_prime_sqr_lower_bound(prepared1, prepared2) >= err)
+					continue;
+
 				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(prepared1, prepared2, a1Prime, a2Prime, CPrime1, CPrime2);
 				nerr += nerr2 * sqr(deltaC_prime_div_k_L_S_L);
 				if (nerr >= err)
 					continue;
 
+				if (nerr + nerr2 * CIELABConvertor::H_prime_sqr_lower_bound(prepared1, prepared2, a1Prime, a2Prime, CPrime1, CPrime2) >= err)
+					continue;
+
 				double barCPrime, barhPrime;
 				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
 				nerr += nerr2 * sqr(deltaH_prime_div_k_L_S_L);
@@ -109,7 +98,7 @@ namespace PnnLABQuant
 		bin1.nn = nn;
 	}
 
-	int PnnLABQuantizer::pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	int PnnLABQuantizer::pnnquan(const PixelSpan& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
 	{
 		auto bins = make_unique<pnnbin[]>(65536);
 		auto heap = make_unique<int[]>(65537);
@@ -123,7 +112,7 @@ namespace PnnLABQuant
 			int index = GetARGBIndex(c, hasSemiTransparency);
 
 			CIELABConvertor::Lab lab1;
-			getLab(c, lab1);
+			CIELABConvertor::RGB2LAB(c, lab1);
 			auto& tb = bins[index];
 			tb.ac += c.GetA();
 			tb.Lc += lab1.L;
@@ -151,6 +140,9 @@ namespace PnnLABQuant
 			++maxbins;
 		}
 
+		if (m_pStats)
+			m_pStats->uniqueColors += maxbins;
+
 		for (int i = 0; i < maxbins - 1; ++i) {
 			bins[i].fw = i + 1;
 			bins[i + 1].bk = i;
@@ -206,6 +198,8 @@ namespace PnnLABQuant
 			}
 
 			/* Do a merge */
+			if (m_pStats)
+				++m_pStats->merges;
 			auto& tb = bins[b1];
 			auto& nb = bins[tb.nn];
 			n1 = tb.cnt;
@@ -242,14 +236,26 @@ namespace PnnLABQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnLABQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
+		if (nMaxColors > 32) {
+			if (!m_paletteTree.IsBuilt())
+				m_paletteTree.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+			return m_paletteTree.Nearest(argb);
+		}
+
 		unsigned short k = 0;
 		Color c(argb);
 
 		double mindist = INT_MAX;
-		CIELABConvertor::Lab lab1, lab2;
-		getLab(c, lab1);
+		CIELABConvertor::Lab lab;
+		CIELABConvertor::RGB2LAB(c, lab);
+		CIELABConvertor::PreparedLab lab1;
+		CIELABConvertor::Prepare(lab, lab1);
+		if (m_paletteLabs.empty()) {
+			m_paletteLabs.resize(nMaxColors);
+			CIELABConvertor::Prepare(pPalette->Entries, nMaxColors, m_paletteLabs.data());
+		}
 
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			Color c2(pPalette->Entries[i]);
@@ -257,39 +263,29 @@ namespace PnnLABQuant
 			if (curdist > mindist)
 				continue;
 
-			if (nMaxColors > 32) {
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-			}
-			else {
-				getLab(c2, lab2);
+			const auto& lab2 = m_paletteLabs[i];
 
-				double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1, lab2);
-				curdist += sqr(deltaL_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
+			double deltaL_prime_div_k_L_S_L = CIELABConvertor::L_prime_div_k_L_S_L(lab1.lab, lab2.lab);
+			curdist += sqr(deltaL_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
 
-				double a1Prime, a2Prime, CPrime1, CPrime2;
-				double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
-				curdist += sqr(deltaC_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
+			double a1Prime, a2Prime, CPrime1, CPrime2;
+			double deltaC_prime_div_k_L_S_L = CIELABConvertor::C_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2);
+			curdist += sqr(deltaC_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
+			// skip the hue angles when even the least the hue term can add is too much
+			if (curdist + CIELABConvertor::H_prime_sqr_lower_bound(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2) > mindist)
+				continue;
 
-				double barCPrime, barhPrime;
-				double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1, lab2, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
-				curdist += sqr(deltaH_prime_div_k_L_S_L);
-				if (curdist > mindist)
-					continue;
+			double barCPrime, barhPrime;
+			double deltaH_prime_div_k_L_S_L = CIELABConvertor::H_prime_div_k_L_S_L(lab1.lab, lab2.lab, a1Prime, a2Prime, CPrime1, CPrime2, barCPrime, barhPrime);
+			curdist += sqr(deltaH_prime_div_k_L_S_L);
+			if (curdist > mindist)
+				continue;
 
-				curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
-			}
+			curdist += CIELABConvertor::R_T(barCPrime, barhPrime, deltaC_prime_div_k_L_S_L, deltaH_prime_div_k_L_S_L);
 
 			if (curdist > mindist)
 				continue;
@@ -299,21 +295,28 @@ namespace PnnLABQuant
 		return k;
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnLABQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<double> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		double closest[5] = { 0 };
+		const bool found = closestMap.Find(argb, closest);
+		if (m_pStats)
+			(found ? m_pStats->closestHits : m_pStats->closestMisses)++;
+		if (!found) {
 			closest[2] = closest[3] = SHORT_MAX;
 
-			CIELABConvertor::Lab lab1, lab2;
-			getLab(c, lab1);
+			CIELABConvertor::Lab lab;
+			CIELABConvertor::RGB2LAB(c, lab);
+			CIELABConvertor::PreparedLab lab1;
+			CIELABConvertor::Prepare(lab, lab1);
+			if (m_paletteLabs.empty()) {
+				m_paletteLabs.resize(nMaxColors);
+				CIELABConvertor::Prepare(pPalette->Entries, nMaxColors, m_paletteLabs.data());
+			}
 			for (; k < nMaxColors; ++k) {
-				Color c2(pPalette->Entries[k]);
-				getLab(c2, lab2);
-				closest[4] = sqr(lab2.alpha - lab1.alpha) + CIELABConvertor::CIEDE2000(lab2, lab1);
+				const auto& lab2 = m_paletteLabs[k];
+				closest[4] = sqr(lab2.lab.alpha - lab1.lab.alpha) + CIELABConvertor::CIEDE2000(lab2, lab1);
 				//closest[4] = abs(lab2.alpha - lab1.alpha) + abs(lab2.L - lab1.L) + abs(lab2.A - lab1.A) + abs(lab2.B - lab1.B);
 				if (closest[4] < closest[2]) {
 					closest[1] = closest[0];
@@ -329,48 +332,79 @@ namespace PnnLABQuant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (int)ceil(closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next((UINT) ceil(closest[3] + closest[2])) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
 
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	bool PnnLABQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
 	{
-		if (dither)
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
-
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
-		UINT pixelIndex = 0;
-		for (int j = 0; j < height; ++j) {
-			for (int i = 0; i < width; ++i, ++pixelIndex)
-				qPixels[pixelIndex] = ditherFn(pPalette, nMaxColors, pixels[pixelIndex]);
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			// at 32 colors or fewer the match is not a distance the colormap can hold
+			auto pColormap = nMaxColors > 32 ? MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB) : nullptr;
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
+
+		// a block draws its tie-breaks from a seed of its own, whichever thread maps it
+		const bool closest = m_transparentPixelIndex < 0 && nMaxColors >= 256;
+		const UINT seed = closest ? m_random.Next() : 0;
+		// over 32 colors the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && !closest && nMaxColors > 32)
+			nearestMap.Build(pPalette, nMaxColors, 1, PR, PG, PB);
+		RemapBlocks(*this, (size_t) width * height, m_remapThreads, m_pStats, [&](PnnLABQuantizer& worker, const size_t block, const size_t first, const size_t last) {
+			if (closest) {
+				worker.m_random.Seed(seed + block);
+				auto closestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(closestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+			else if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			else {
+				auto nearestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.nearestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(nearestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+		});
 		return true;
 	}
 
-	bool PnnLABQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool PnnLABQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
+
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
 
+	bool PnnLABQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		srand(time(NULL));
-		bool quan_sqrt = rand_gen() < nMaxColors / 64.0;
+		bool quan_sqrt = m_random.NextDouble() < nMaxColors / 64.0;
 		if (nMaxColors > 2)
 			pnnquan(pixels, pPalette, nMaxColors, quan_sqrt);
 		else {
@@ -384,16 +418,21 @@ namespace PnnLABQuant
 			}
 		}
 
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+		m_paletteLabs.clear();
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return nearestColorIndex(pPalette, nMaxColors, argb);
+			};
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency, 1, PR, PG, PB);
+			dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+			return true;
 		}
 		if (hasSemiTransparency)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -402,10 +441,31 @@ namespace PnnLABQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		pixelMap.clear();
-		closestMap.clear();
+		closestMap.Clear();
+
+		return true;
+	}
+
+#ifdef _WIN32
+	bool PnnLABQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool PnnLABQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
@@ -1,6 +1,12 @@
 #pragma once
+#include "CIELABConvertor.h"
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 using namespace std;
 
 namespace PnnLABQuant
@@ -21,10 +27,45 @@ namespace PnnLABQuant
 	// Use at your own risk!
 	// =============================================================
 
+	struct pnnbin;
+
 	class PnnLABQuantizer
 	{
+		private:
+			double PR = .2126, PG = .7152, PB = .0722;
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			double ratio = 1.0;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			FastRandom m_random;
+			PaletteTree m_paletteTree;
+			vector<CIELABConvertor::PreparedLab> m_paletteLabs;	// of the palette entries, for the CIEDE2000 scans
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			bool m_useNearestMap = false;
+			ClosestCache<double> closestMap;
+
+			void find_nn(pnnbin* bins, int idx, const UINT& nMaxColors);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither);
+
 		public:
-			int pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt);
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			inline void SetClosestCacheSize(const size_t nEntries) { closestMap.SetCapacity(nEntries); }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			// remap without dithering through a NearestMap, which starts each search from the match of the previous pixel
+			inline void SetNearestMap(const bool enabled) { m_useNearestMap = enabled; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			int pnnquan(const PixelSpan& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt);
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
@@ -7,23 +7,20 @@ Copyright (c) 2018-2019 Miller Cy Chan
 #include "stdafx.h"
 #include "PnnQuantizer.h"
 #include "bitmapUtilities.h"
-#include <unordered_map>
 
 namespace PnnQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-
 	struct pnnbin {
 		double ac = 0, rc = 0, gc = 0, bc = 0, err = 0;
-		int cnt = 0;
+		size_t cnt = 0;
 		int nn = 0, fw = 0, bk = 0, tm = 0, mtm = 0;
 	};
 
-	void find_nn(pnnbin* bins, int idx)
+	void PnnQuantizer::find_nn(pnnbin* bins, int idx)
 	{
+		if (m_pStats)
+			++m_pStats->nnSearches;
+
 		int i, nn = 0;
 		double err = 1e100;
 
@@ -48,25 +45,40 @@ namespace PnnQuant
 		bin1.nn = nn;
 	}
 
-	int pnnquan(const vector<ARGB>& pixels, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
+	int PnnQuantizer::pnnquan(const SourceImage& source, ColorPalette* pPalette, UINT nMaxColors, bool quan_sqrt)
 	{
 		auto bins = make_unique<pnnbin[]>(65536);
 		auto heap = make_unique<int[]>(65537);
 		double err, n1, n2;
 
 		/* Build histogram */
-		for (const auto& pixel : pixels) {
-			// !!! Can throw gamma correction in here, but what to do about perceptual
-			// !!! nonuniformity then?
-			Color c(pixel);
+		for (const auto& entry : source.histogram) {
+			// Sums of whole channel values stay exact, so this matches the per pixel loop
+			Color c(entry.first);
 			int index = GetARGBIndex(c, hasSemiTransparency);
 			auto& tb = bins[index];
 			if (hasSemiTransparency)
-				tb.ac += c.GetA();
-			tb.rc += c.GetR();
-			tb.gc += c.GetG();
-			tb.bc += c.GetB();
-			tb.cnt++;
+				tb.ac += (double) c.GetA() * entry.second;
+			tb.rc += (double) c.GetR() * entry.second;
+			tb.gc += (double) c.GetG() * entry.second;
+			tb.bc += (double) c.GetB() * entry.second;
+			tb.cnt += entry.second;
+		}
+
+		if (source.histogram.empty()) {
+			for (const auto& pixel : source.pixels) {
+				// !!! Can throw gamma correction in here, but what to do about perceptual
+				// !!! nonuniformity then?
+				Color c(pixel);
+				int index = GetARGBIndex(c, hasSemiTransparency);
+				auto& tb = bins[index];
+				if (hasSemiTransparency)
+					tb.ac += c.GetA();
+				tb.rc += c.GetR();
+				tb.gc += c.GetG();
+				tb.bc += c.GetB();
+				tb.cnt++;
+			}
 		}
 
 		/* Cluster nonempty bins at one end of array */
@@ -89,6 +101,9 @@ namespace PnnQuant
 			++maxbins;
 		}
 
+		if (m_pStats)
+			m_pStats->uniqueColors += maxbins;
+
 		for (int i = 0; i < maxbins - 1; ++i) {
 			bins[i].fw = i + 1;
 			bins[i + 1].bk = i;
@@ -142,6 +157,8 @@ namespace PnnQuant
 			}
 
 			/* Do a merge */
+			if (m_pStats)
+				++m_pStats->merges;
 			auto& tb = bins[b1];
 			auto& nb = bins[tb.nn];
 			n1 = tb.cnt;
@@ -176,43 +193,22 @@ namespace PnnQuant
 		return 0;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnQuantizer::nearestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
-		unsigned short k = 0;
-		Color c(argb);
-
-		double mindist = INT_MAX;
-		for (UINT i = 0; i < nMaxColors; ++i) {
-			Color c2(pPalette->Entries[i]);
-			double curdist = sqr(c2.GetA() - c.GetA());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetR() - c.GetR());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetG() - c.GetG());
-			if (curdist > mindist)
-				continue;
-
-			curdist += sqr(c2.GetB() - c.GetB());
-			if (curdist > mindist)
-				continue;
-
-			mindist = curdist;
-			k = i;
-		}
-		return k;
+		if (!m_paletteTree.IsBuilt())
+			m_paletteTree.Build(pPalette, nMaxColors);
+		return m_paletteTree.Nearest(argb);
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short PnnQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		const bool found = closestMap.Find(argb, closest);
+		if (m_pStats)
+			(found ? m_pStats->closestHits : m_pStats->closestMisses)++;
+		if (!found) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; ++k) {
@@ -232,49 +228,83 @@ namespace PnnQuant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
 
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
-	{		
-		if (dither) 
-			return dither_image(pixels, pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height);
-
-		DitherFn ditherFn = (m_transparentPixelIndex >= 0 || nMaxColors < 256) ? nearestColorIndex : closestColorIndex;
-		UINT pixelIndex = 0;
-		for (int j = 0; j < height; ++j) {
-			for (int i = 0; i < width; ++i, ++pixelIndex)
-				qPixels[pixelIndex] = ditherFn(pPalette, nMaxColors, pixels[pixelIndex]);
+	bool PnnQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, const bool dither)
+	{
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (dither) {
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			return dither_image(pixels, pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, width, height, m_pStats, pColormap.get(), m_ditherLookup);
 		}
 
+		// a block draws its tie-breaks from a seed of its own, whichever thread maps it
+		const bool closest = m_transparentPixelIndex < 0 && nMaxColors >= 256;
+		const UINT seed = closest ? m_random.Next() : 0;
+		// the NearestMap gives the index of the PaletteTree in nearestColorIndex
+		NearestMap nearestMap;
+		if (m_useNearestMap && !closest)
+			nearestMap.Build(pPalette, nMaxColors);
+		RemapBlocks(*this, (size_t) width * height, m_remapThreads, m_pStats, [&](PnnQuantizer& worker, const size_t block, const size_t first, const size_t last) {
+			if (closest) {
+				worker.m_random.Seed(seed + block);
+				auto closestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(closestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+			else if (nearestMap.IsBuilt())
+				MatchPixels(nearestMap, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			else {
+				auto nearestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.nearestColorIndex(pPalette, nMaxColors, argb);
+				};
+				MatchPixels(nearestFn, pPalette, nMaxColors, pixels + first, last - first, qPixels + first);
+			}
+		});
+
 		return true;
 	}	
 
-	bool PnnQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool PnnQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
 
-		int pixelIndex = 0;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);		
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	void PnnQuantizer::build_palette(const SourceImage& source, ColorPalette* pPalette, UINT& nMaxColors)
+	{
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 		
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		if (nMaxColors > 2)
-			pnnquan(pixels, pPalette, nMaxColors, true);
+		if (nMaxColors > 2) {
+			string key;
+			if (m_pPaletteCache) {
+				key = PaletteKey("PNN", source, nMaxColors);
+				if (m_pPaletteCache->Find(key, pPalette, nMaxColors))
+					return;
+			}
+			pnnquan(source, pPalette, nMaxColors, true);
+			if (m_pPaletteCache)
+				m_pPaletteCache->Store(key, pPalette);
+		}
 		else {
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
@@ -285,15 +315,28 @@ namespace PnnQuant
 				pPalette->Entries[1] = Color::White;
 			}
 		}
-		
+	}
+
+	bool PnnQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
+
+		const auto& pixels = source.pixels;
+		build_palette(source, pPalette, nMaxColors);
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
 		if (nMaxColors > 256) {
-			auto qPixels = make_unique<ARGB[]>(pixels.size());
-			dithering_image(pixels.data(), pPalette, nearestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-			return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+			auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return nearestColorIndex(pPalette, nMaxColors, argb);
+			};
+			auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency);
+			dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+			return true;
 		}
 
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight, dither);
+		quantize_image(pixels.data(), pPalette, nMaxColors, qPixels, bitmapWidth, bitmapHeight, dither);
 
 		if (m_transparentPixelIndex >= 0) {
 			UINT k = qPixels[m_transparentPixelIndex];
@@ -302,9 +345,120 @@ namespace PnnQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
+		closestMap.Clear();
+
+		return true;
+	}
+
+	bool PnnQuantizer::QuantizeImage(const ReadBandFn& readBand, const UINT width, const UINT height, ColorPalette* pPalette, const WriteBandFn& writeBand, UINT& nMaxColors, bool dither, const UINT bandHeight)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage source;
+		if (!ScanBands(readBand, width, height, bandHeight, source))
+			return false;
+
+		build_palette(source, pPalette, nMaxColors);
+		source.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+
+		// the same choice of mapping as quantize_image, more than 256 colours are always dithered
+		auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nearestColorIndex(pPalette, nMaxColors, argb);
+		};
+		// reseeded at the blocks of quantize_image, so that bands map as the whole image does
+		const UINT seed = m_random.Next();
+		size_t pixelIndex = 0;
+		auto closestFn = [this, seed, &pixelIndex](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			if (pixelIndex % REMAP_BLOCK == 0)
+				m_random.Seed(seed + pixelIndex / REMAP_BLOCK);
+			++pixelIndex;
+			return closestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (nMaxColors > 256)
+			dither = true;
+
+		int k = -1;
+		auto pColormap = dither ? MakeInverseColormap(m_ditherLookup, pPalette, nMaxColors, hasSemiTransparency) : nullptr;
+		bool result;
+		if (!dither && m_transparentPixelIndex < 0 && nMaxColors >= 256)
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, closestFn, dither, hasSemiTransparency, nMaxColors, k, m_pStats);
+		else if (!dither && m_useNearestMap) {
+			NearestMap nearestMap;
+			nearestMap.Build(pPalette, nMaxColors);
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, nearestMap, dither, hasSemiTransparency, nMaxColors, k, m_pStats);
+		}
+		else
+			result = RemapBands(readBand, writeBand, width, height, bandHeight, pPalette, ditherFn, dither, hasSemiTransparency, nMaxColors, k, m_pStats, pColormap.get(), m_ditherLookup);
+		if (result && k >= 0 && nMaxColors <= 256) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		closestMap.Clear();
+
+		return result;
+	}
+
+	bool PnnQuantizer::QuantizeImages(const vector<const SourceImage*>& sources, ColorPalette* pPalette, const vector<unsigned short*>& qPixels, UINT& nMaxColors, bool dither, UINT nThreads)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage merged;
+		if (qPixels.size() != sources.size() || !MergeHistograms(sources, merged))
+			return false;
+
+		build_palette(merged, pPalette, nMaxColors);
+		merged.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+		closestMap.Clear();
+
+		// each image is mapped by its own copy of this quantizer, taken with the tree and the caches empty so
+		// that it holds the settings and none of the lookups, which each thread then builds for itself
+		ParallelFor(sources.size(), nThreads, [&](size_t i) {
+			auto worker = *this;
+			worker.m_pStats = nullptr;
+			const auto& source = *sources[i];
+			worker.quantize_image(source.pixels.data(), pPalette, nMaxColors, qPixels[i], source.width, source.height, dither || nMaxColors > 256);
+		});
+
+		for (size_t i = sources.size(); i-- > 0 && nMaxColors <= 256; ) {
+			if (sources[i]->transparentPixelIndex < 0)
+				continue;
+
+			UINT k = qPixels[i][sources[i]->transparentPixelIndex];
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+			break;
+		}
+		closestMap.Clear();
+
+		return true;
+	}
+
+#ifdef _WIN32
+	bool PnnQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool PnnQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
@@ -0,0 +1,106 @@
+#pragma once
+// Minimal stand-ins for the Windows and GDI+ value types used by the quantizers,
+// so that the raw buffer entry points build with g++ or clang where GDI+ is not available.
+// Only the types are provided here, Gdiplus::Bitmap and the code using it stay Windows only.
+
+#include <cfloat>
+#include <climits>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+#include <string>
+#include <type_traits>
+
+typedef unsigned char BYTE;
+typedef unsigned short USHORT;
+typedef int INT;
+typedef unsigned int UINT;
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef uint32_t DWORD;
+typedef int BOOL;
+typedef float REAL;
+typedef uint32_t ARGB;
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define BYTE_MAX 0xff
+#define SHORT_MAX 32767
+#define USHORT_MAX 0xffff
+
+// windows.h min and max accept mixed operand types, std::min and std::max do not
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type min(const T& a, const U& b)
+{
+	return (a < b) ? a : b;
+}
+
+template <typename T, typename U>
+inline typename std::common_type<T, U>::type max(const T& a, const U& b)
+{
+	return (a > b) ? a : b;
+}
+
+namespace Gdiplus
+{
+	class Color
+	{
+	public:
+		Color() : Argb(Color::Black) {}
+		Color(ARGB argb) : Argb(argb) {}
+		Color(BYTE r, BYTE g, BYTE b) : Argb(MakeARGB(BYTE_MAX, r, g, b)) {}
+		Color(BYTE a, BYTE r, BYTE g, BYTE b) : Argb(MakeARGB(a, r, g, b)) {}
+
+		BYTE GetAlpha() const { return (BYTE)(Argb >> AlphaShift); }
+		BYTE GetA() const { return GetAlpha(); }
+		BYTE GetRed() const { return (BYTE)(Argb >> RedShift); }
+		BYTE GetR() const { return GetRed(); }
+		BYTE GetGreen() const { return (BYTE)(Argb >> GreenShift); }
+		BYTE GetG() const { return GetGreen(); }
+		BYTE GetBlue() const { return (BYTE)(Argb >> BlueShift); }
+		BYTE GetB() const { return GetBlue(); }
+
+		ARGB GetValue() const { return Argb; }
+		void SetValue(ARGB argb) { Argb = argb; }
+		DWORD ToCOLORREF() const { return GetRed() | (GetGreen() << 8) | (GetBlue() << 16); }
+
+		static ARGB MakeARGB(BYTE a, BYTE r, BYTE g, BYTE b)
+		{
+			return ((ARGB)b << BlueShift) | ((ARGB)g << GreenShift) | ((ARGB)r << RedShift) | ((ARGB)a << AlphaShift);
+		}
+
+		enum : ARGB
+		{
+			Black = 0xFF000000,
+			White = 0xFFFFFFFF,
+			Transparent = 0x00FFFFFF
+		};
+
+		enum
+		{
+			AlphaShift = 24,
+			RedShift = 16,
+			GreenShift = 8,
+			BlueShift = 0
+		};
+
+	protected:
+		ARGB Argb;
+	};
+
+	struct ColorPalette
+	{
+		UINT Flags;
+		UINT Count;
+		ARGB Entries[1];
+	};
+}
+using namespace Gdiplus;
@@ -36,10 +36,6 @@ SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 namespace SpatialQuant
 {
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-
 	template <typename T, int length>
 	class vector_fixed
 	{
@@ -298,10 +294,10 @@ namespace SpatialQuant
 			return data[row * width * depth + col * depth + layer];
 		}
 
-		void fill_random() {
+		void fill_random(FastRandom& random) {
 			const int volume = width * height * depth;
 			for (int i = 0; i < volume; ++i)
-				data[i] = ((double)rand()) / RAND_MAX;
+				data[i] = random.NextDouble();
 		}
 
 		inline int get_width()  const { return width; }
@@ -335,7 +331,7 @@ namespace SpatialQuant
 	void random_permutation_2d(int width, int height, deque<pair<int, int> >& result) {
 		vector<int> perm1d;
 		random_permutation(width * height, perm1d);
-		for (auto& it = perm1d.cbegin(); it != perm1d.cend(); ++it)
+		for (auto it = perm1d.cbegin(); it != perm1d.cend(); ++it)
 			result.emplace_front(*it % width, *it / width);
 	}
 
@@ -378,7 +374,7 @@ namespace SpatialQuant
 		return b(k_x, k_y);
 	}
 
-	void compute_a_image(const vector<ARGB>& image, array2d<vector_fixed<double, 4> >& b, array2d<vector_fixed<double, 4> >& a)
+	void compute_a_image(const PixelSpan& image, array2d<vector_fixed<double, 4> >& b, array2d<vector_fixed<double, 4> >& a)
 	{
 		const int a_width = a.get_width(), a_height = a.get_height();
 		const int radius_width = (b.get_width() - 1) / 2, radius_height = (b.get_height() - 1) / 2;
@@ -503,7 +499,7 @@ namespace SpatialQuant
 		}
 	}
 
-	void compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
+	void SpatialQuantizer::compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		const int palette_size = s.get_width();
@@ -523,7 +519,7 @@ namespace SpatialQuant
 					for (int j_x = max(0, i_x - center_x); j_x < max_j_x; ++j_x) {
 						if (i_x == j_x && i_y == j_y)
 							continue;
-						auto& b_ij = b_value(b, i_x, i_y, j_x, j_y);
+						auto b_ij = b_value(b, i_x, i_y, j_x, j_y);
 						for (int v = 0; v < palette_size; ++v) {
 							auto v1 = coarse_variables(i_x, i_y, v);
 							for (int alpha = v; alpha < palette_size; ++alpha) {
@@ -540,7 +536,7 @@ namespace SpatialQuant
 		}
 	}
 
-	void update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
+	void SpatialQuantizer::update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
 		const int j_x, const int j_y, const int alpha, const double delta)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
@@ -569,7 +565,7 @@ namespace SpatialQuant
 		s(alpha, alpha) += delta * b_value(b, 0, 0, 0, 0);
 	}
 
-	void refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
+	void SpatialQuantizer::refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
 		const array2d<vector_fixed<double, 4> >& a, vector<vector_fixed<double, 4> >& palette)
 	{
 		// We only computed the half of S above the diagonal - reflect it
@@ -591,9 +587,9 @@ namespace SpatialQuant
 
 		const int length = hasSemiTransparency ? 4 : 3;
 		for (int k = 0; k < length; ++k) {
-			auto& S_k = extract_vector_layer_2d(s, k);
-			auto& R_k = extract_vector_layer_1d(r, k);
-			auto& palette_channel = (-2.0 * S_k).matrix_inverse() * R_k;
+			auto S_k = extract_vector_layer_2d(s, k);
+			auto R_k = extract_vector_layer_1d(r, k);
+			auto palette_channel = (-2.0 * S_k).matrix_inverse() * R_k;
 			for (UINT v = 0; v < nMaxColor; ++v) {
 				double val = palette_channel[v];
 				if (val < 0.0 || isnan(val))
@@ -626,9 +622,9 @@ namespace SpatialQuant
 		}
 	}
 
-	bool spatial_color_quant(const vector<ARGB>& image, array2d<vector_fixed<double, 4> >& filter_weights,
+	bool SpatialQuantizer::spatial_color_quant(const PixelSpan& image, array2d<vector_fixed<double, 4> >& filter_weights,
 		unsigned short* quantized_image, const int bitmapWidth, vector<vector_fixed<double, 4> >& palette,
-		const double initial_temperature = 1.0, const double final_temperature = 0.001, const int temps_per_level = 3, const int repeats_per_temp = 1)
+		const double initial_temperature, const double final_temperature, const int temps_per_level, const int repeats_per_temp)
 	{
 		const int length = hasSemiTransparency ? 4 : 3;
 		const int bitmapHeight = image.size() / bitmapWidth;
@@ -640,7 +636,7 @@ namespace SpatialQuant
 			bitmapHeight >> max_coarse_level,
 			nMaxColor);
 
-		p_coarse_variables->fill_random();
+		p_coarse_variables->fill_random(m_random);
 
 		double temperature = initial_temperature;
 
@@ -697,6 +693,9 @@ namespace SpatialQuant
 		auto p_palette_sum = make_unique<array2d< vector_fixed<double, 4> > >(p_coarse_variables->get_width(), p_coarse_variables->get_height());
 		compute_initial_j_palette_sum(*p_palette_sum, *p_coarse_variables, palette);
 
+		if (m_pStats)
+			++m_pStats->levels;
+
 		const double divisor = 1.0 / (255.0 * 255.0);
 		while (coarse_level >= 0 || temperature > final_temperature) {
 			// Need to reseat this reference in case we changed p_coarse_variables
@@ -706,7 +705,7 @@ namespace SpatialQuant
 			auto& a = a_vec[coarse_level];
 			auto& b = b_vec[coarse_level];
 			const int b_width = b.get_width(), b_height = b.get_height();
-			auto& middle_b = b_value(b, 0, 0, 0, 0);
+			auto middle_b = b_value(b, 0, 0, 0, 0);
 
 			const int center_x = (b_width - 1) / 2, center_y = (b_height - 1) / 2;
 			const int min_x = min(1, center_x - 1), min_y = min(1, center_y - 1);
@@ -743,7 +742,7 @@ namespace SpatialQuant
 								continue;
 							if (j_x < 0 || j_x >= coarse_width)
 								continue;
-							auto& b_ij = b_value(b, i_x, i_y, j_x, j_y);
+							auto b_ij = b_value(b, i_x, i_y, j_x, j_y);
 							auto& j_pal = (*p_palette_sum)(j_x, j_y);
 							for (BYTE p = 0; p < length; ++p)
 								p_i[p] += b_ij[p] * j_pal[p];
@@ -835,11 +834,15 @@ namespace SpatialQuant
 			}
 
 			++iters_at_current_level;
+			if (m_pStats)
+				++m_pStats->iterations;
 			skip_palette_maintenance = false;
 			if ((temperature <= final_temperature || coarse_level > 0) && iters_at_current_level >= iters_per_level) {
 				if (--coarse_level < 0)
 					break;
 
+				if (m_pStats)
+					++m_pStats->levels;
 				auto p_old_coarse_variables = make_unique<array3d<double> >(bitmapWidth >> coarse_level, bitmapHeight >> coarse_level, nMaxColor);
 				swap(p_old_coarse_variables, p_coarse_variables);
 				zoom_double(*p_old_coarse_variables, *p_coarse_variables);
@@ -861,16 +864,25 @@ namespace SpatialQuant
 		return true;
 	}
 
-	bool SpatialQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	bool SpatialQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
+
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither);
+	}
+
+	bool SpatialQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither)
 	{
-		const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
 
-		hasSemiTransparency = false;
-		m_transparentPixelIndex = -1;
-		vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-		GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+		const auto& pixels = source.pixels;
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
 
 		const int length = hasSemiTransparency ? 4 : 3;
 		double dithering_level = 1.0;
@@ -894,23 +906,19 @@ namespace SpatialQuant
 		vector<vector_fixed<double, 4> > palette(nMaxColors);
 		for (UINT i = 0; i < nMaxColors; ++i) {
 			for (BYTE p = 0; p < length; ++p)
-				palette[i][p] = ((double)rand()) / RAND_MAX;
+				palette[i][p] = m_random.NextDouble();
 		}
 
 		if (nMaxColors > 256)
 			nMaxColors = 256;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(pDest->GetPaletteSize());
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 
-		if (nMaxColors == 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
-
-		auto qPixels = make_unique<unsigned short[]>(pixels.size());
-		if (!spatial_color_quant(pixels, filter3_weights, qPixels.get(), bitmapWidth, palette))
+		if (!spatial_color_quant(pixels, filter3_weights, qPixels, bitmapWidth, palette))
 			return false;
 
+		// the palette and the indices are optimised together
+		timer.PaletteBuilt();
 		if (nMaxColors > 2) {
 			/* Fill palette */
 			for (UINT k = 0; k < nMaxColors; ++k)
@@ -935,7 +943,29 @@ namespace SpatialQuant
 			}
 		}
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+#ifdef _WIN32
+	bool SpatialQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither);
+	}
+
+	bool SpatialQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
\ No newline at end of file
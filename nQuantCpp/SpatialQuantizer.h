@@ -1,6 +1,7 @@
 #pragma once
 #include <memory>
 #include <vector>
+#include "bitmapUtilities.h"
 using namespace std;
 
 namespace SpatialQuant
@@ -21,9 +22,39 @@ namespace SpatialQuant
 	// Use at your own risk!
 	// =============================================================
 
+	template <typename T, int length>
+	class vector_fixed;
+	template <typename T>
+	class array2d;
+	template <typename T>
+	class array3d;
+
 	class SpatialQuantizer
 	{
+		private:
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			FastRandom m_random;
+
+			void compute_initial_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b);
+			void update_s(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables, array2d<vector_fixed<double, 4> >& b,
+				const int j_x, const int j_y, const int alpha, const double delta);
+			void refine_palette(array2d<vector_fixed<double, 4> >& s, const array3d<double>& coarse_variables,
+				const array2d<vector_fixed<double, 4> >& a, vector<vector_fixed<double, 4> >& palette);
+			bool spatial_color_quant(const PixelSpan& image, array2d<vector_fixed<double, 4> >& filter_weights,
+				unsigned short* quantized_image, const int bitmapWidth, vector<vector_fixed<double, 4> >& palette,
+				const double initial_temperature = 1.0, const double final_temperature = 0.001, const int temps_per_level = 3, const int repeats_per_temp = 1);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true);
+#endif
 	};
 }
\ No newline at end of file
@@ -23,7 +23,6 @@
 #include "stdafx.h"
 #include "WuQuantizer.h"
 #include "bitmapUtilities.h"
-#include <unordered_map>
 
 namespace nQuant
 {
@@ -37,13 +36,6 @@ namespace nQuant
 	const BYTE SIDESIZE = MAXSIDEINDEX + 1;
 	const UINT TOTAL_SIDESIZE = SIDESIZE * SIDESIZE * SIDESIZE * SIDESIZE;
 
-	bool hasSemiTransparency = false;
-	int m_transparentPixelIndex = -1;
-	ARGB m_transparentColor = Color::Transparent;
-	double PR = .2126, PG = .7152, PB = .0722;
-	unordered_map<ARGB, vector<unsigned short> > closestMap;
-	unordered_map<ARGB, UINT> rightMatches;
-
 	struct Box {
 		BYTE AlphaMinimum = 0;
 		BYTE AlphaMaximum = 0;
@@ -78,10 +70,11 @@ namespace nQuant
 
 		unique_ptr<ARGB[]> pixels;
 
-		UINT pixelsCount = 0;
-		UINT pixelFillingCounter = 0;
+		size_t pixelsCount = 0;
+		size_t pixelFillingCounter = 0;
 
-		ColorData(UINT sideSize, UINT bitmapWidth, UINT bitmapHeight) {
+		// pixelsCount is 0 when the faded pixels are not needed, i.e. they equal the source pixels
+		ColorData(UINT sideSize, size_t pixelsCount) {
 			const int TOTAL_SIDESIZE = sideSize * sideSize * sideSize * sideSize;
 			weights = make_unique<long[]>(TOTAL_SIDESIZE);
 			momentsAlpha = make_unique<long[]>(TOTAL_SIDESIZE);
@@ -89,8 +82,9 @@ namespace nQuant
 			momentsGreen = make_unique<long[]>(TOTAL_SIDESIZE);
 			momentsBlue = make_unique<long[]>(TOTAL_SIDESIZE);
 			moments = make_unique<float[]>(TOTAL_SIDESIZE);
-			pixelsCount = bitmapWidth * bitmapHeight;
-			pixels = make_unique<ARGB[]>(pixelsCount);
+			this->pixelsCount = pixelsCount;
+			if (pixelsCount > 0)
+				pixels = make_unique<ARGB[]>(pixelsCount);
 		}
 
 		inline ARGB* GetPixels() {
@@ -99,6 +93,9 @@ namespace nQuant
 
 		inline void AddPixel(ARGB pixel)
 		{
+			if (!pixels)
+				return;
+
 			pixels[pixelFillingCounter] = pixel;
 			++pixelFillingCounter;
 		}
@@ -250,7 +247,18 @@ namespace nQuant
 		}
 	}
 
-	void CompileColorData(ColorData& colorData, const Color& color, const BYTE alphaThreshold, const BYTE alphaFader)
+	ARGB FadeAlpha(const Color& color, const BYTE alphaThreshold, const BYTE alphaFader)
+	{
+		BYTE pixelAlpha = color.GetA();
+		if (pixelAlpha <= alphaThreshold || pixelAlpha == BYTE_MAX)
+			return color.GetValue();
+
+		short alpha = pixelAlpha + (pixelAlpha % alphaFader);
+		pixelAlpha = static_cast<BYTE>(alpha > BYTE_MAX ? BYTE_MAX : alpha);
+		return Color::MakeARGB(pixelAlpha, color.GetR(), color.GetG(), color.GetB());
+	}
+
+	void CompileColorData(ColorData& colorData, const Color& color, const BYTE alphaThreshold, const BYTE alphaFader, const size_t count = 1)
 	{
 		BYTE pixelBlue = color.GetB();
 		BYTE pixelGreen = color.GetG();
@@ -264,95 +272,39 @@ namespace nQuant
 
 		if (pixelAlpha > alphaThreshold) {
 			if (pixelAlpha < BYTE_MAX) {
-				short alpha = pixelAlpha + (pixelAlpha % alphaFader);
-				pixelAlpha = static_cast<BYTE>(alpha > BYTE_MAX ? BYTE_MAX : alpha);
+				pixelAlpha = Color(FadeAlpha(color, alphaThreshold, alphaFader)).GetA();
 				indexAlpha = static_cast<BYTE>((pixelAlpha >> 3) + 1);
 			}
 
 			const int index = Index(indexAlpha, indexRed, indexGreen, indexBlue);
 			if (index < TOTAL_SIDESIZE) {
-				colorData.weights[index]++;
-				colorData.momentsRed[index] += pixelRed;
-				colorData.momentsGreen[index] += pixelGreen;
-				colorData.momentsBlue[index] += pixelBlue;
-				colorData.momentsAlpha[index] += pixelAlpha;
-				colorData.moments[index] += sqr(pixelAlpha) + sqr(pixelRed) + sqr(pixelGreen) + sqr(pixelBlue);
+				colorData.weights[index] += count;
+				colorData.momentsRed[index] += pixelRed * count;
+				colorData.momentsGreen[index] += pixelGreen * count;
+				colorData.momentsBlue[index] += pixelBlue * count;
+				colorData.momentsAlpha[index] += pixelAlpha * count;
+				colorData.moments[index] += (sqr(pixelAlpha) + sqr(pixelRed) + sqr(pixelGreen) + sqr(pixelBlue)) * count;
 			}
 		}
 
 		colorData.AddPixel(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
 	}
 
-	void BuildHistogram(ColorData& colorData, Bitmap* sourceImage, BYTE alphaThreshold, BYTE alphaFader)
+	void WuQuantizer::BuildHistogram(ColorData& colorData, const PixelSpan& pixels, BYTE alphaThreshold, BYTE alphaFader)
 	{
-		const UINT bitDepth = GetPixelFormatSize(sourceImage->GetPixelFormat());
-		const UINT bitmapWidth = sourceImage->GetWidth();
-		const UINT bitmapHeight = sourceImage->GetHeight();
-
-		int pixelIndex = 0;
-		if (bitDepth <= 16) {
-			for (UINT y = 0; y < bitmapHeight; ++y) {
-				for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex) {
-					Color color;
-					sourceImage->GetPixel(x, y, &color);
-					if (color.GetA() < BYTE_MAX) {
-						hasSemiTransparency = true;
-						if (color.GetA() == 0) {
-							m_transparentPixelIndex = pixelIndex;
-							m_transparentColor = color.GetValue();
-						}
-					}
-					CompileColorData(colorData, color, alphaThreshold, alphaFader);
-				}
-			}
-			return;
-		}
-
-		BitmapData data;
-		Status status = sourceImage->LockBits(&Rect(0, 0, bitmapWidth, bitmapHeight), ImageLockModeRead, sourceImage->GetPixelFormat(), &data);
-		if (status != Ok)
-			return;
-
-		auto pRowSource = (LPBYTE)data.Scan0;
-		UINT strideSource;
-
-		if (data.Stride > 0) strideSource = data.Stride;
-		else
-		{
-			// Compensate for possible negative stride
-			// (not needed for first loop, but we have to do it
-			// for second loop anyway)
-			pRowSource += bitmapHeight * data.Stride;
-			strideSource = -data.Stride;
-		}
-
-		// First loop: gather color information
-		for (UINT y = 0; y < bitmapHeight; ++y)	// For each row...
-		{
-			auto pPixelSource = pRowSource;
-
-			for (UINT x = 0; x < bitmapWidth; ++x, ++pixelIndex)	// ...for each pixel...
-			{
-				BYTE pixelBlue = *pPixelSource++;
-				BYTE pixelGreen = *pPixelSource++;
-				BYTE pixelRed = *pPixelSource++;
-				BYTE pixelAlpha = bitDepth < 32 ? BYTE_MAX : *pPixelSource++;
-
-				Color color(Color::MakeARGB(pixelAlpha, pixelRed, pixelGreen, pixelBlue));
-				if (pixelAlpha < BYTE_MAX) {
-					hasSemiTransparency = true;
-					if (pixelAlpha == 0) {
-						m_transparentPixelIndex = pixelIndex;
-						m_transparentColor = color.GetValue();
-					}
+		size_t pixelIndex = 0;
+		for (const auto& pixel : pixels) {
+			Color color(pixel);
+			if (color.GetA() < BYTE_MAX) {
+				hasSemiTransparency = true;
+				if (color.GetA() == 0) {
+					m_transparentPixelIndex = pixelIndex;
+					m_transparentColor = color.GetValue();
 				}
-				CompileColorData(colorData, color, alphaThreshold, alphaFader);
 			}
-
-			pRowSource += strideSource;
+			CompileColorData(colorData, color, alphaThreshold, alphaFader);
+			++pixelIndex;
 		}
-
-		sourceImage->UnlockBits(&data);
 	}
 
 	void CalculateMoments(ColorData& data)
@@ -589,7 +541,7 @@ namespace nQuant
 		boxList.resize(colorCount);
 	}
 
-	void BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData& data)
+	void WuQuantizer::BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData& data)
 	{
 		volatile UINT lookupsCount = 0;
 		if (m_transparentPixelIndex >= 0) {
@@ -615,13 +567,15 @@ namespace nQuant
 			pPalette->Count = lookupsCount;
 	}
 
-	unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
+	unsigned short WuQuantizer::closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb)
 	{
 		UINT k = 0;
 		Color c(argb);
-		vector<unsigned short> closest(5);
-		auto got = closestMap.find(argb);
-		if (got == closestMap.end()) {
+		unsigned short closest[5] = { 0 };
+		const bool found = closestMap.Find(argb, closest);
+		if (m_pStats)
+			(found ? m_pStats->closestHits : m_pStats->closestMisses)++;
+		if (!found) {
 			closest[2] = closest[3] = SHORT_MAX;
 
 			for (; k < nMaxColors; k++) {
@@ -641,20 +595,18 @@ namespace nQuant
 
 			if (closest[3] == SHORT_MAX)
 				closest[2] = 0;
+			closestMap.Insert(argb, closest);
 		}
-		else
-			closest = got->second;
 
-		if (closest[2] == 0 || (rand() % (closest[3] + closest[2])) <= closest[3])
+		if (closest[2] == 0 || m_random.Next(closest[3] + closest[2]) <= closest[3])
 			k = closest[0];
 		else
 			k = closest[1];
 
-		closestMap[argb] = closest;
 		return k;
 	}
 
-	unsigned short nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold)
+	unsigned short WuQuantizer::nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold)
 	{
 		Color c(argb);
 		unsigned short k = 0;
@@ -662,30 +614,12 @@ namespace nQuant
 			return k;
 
 		auto got = rightMatches.find(argb);
+		if (m_pStats)
+			(got == rightMatches.end() ? m_pStats->closestMisses : m_pStats->closestHits)++;
 		if (got == rightMatches.end()) {
-			double mindist = INT_MAX;
-			for (UINT i = 0; i < pPalette->Count; i++) {
-				Color c2(pPalette->Entries[i]);
-				double curdist = sqr(c2.GetA() - c.GetA());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PR * sqr(c2.GetR() - c.GetR());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PG * sqr(c2.GetG() - c.GetG());
-				if (curdist > mindist)
-					continue;
-
-				curdist += PB * sqr(c2.GetB() - c.GetB());
-				if (curdist > mindist)
-					continue;
-
-				mindist = curdist;
-				k = i;
-			}
-
+			if (!m_paletteTree.IsBuilt())
+				m_paletteTree.Build(pPalette, pPalette->Count, 1, PR, PG, PB);
+			k = m_paletteTree.Nearest(argb);
 			rightMatches[argb] = k;
 		}
 		else
@@ -694,31 +628,40 @@ namespace nQuant
 		return k;
 	}
 
-	void GetQuantizedPalette(const ColorData& data, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold)
+	void WuQuantizer::GetQuantizedPalette(const PixelSpan& pixels, const unordered_map<ARGB, size_t>& histogram, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold)
 	{
-		auto alphas = make_unique<UINT[]>(colorCount);
-		auto reds = make_unique<UINT[]>(colorCount);
-		auto greens = make_unique<UINT[]>(colorCount);
-		auto blues = make_unique<UINT[]>(colorCount);
-		auto sums = make_unique<UINT[]>(colorCount);
-
-		int pixelsCount = data.pixelsCount;
-
-		for (UINT pixelIndex = 0; pixelIndex < pixelsCount; ++pixelIndex) {
-			auto argb = data.pixels[pixelIndex];
+		auto alphas = make_unique<size_t[]>(colorCount);
+		auto reds = make_unique<size_t[]>(colorCount);
+		auto greens = make_unique<size_t[]>(colorCount);
+		auto blues = make_unique<size_t[]>(colorCount);
+		auto sums = make_unique<size_t[]>(colorCount);
+		m_paletteTree.Clear();
+
+		auto addColor = [&](const ARGB argb, const size_t count) {
 			Color pixel(argb);
 			if (pixel.GetA() <= alphaThreshold)
-				continue;
+				return;
 
 			UINT bestMatch = nearestColorIndex(pPalette, argb, alphaThreshold);
 
-			alphas[bestMatch] += pixel.GetA();
-			reds[bestMatch] += pixel.GetR();
-			greens[bestMatch] += pixel.GetG();
-			blues[bestMatch] += pixel.GetB();
-			sums[bestMatch]++;
+			alphas[bestMatch] += (size_t) pixel.GetA() * count;
+			reds[bestMatch] += (size_t) pixel.GetR() * count;
+			greens[bestMatch] += (size_t) pixel.GetG() * count;
+			blues[bestMatch] += (size_t) pixel.GetB() * count;
+			sums[bestMatch] += count;
+		};
+
+		// a histogram gives the same averages as the pixels it was counted from
+		if (histogram.empty()) {
+			for (const auto& argb : pixels)
+				addColor(argb, 1);
+		}
+		else {
+			for (const auto& entry : histogram)
+				addColor(entry.first, entry.second);
 		}
 		rightMatches.clear();
+		m_paletteTree.Clear();
 
 		short paletteIndex = (m_transparentPixelIndex < 0) ? 0 : 1;
 		for (; paletteIndex < colorCount; ++paletteIndex) {
@@ -733,161 +676,131 @@ namespace nQuant
 		}
 	}
 
-	bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold)
+	bool WuQuantizer::quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold)
 	{
+		if (dither && (m_ditherLookup.pattern != DitherPattern::Diffusion || m_ditherLookup.tileSize || m_ditherLookup.wavefront)) {
+			// on several threads they all read the PaletteTree that rightMatches only memoises
+			UINT nThreads = m_ditherLookup.nThreads;
+			if (nThreads == 0)
+				nThreads = max(thread::hardware_concurrency(), 1U);
+			const bool shared = nThreads > 1;
+			if (m_pStats)
+				m_pStats->ditherThreads = max(m_pStats->ditherThreads, (size_t) nThreads);
+			if (shared && !m_paletteTree.IsBuilt())
+				m_paletteTree.Build(pPalette, pPalette->Count, 1, PR, PG, PB);
+			auto indexFn = [&](const ARGB argb) -> unsigned short {
+				if (!shared)
+					return nearestColorIndex(pPalette, argb, alphaThreshold);
+				return Color(argb).GetA() <= alphaThreshold ? 0 : m_paletteTree.Nearest(argb);
+			};
+
+			if (m_ditherLookup.pattern != DitherPattern::Diffusion) {
+				// every pixel on its own
+				OrderedDither ordered(m_ditherLookup.pattern, pPalette->Count, hasSemiTransparency);
+				ParallelFor(height, nThreads, [&](size_t row) {
+					const size_t pixelIndex = row * width;
+					ordered.MapRow(pixels + pixelIndex, row, width, qPixels + pixelIndex, indexFn);
+				});
+			}
+			else if (m_ditherLookup.tileSize)
+				DiffuseTiles<DitherAlpha::Visible>(pixels, qPixels, width, height, m_ditherLookup.tileSize, m_ditherLookup.tileOverlap, nThreads, pPalette, indexFn);
+			else {
+				// rows left to right
+				Wavefront wavefront(width, nThreads);
+				wavefront.Run(0, height, [&](const size_t row) {
+					const size_t pixelIndex = row * width;
+					wavefront.DitherRow<DitherAlpha::Visible>(row, pixels + pixelIndex, qPixels + pixelIndex, pPalette, indexFn);
+				});
+			}
+			return true;
+		}
+
 		if (dither) {
+			if (m_pStats)
+				m_pStats->ditherThreads = max(m_pStats->ditherThreads, (size_t) 1);
 			bool odd_scanline = false;
-			short *thisrowerr, *nextrowerr;
-			constexpr BYTE DJ = 4;
-			constexpr BYTE DITHER_MAX = 20;
-			const int err_len = (width + 2) * DJ;
-			BYTE range_tbl[DJ * 256] = { 0 };
-			auto range = &range_tbl[256];
+			const int err_len = (width + 2) * 4;
 			auto erowErr = make_unique<short[]>(err_len);
 			auto orowErr = make_unique<short[]>(err_len);
-			char dith_max_tbl[512] = { 0 };
-			auto dith_max = &dith_max_tbl[256];
-			auto erowerr = erowErr.get();
-			auto orowerr = orowErr.get();
-
-			for (int i = 0; i < 256; i++) {
-				range_tbl[i] = 0;
-				range_tbl[i + 256] = static_cast<BYTE>(i);
-				range_tbl[i + 512] = BYTE_MAX;
-				range_tbl[i + 768] = BYTE_MAX;
-			}
-
-			for (int i = 0; i < 256; i++) {
-				dith_max_tbl[i] = -DITHER_MAX;
-				dith_max_tbl[i + 256] = DITHER_MAX;
-			}
-			for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
-				dith_max_tbl[i + 256] = i;
-
-			UINT pixelIndex = 0;
-			for (int i = 0; i < height; i++) {
-				int dir;
-				if (odd_scanline) {
-					dir = -1;
-					pixelIndex += (width - 1);
-					thisrowerr = orowerr + DJ;
-					nextrowerr = erowerr + width * DJ;
-				}
-				else {
-					dir = 1;
-					thisrowerr = erowerr + DJ;
-					nextrowerr = orowerr + width * DJ;
-				}
-				nextrowerr[0] = nextrowerr[1] = nextrowerr[2] = nextrowerr[3] = 0;
-				for (int j = 0; j < width; j++) {
-					Color c(pixels[pixelIndex]);
-
-					int a_pix = range[((thisrowerr[0] + 8) >> 4) + c.GetA()];
-					int r_pix = range[((thisrowerr[1] + 8) >> 4) + c.GetR()];
-					int g_pix = range[((thisrowerr[2] + 8) >> 4) + c.GetG()];
-					int b_pix = range[((thisrowerr[3] + 8) >> 4) + c.GetB()];
-
-					ARGB argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
-					qPixels[pixelIndex] = nearestColorIndex(pPalette, c.GetA() ? argb : pixels[pixelIndex], alphaThreshold);
-
-					Color c2(pPalette->Entries[qPixels[pixelIndex]]);
-					a_pix = dith_max[a_pix - c2.GetA()];
-					r_pix = dith_max[r_pix - c2.GetR()];
-					g_pix = dith_max[g_pix - c2.GetG()];
-					b_pix = dith_max[b_pix - c2.GetB()];
-
-					int two_val = a_pix * 2;
-					nextrowerr[0 - DJ] = a_pix;
-					a_pix += two_val;
-					nextrowerr[0 + DJ] += a_pix;
-					a_pix += two_val;
-					nextrowerr[0] += a_pix;
-					a_pix += two_val;
-					thisrowerr[0 + DJ] += a_pix;
-
-					two_val = r_pix * 2;
-					nextrowerr[1 - DJ] = r_pix;
-					r_pix += two_val;
-					nextrowerr[1 + DJ] += r_pix;
-					r_pix += two_val;
-					nextrowerr[1] += r_pix;
-					r_pix += two_val;
-					thisrowerr[1 + DJ] += r_pix;
-
-					two_val = g_pix * 2;
-					nextrowerr[2 - DJ] = g_pix;
-					g_pix += two_val;
-					nextrowerr[2 + DJ] += g_pix;
-					g_pix += two_val;
-					nextrowerr[2] += g_pix;
-					g_pix += two_val;
-					thisrowerr[2 + DJ] += g_pix;
-
-					two_val = b_pix * 2;
-					nextrowerr[3 - DJ] = b_pix;
-					b_pix += two_val;
-					nextrowerr[3 + DJ] += b_pix;
-					b_pix += two_val;
-					nextrowerr[3] += b_pix;
-					b_pix += two_val;
-					thisrowerr[3 + DJ] += b_pix;
-
-					thisrowerr += DJ;
-					nextrowerr -= DJ;
-					pixelIndex += dir;
-				}
-				if ((i % 2) == 1)
-					pixelIndex += (width + 1);
-
-				odd_scanline = !odd_scanline;
-			}
+			DiffuseSerpentine<DitherAlpha::Visible>(pixels, qPixels, height, width, erowErr.get(), orowErr.get(), odd_scanline, pPalette, [&](const ARGB argb) {
+				return nearestColorIndex(pPalette, argb, alphaThreshold);
+			});
 			return true;
 		}
 
-		for (int i = 0; i < (width * height); ++i)
-			qPixels[i] = closestColorIndex(pPalette, pPalette->Count, pixels[i]);
+		// a block draws its tie-breaks from a seed of its own, whichever thread maps it
+		const UINT seed = m_random.Next();
+		RemapBlocks(*this, (size_t) width * height, m_remapThreads, m_pStats, [&](WuQuantizer& worker, const size_t block, const size_t first, const size_t last) {
+			worker.m_random.Seed(seed + block);
+			auto closestFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+				return worker.closestColorIndex(pPalette, nMaxColors, argb);
+			};
+			MatchPixels(closestFn, pPalette, pPalette->Count, pixels + first, last - first, qPixels + first);
+		});
 
 		return true;
 	}
 	
-	bool WuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
+	bool WuQuantizer::QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
 	{
-		const UINT bitmapWidth = pSource->GetWidth();
-		const UINT bitmapHeight = pSource->GetHeight();
+		SourceImage source;
+		if (!GrabPixels(pixels, width, height, stride, source))
+			return false;
+
+		return QuantizeImage(source, pPalette, qPixels, nMaxColors, dither, alphaThreshold, alphaFader);
+	}
+
+	bool WuQuantizer::QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		PhaseTimer timer(m_pStats);
+		const UINT bitmapWidth = source.width;
+		const UINT bitmapHeight = source.height;
 
-		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
-		auto pPalette = (ColorPalette*)pPaletteBytes.get();
 		pPalette->Count = nMaxColors;
 		
 		if (nMaxColors <= 32)
 			PR = PG = PB = 1;
 
-		auto qPixels = make_unique<unsigned short[]>(bitmapWidth * bitmapHeight);
 		if (nMaxColors > 2) {
-			ColorData colorData(SIDESIZE, bitmapWidth, bitmapHeight);
-			BuildHistogram(colorData, pSource, alphaThreshold, alphaFader);
-			CalculateMoments(colorData);
-			vector<Box> cubes;
-			SplitData(cubes, nMaxColors, colorData);
-
-			BuildLookups(pPalette, cubes, colorData);
-			cubes.clear();
-
-			nMaxColors = pPalette->Count;
-			if (nMaxColors > 16 && nMaxColors <= 256 && pDest->GetPixelFormat() != PixelFormat8bppIndexed)
-				pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, pPalette, 0);
-
-			GetQuantizedPalette(colorData, pPalette, nMaxColors, alphaThreshold);
+			ColorData colorData(SIDESIZE, alphaFader > 1 ? source.pixels.size() : 0);
+			hasSemiTransparency = false;
+			m_transparentPixelIndex = -1;
+			BuildHistogram(colorData, source.pixels, alphaThreshold, alphaFader);
+			const PixelSpan pixels = colorData.pixels ? PixelSpan(colorData.GetPixels(), colorData.pixelsCount) : source.pixels;
+
+			string key;
+			if (m_pPaletteCache)
+				key = PaletteKey("WU", source, nMaxColors, { alphaThreshold, alphaFader });
+			if (!m_pPaletteCache || !m_pPaletteCache->Find(key, pPalette, nMaxColors)) {
+				CalculateMoments(colorData);
+				vector<Box> cubes;
+				SplitData(cubes, nMaxColors, colorData);
+
+				BuildLookups(pPalette, cubes, colorData);
+				cubes.clear();
+
+				nMaxColors = pPalette->Count;
+				GetQuantizedPalette(pixels, {}, pPalette, nMaxColors, alphaThreshold);
+				if (m_pPaletteCache)
+					m_pPaletteCache->Store(key, pPalette);
+			}
+			timer.PaletteBuilt();
+			m_paletteTree.Clear();
 			if (nMaxColors > 256) {
-				auto qPixels = make_unique<ARGB[]>(bitmapWidth * bitmapHeight);
-				dithering_image(colorData.GetPixels(), pPalette, closestColorIndex, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels.get(), bitmapWidth, bitmapHeight);
-				return ProcessImagePixels(pDest, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
+				auto ditherFn = [this](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				auto pColormap = MakeInverseColormap(m_ditherLookup, pPalette, pPalette->Count, hasSemiTransparency, 1, PR, PG, PB);
+				dither_image(pixels.data(), pPalette, ditherFn, hasSemiTransparency, m_transparentPixelIndex, nMaxColors, qPixels, bitmapWidth, bitmapHeight, m_pStats, pColormap.get(), m_ditherLookup);
+				return true;
 			}			
-			quantize_image(colorData.GetPixels(), pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
+			quantize_image(pixels.data(), pPalette, qPixels, bitmapWidth, bitmapHeight, dither, alphaThreshold);
 		}
 		else {
-			vector<ARGB> pixels(bitmapWidth * bitmapHeight);
-			GrabPixels(pSource, pixels, hasSemiTransparency, m_transparentPixelIndex, m_transparentColor);
+			const auto& pixels = source.pixels;
+			hasSemiTransparency = source.hasSemiTransparency;
+			m_transparentPixelIndex = source.transparentPixelIndex;
+			m_transparentColor = source.transparentColor;
 			if (m_transparentPixelIndex >= 0) {
 				pPalette->Entries[0] = m_transparentColor;
 				pPalette->Entries[1] = Color::Black;
@@ -896,7 +809,9 @@ namespace nQuant
 				pPalette->Entries[0] = Color::Black;
 				pPalette->Entries[1] = Color::White;
 			}
-			quantize_image(pixels.data(), pPalette, qPixels.get(), bitmapWidth, bitmapHeight, dither, alphaThreshold);
+			timer.PaletteBuilt();
+			m_paletteTree.Clear();
+			quantize_image(pixels.data(), pPalette, qPixels, bitmapWidth, bitmapHeight, dither, alphaThreshold);
 		}		
 		
 		if (m_transparentPixelIndex >= 0) {
@@ -906,10 +821,197 @@ namespace nQuant
 			else if (pPalette->Entries[k] != m_transparentColor)
 				swap(pPalette->Entries[0], pPalette->Entries[1]);
 		}
-		closestMap.clear();
+		closestMap.Clear();
 		rightMatches.clear();
 
-		return ProcessImagePixels(pDest, pPalette, qPixels.get());
+		return true;
+	}
+
+	void WuQuantizer::build_palette(const SourceImage& source, ColorPalette* pPalette, UINT& nMaxColors, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		pPalette->Count = nMaxColors;
+
+		if (nMaxColors <= 32)
+			PR = PG = PB = 1;
+
+		hasSemiTransparency = source.hasSemiTransparency;
+		m_transparentPixelIndex = source.transparentPixelIndex;
+		m_transparentColor = source.transparentColor;
+		if (nMaxColors > 2) {
+			string key;
+			if (m_pPaletteCache)
+				key = PaletteKey("WU", source, nMaxColors, { alphaThreshold, alphaFader });
+			if (!m_pPaletteCache || !m_pPaletteCache->Find(key, pPalette, nMaxColors)) {
+				ColorData colorData(SIDESIZE, 0);
+				unordered_map<ARGB, size_t> faded;
+				for (const auto& entry : source.histogram) {
+					Color color(entry.first);
+					CompileColorData(colorData, color, alphaThreshold, alphaFader, entry.second);
+					faded[FadeAlpha(color, alphaThreshold, alphaFader)] += entry.second;
+				}
+				CalculateMoments(colorData);
+				vector<Box> cubes;
+				SplitData(cubes, nMaxColors, colorData);
+
+				BuildLookups(pPalette, cubes, colorData);
+				cubes.clear();
+
+				nMaxColors = pPalette->Count;
+				GetQuantizedPalette(PixelSpan(), faded, pPalette, nMaxColors, alphaThreshold);
+				if (m_pPaletteCache)
+					m_pPaletteCache->Store(key, pPalette);
+			}
+		}
+		else {
+			if (m_transparentPixelIndex >= 0) {
+				pPalette->Entries[0] = m_transparentColor;
+				pPalette->Entries[1] = Color::Black;
+			}
+			else {
+				pPalette->Entries[0] = Color::Black;
+				pPalette->Entries[1] = Color::White;
+			}
+		}
+	}
+
+	bool WuQuantizer::QuantizeImage(const ReadBandFn& readBand, const UINT width, const UINT height, ColorPalette* pPalette, const WriteBandFn& writeBand, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader, const UINT bandHeight)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage source;
+		if (!ScanBands(readBand, width, height, bandHeight, source))
+			return false;
+
+		build_palette(source, pPalette, nMaxColors, alphaThreshold, alphaFader);
+		source.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+
+		// the bands are faded as they are read again, the histogram was faded by build_palette
+		ReadBandFn readFaded = readBand;
+		if (nMaxColors > 2 && alphaFader > 1) {
+			readFaded = [&](const UINT y, const UINT rows, ARGB* pixels) {
+				if (!readBand(y, rows, pixels))
+					return false;
+				for (size_t i = 0; i < (size_t) width * rows; ++i)
+					pixels[i] = FadeAlpha(Color(pixels[i]), alphaThreshold, alphaFader);
+				return true;
+			};
+		}
+
+		// the matches of quantize_image, but the bands dither through BandDitherer rather than its own loop,
+		// so that only one band is held, more than 256 colours are always dithered
+		auto ditherFn = [this, alphaThreshold](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			return nMaxColors > 256 ? closestColorIndex(pPalette, nMaxColors, argb) : nearestColorIndex(pPalette, argb, alphaThreshold);
+		};
+		// reseeded at the blocks of quantize_image, so that bands map as the whole image does
+		const UINT seed = m_random.Next();
+		size_t pixelIndex = 0;
+		auto closestFn = [this, seed, &pixelIndex](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+			if (pixelIndex % REMAP_BLOCK == 0)
+				m_random.Seed(seed + pixelIndex / REMAP_BLOCK);
+			++pixelIndex;
+			return closestColorIndex(pPalette, nMaxColors, argb);
+		};
+		if (nMaxColors > 256)
+			dither = true;
+
+		int k = -1;
+		auto pColormap = dither ? MakeInverseColormap(m_ditherLookup, pPalette, pPalette->Count, hasSemiTransparency, 1, PR, PG, PB) : nullptr;
+		bool result;
+		if (dither)
+			result = RemapBands(readFaded, writeBand, width, height, bandHeight, pPalette, ditherFn, dither, hasSemiTransparency, nMaxColors, k, m_pStats, pColormap.get(), m_ditherLookup);
+		else
+			result = RemapBands(readFaded, writeBand, width, height, bandHeight, pPalette, closestFn, dither, hasSemiTransparency, pPalette->Count, k, m_pStats);
+		if (result && k >= 0 && nMaxColors <= 256) {
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+		}
+		closestMap.Clear();
+		rightMatches.clear();
+
+		return result;
+	}
+
+	bool WuQuantizer::QuantizeImages(const vector<const SourceImage*>& sources, ColorPalette* pPalette, const vector<unsigned short*>& qPixels, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader, UINT nThreads)
+	{
+		PhaseTimer timer(m_pStats);
+		SourceImage merged;
+		if (qPixels.size() != sources.size() || !MergeHistograms(sources, merged))
+			return false;
+
+		build_palette(merged, pPalette, nMaxColors, alphaThreshold, alphaFader);
+		merged.histogram.clear();
+		timer.PaletteBuilt();
+		m_paletteTree.Clear();
+		closestMap.Clear();
+		rightMatches.clear();
+
+		// the colormap only depends on the palette, one serves every image
+		auto pColormap = nMaxColors > 256 ? MakeInverseColormap(m_ditherLookup, pPalette, pPalette->Count, hasSemiTransparency, 1, PR, PG, PB) : nullptr;
+
+		// each image is mapped by its own copy of this quantizer, taken with the tree and the caches empty so
+		// that it holds the settings and none of the lookups, which each thread then builds for itself
+		ParallelFor(sources.size(), nThreads, [&](size_t i) {
+			auto worker = *this;
+			worker.m_pStats = nullptr;
+			const auto& source = *sources[i];
+			vector<ARGB> fadedPixels;
+			if (nMaxColors > 2 && alphaFader > 1) {
+				fadedPixels.reserve(source.pixels.size());
+				for (const auto& pixel : source.pixels)
+					fadedPixels.emplace_back(FadeAlpha(Color(pixel), alphaThreshold, alphaFader));
+			}
+			const auto pixels = fadedPixels.empty() ? source.pixels.data() : fadedPixels.data();
+
+			if (nMaxColors > 256) {
+				auto ditherFn = [&worker](const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb) {
+					return worker.closestColorIndex(pPalette, nMaxColors, argb);
+				};
+				dither_image(pixels, pPalette, ditherFn, worker.hasSemiTransparency, source.transparentPixelIndex, nMaxColors, qPixels[i], source.width, source.height, nullptr, pColormap.get(), m_ditherLookup);
+			}
+			else
+				worker.quantize_image(pixels, pPalette, qPixels[i], source.width, source.height, dither, alphaThreshold);
+		});
+
+		for (size_t i = sources.size(); i-- > 0 && nMaxColors <= 256; ) {
+			if (sources[i]->transparentPixelIndex < 0)
+				continue;
+
+			UINT k = qPixels[i][sources[i]->transparentPixelIndex];
+			if (nMaxColors > 2)
+				pPalette->Entries[k] = m_transparentColor;
+			else if (pPalette->Entries[k] != m_transparentColor)
+				swap(pPalette->Entries[0], pPalette->Entries[1]);
+			break;
+		}
+		closestMap.Clear();
+		rightMatches.clear();
+
+		return true;
+	}
+
+#ifdef _WIN32
+	bool WuQuantizer::QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		SourceImage source;
+		if (!GrabPixels(pSource, source))
+			return false;
+
+		return QuantizeImage(source, pDest, nMaxColors, dither, alphaThreshold, alphaFader);
+	}
+
+	bool WuQuantizer::QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither, BYTE alphaThreshold, BYTE alphaFader)
+	{
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nMaxColors * sizeof(ARGB));
+		auto pPalette = (ColorPalette*)pPaletteBytes.get();
+		auto qPixels = make_unique<unsigned short[]>(source.pixels.size());
+		if (!QuantizeImage(source, pPalette, qPixels.get(), nMaxColors, dither, alphaThreshold, alphaFader))
+			return false;
+
+		return ProcessImagePixels(pDest, pPalette, qPixels.get(), hasSemiTransparency, m_transparentPixelIndex);
 	}
+#endif
 
 }
@@ -1,6 +1,11 @@
 #pragma once
 #include <memory>
+#include <unordered_map>
 #include <vector>
+#include "bitmapUtilities.h"
+#include "ClosestCache.h"
+#include "InverseColormap.h"
+#include "PaletteTree.h"
 using namespace std;
 
 // =============================================================
@@ -26,9 +31,48 @@ namespace nQuant
 */
 	enum Pixel : BYTE { Blue, Green, Red, Alpha };
 
+	struct Box;
+	struct ColorData;
+
 	class WuQuantizer
 	{
+		private:
+			bool hasSemiTransparency = false;
+			long long m_transparentPixelIndex = -1;
+			ARGB m_transparentColor = Color::Transparent;
+			QuantizeStats* m_pStats = nullptr;
+			PaletteCache* m_pPaletteCache = nullptr;
+			FastRandom m_random;
+			PaletteTree m_paletteTree;
+			DitherLookup m_ditherLookup;
+			UINT m_remapThreads = 1;
+			double PR = .2126, PG = .7152, PB = .0722;
+			ClosestCache<unsigned short> closestMap;
+			unordered_map<ARGB, UINT> rightMatches;
+
+			void BuildHistogram(ColorData& colorData, const PixelSpan& pixels, BYTE alphaThreshold, BYTE alphaFader);
+			void BuildLookups(ColorPalette* pPalette, vector<Box>& cubes, const ColorData& data);
+			unsigned short closestColorIndex(const ColorPalette* pPalette, const UINT nMaxColors, const ARGB argb);
+			unsigned short nearestColorIndex(const ColorPalette* pPalette, const ARGB argb, const BYTE alphaThreshold);
+			void GetQuantizedPalette(const PixelSpan& pixels, const unordered_map<ARGB, size_t>& histogram, ColorPalette* pPalette, const UINT colorCount, const BYTE alphaThreshold);
+			bool quantize_image(const ARGB* pixels, const ColorPalette* pPalette, unsigned short* qPixels, const UINT width, const UINT height, const bool dither, BYTE alphaThreshold);
+			void build_palette(const SourceImage& source, ColorPalette* pPalette, UINT& nMaxColors, BYTE alphaThreshold, BYTE alphaFader);
+
 		public:
+			inline void SetStats(QuantizeStats* pStats) { m_pStats = pStats; }
+			inline void SetDitherLookup(const DitherLookup& lookup) { m_ditherLookup = lookup; }
+			inline void SetClosestCacheSize(const size_t nEntries) { closestMap.SetCapacity(nEntries); }
+			// threads of the remap without dithering, 0 for one per logical processor
+			inline void SetRemapThreads(const UINT nThreads) { m_remapThreads = nThreads; }
+			inline void SetPaletteCache(PaletteCache* pPaletteCache) { m_pPaletteCache = pPaletteCache; }
+			inline void SetSeed(const unsigned long long seed) { m_random.Seed(seed); }
+			bool QuantizeImage(const ARGB* pixels, const UINT width, const UINT height, const int stride, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
+			bool QuantizeImage(const SourceImage& source, ColorPalette* pPalette, unsigned short* qPixels, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
+			bool QuantizeImage(const ReadBandFn& readBand, const UINT width, const UINT height, ColorPalette* pPalette, const WriteBandFn& writeBand, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1, const UINT bandHeight = 256);
+			bool QuantizeImages(const vector<const SourceImage*>& sources, ColorPalette* pPalette, const vector<unsigned short*>& qPixels, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1, UINT nThreads = 0);
+#ifdef _WIN32
+			bool QuantizeImage(const SourceImage& source, Bitmap* pDest, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
 			bool QuantizeImage(Bitmap* pSource, Bitmap* pDest, UINT& nMaxColors, bool dither = true, BYTE alphaThreshold = 0, BYTE alphaFader = 1);
+#endif
 	};
 }
\ No newline at end of file
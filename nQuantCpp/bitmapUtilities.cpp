@@ -4,7 +4,15 @@
 // GetBitmapHeaderSize
 //
 #include "bitmapUtilities.h"
-
+#include "InverseColormap.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <thread>
+
+#ifdef _WIN32
 ULONG GetBitmapHeaderSize(LPCVOID pDib)
 {
 	ULONG nHeaderSize = *(PDWORD)pDib;
@@ -439,269 +447,65 @@ BOOL FillBitmapFileHeader(LPCVOID pDib, PBITMAPFILEHEADER pbmfh)
 
 	return TRUE;
 }
+#endif
 
-void CalcDitherPixel(int* pDitherPixel, const Color& c, const BYTE* clamp, const short* rowerr, const bool& hasSemiTransparency)
+void MatchPixels(const NearestMap& nearestMap, const ColorPalette*, const UINT, const ARGB* pixels, const size_t count, unsigned short* qPixels)
 {
-	if (hasSemiTransparency) {
-		pDitherPixel[0] = clamp[((rowerr[0] + 0x1008) >> 4) + c.GetR()];
-		pDitherPixel[1] = clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()];
-		pDitherPixel[2] = clamp[((rowerr[2] + 0x1008) >> 4) + c.GetB()];
-		pDitherPixel[3] = clamp[((rowerr[3] + 0x1008) >> 4) + c.GetA()];
-	}
-	else {
-		pDitherPixel[0] = clamp[((rowerr[0] + 0x2010) >> 5) + c.GetR()];
-		pDitherPixel[1] = clamp[((rowerr[1] + 0x1008) >> 4) + c.GetG()];
-		pDitherPixel[2] = clamp[((rowerr[2] + 0x2010) >> 5) + c.GetB()];
-		pDitherPixel[3] = c.GetA();
+	UINT likely = 0;
+	for (size_t i = 0; i < count; ++i) {
+		// a run of one colour keeps the match of its first pixel
+		if (i > 0 && pixels[i] == pixels[i - 1])
+			qPixels[i] = qPixels[i - 1];
+		else
+			likely = qPixels[i] = nearestMap.Nearest(pixels[i], likely);
 	}
 }
 
-bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height)
+Wavefront::Wavefront(const UINT width, const UINT nThreads) : m_width(width)
 {
-	UINT pixelIndex = 0;
-	
-	bool odd_scanline = false;
-	short *row0, *row1;
-	int dir, k;
-	const int DJ = 4;
-	const int DITHER_MAX = 20;
-	const int err_len = (width + 2) * DJ;
-	BYTE clamp[DJ * 256] = { 0 };
-	auto erowErr = make_unique<short[]>(err_len);
-	auto orowErr = make_unique<short[]>(err_len);
-	char limtb[512] = { 0 };
-	auto lim = &limtb[256];
-	auto erowerr = erowErr.get();
-	auto orowerr = orowErr.get();
-	auto lookup = make_unique<short[]>(65536);
-	auto pDitherPixel = make_unique<int[]>(4);
-
-	for (int i = 0; i < 256; i++) {
-		clamp[i] = 0;
-		clamp[i + 256] = static_cast<BYTE>(i);
-		clamp[i + 512] = BYTE_MAX;
-		clamp[i + 768] = BYTE_MAX;
-
-		limtb[i] = -DITHER_MAX;
-		limtb[i + 256] = DITHER_MAX;
-	}
-	for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
-		limtb[i + 256] = i;
-
-	for (int i = 0; i < height; i++) {
-		if (odd_scanline) {
-			dir = -1;
-			pixelIndex += (width - 1);
-			row0 = &orowerr[DJ];
-			row1 = &erowerr[width * DJ];
-		}
-		else {
-			dir = 1;
-			row0 = &erowerr[DJ];
-			row1 = &orowerr[width * DJ];
-		}
-		row1[0] = row1[1] = row1[2] = row1[3] = 0;
-		for (UINT j = 0; j < width; ++j) {
-			Color c(pixels[pixelIndex]);
-
-			CalcDitherPixel(pDitherPixel.get(), c, clamp, row0, hasSemiTransparency);
-			int r_pix = pDitherPixel[0];
-			int g_pix = pDitherPixel[1];
-			int b_pix = pDitherPixel[2];
-			int a_pix = pDitherPixel[3];
-			auto argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
-			Color c1(argb);
-			int offset = GetARGBIndex(c1, hasSemiTransparency);
-			if (!lookup[offset])
-				lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
-			qPixels[pixelIndex] = lookup[offset] - 1;
-
-			Color c2(pPalette->Entries[qPixels[pixelIndex]]);
-
-			r_pix = lim[c1.GetR() - c2.GetR()];
-			g_pix = lim[c1.GetG() - c2.GetG()];
-			b_pix = lim[c1.GetB() - c2.GetB()];
-			a_pix = lim[c1.GetA() - c2.GetA()];
-
-			k = r_pix * 2;
-			row1[0 - DJ] = r_pix;
-			row1[0 + DJ] += (r_pix += k);
-			row1[0] += (r_pix += k);
-			row0[0 + DJ] += (r_pix += k);
-
-			k = g_pix * 2;
-			row1[1 - DJ] = g_pix;
-			row1[1 + DJ] += (g_pix += k);
-			row1[1] += (g_pix += k);
-			row0[1 + DJ] += (g_pix += k);
-
-			k = b_pix * 2;
-			row1[2 - DJ] = b_pix;
-			row1[2 + DJ] += (b_pix += k);
-			row1[2] += (b_pix += k);
-			row0[2 + DJ] += (b_pix += k);
-
-			k = a_pix * 2;
-			row1[3 - DJ] = a_pix;
-			row1[3 + DJ] += (a_pix += k);
-			row1[3] += (a_pix += k);
-			row0[3 + DJ] += (a_pix += k);
-
-			row0 += DJ;
-			row1 -= DJ;
-			pixelIndex += dir;
-		}
-		if ((i % 2) == 1)
-			pixelIndex += (width + 1);
-
-		odd_scanline = !odd_scanline;
-	}
-	return true;
+	m_nThreads = nThreads ? nThreads : max(thread::hardware_concurrency(), 1U);
+	m_done = make_unique<atomic<unsigned long long>[]>(ErrorRows());
+	for (UINT i = 0; i < ErrorRows(); ++i)
+		m_done[i] = 0;
+	m_rowErrs = make_unique<short[]>((width + 2) * 4 * (size_t) ErrorRows());
 }
 
-bool dithering_image(const ARGB* pixels, ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, ARGB* qPixels, const UINT width, const UINT height)
+BandDitherer::BandDitherer(const ColorPalette* pPalette, const bool& hasSemiTransparency, const UINT nMaxColors, const UINT width, QuantizeStats* pStats, const InverseColormap* pColormap, const DitherLookup& lookup)
+	: m_pPalette(pPalette), m_hasSemiTransparency(hasSemiTransparency), m_nMaxColors(nMaxColors), m_width(width), m_pStats(pStats), m_pColormap(pColormap)
 {
-	UINT pixelIndex = 0;
-	bool odd_scanline = false;
-	short *row0, *row1;
-	int dir, k;
 	const int DJ = 4;
-	const int DITHER_MAX = 20;
 	const int err_len = (width + 2) * DJ;
-	BYTE clamp[DJ * 256] = { 0 };
-	auto erowErr = make_unique<short[]>(err_len);
-	auto orowErr = make_unique<short[]>(err_len);
-	char limtb[512] = { 0 };
-	auto lim = &limtb[256];
-	auto erowerr = erowErr.get();
-	auto orowerr = orowErr.get();
-	auto lookup = make_unique<int[]>(65536);
-	auto pDitherPixel = make_unique<int[]>(4);
-
-	for (int i = 0; i < 256; i++) {
-		clamp[i] = 0;
-		clamp[i + 256] = static_cast<BYTE>(i);
-		clamp[i + 512] = BYTE_MAX;
-		clamp[i + 768] = BYTE_MAX;
-
-		limtb[i] = -DITHER_MAX;
-		limtb[i + 256] = DITHER_MAX;
-	}
-	for (int i = -DITHER_MAX; i <= DITHER_MAX; i++)
-		limtb[i + 256] = i;
-
-	for (int i = 0; i < height; i++) {
-		if (odd_scanline) {
-			dir = -1;
-			pixelIndex += (width - 1);
-			row0 = &orowerr[DJ];
-			row1 = &erowerr[width * DJ];
-		}
-		else {
-			dir = 1;
-			row0 = &erowerr[DJ];
-			row1 = &orowerr[width * DJ];
-		}
-		row1[0] = row1[1] = row1[2] = row1[3] = 0;
-		for (UINT j = 0; j < width; ++j) {
-			Color c(pixels[pixelIndex]);
-
-			CalcDitherPixel(pDitherPixel.get(), c, clamp, row0, hasSemiTransparency);
-			int r_pix = pDitherPixel[0];
-			int g_pix = pDitherPixel[1];
-			int b_pix = pDitherPixel[2];
-			int a_pix = pDitherPixel[3];
-			auto argb = Color::MakeARGB(a_pix, r_pix, g_pix, b_pix);
-			Color c1(argb);
-			int offset = GetARGBIndex(c1, hasSemiTransparency);
-			if (!lookup[offset])
-				lookup[offset] = ditherFn(pPalette, nMaxColors, argb) + 1;
-
-			Color c2(pPalette->Entries[lookup[offset] - 1]);
-			qPixels[pixelIndex] = hasSemiTransparency ? c2.GetValue() : GetARGB1555(c2);
-
-			r_pix = lim[c1.GetR() - c2.GetR()];
-			g_pix = lim[c1.GetG() - c2.GetG()];
-			b_pix = lim[c1.GetB() - c2.GetB()];
-			a_pix = lim[c1.GetA() - c2.GetA()];
-
-			k = r_pix * 2;
-			row1[0 - DJ] = r_pix;
-			row1[0 + DJ] += (r_pix += k);
-			row1[0] += (r_pix += k);
-			row0[0 + DJ] += (r_pix += k);
-
-			k = g_pix * 2;
-			row1[1 - DJ] = g_pix;
-			row1[1 + DJ] += (g_pix += k);
-			row1[1] += (g_pix += k);
-			row0[1 + DJ] += (g_pix += k);
-
-			k = b_pix * 2;
-			row1[2 - DJ] = b_pix;
-			row1[2 + DJ] += (b_pix += k);
-			row1[2] += (b_pix += k);
-			row0[2 + DJ] += (b_pix += k);
-
-			k = a_pix * 2;
-			row1[3 - DJ] = a_pix;
-			row1[3 + DJ] += (a_pix += k);
-			row1[3] += (a_pix += k);
-			row0[3 + DJ] += (a_pix += k);
-
-			row0 += DJ;
-			row1 -= DJ;
-			pixelIndex += dir;
-		}
-		if ((i % 2) == 1)
-			pixelIndex += (width + 1);
-
-		odd_scanline = !odd_scanline;
+	// the lazy table is filled by one thread in the order of the pixels, MakeInverseColormap builds
+	// the colormap for the threads but a quantizer that matches in Lab or by CIEDE2000 keeps the table
+	m_nThreads = m_pColormap ? lookup.nThreads : 1;
+	if (m_pStats) {
+		const bool spread = lookup.wavefront || lookup.pattern != DitherPattern::Diffusion || lookup.tileSize > 0;
+		const UINT nThreads = spread ? (m_nThreads ? m_nThreads : max(thread::hardware_concurrency(), 1U)) : 1;
+		m_pStats->ditherThreads = max(m_pStats->ditherThreads, (size_t) nThreads);
 	}
-	return true;
-}
-
-bool ProcessImagePixels(Bitmap* pDest, const ARGB* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex)
-{
-	UINT bpp = GetPixelFormatSize(pDest->GetPixelFormat());
-	if (bpp < 16)
-		return false;
-	
-	if(hasSemiTransparency && pDest->GetPixelFormat() < PixelFormat32bppARGB)
-		pDest->ConvertFormat(PixelFormat32bppARGB, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
-	else if (transparentPixelIndex >= 0 && pDest->GetPixelFormat() < PixelFormat16bppARGB1555)
-		pDest->ConvertFormat(PixelFormat16bppARGB1555, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
-	else if(pDest->GetPixelFormat() != PixelFormat16bppRGB565)
-		pDest->ConvertFormat(PixelFormat16bppRGB565, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
-
-	BitmapData targetData;
-	UINT w = pDest->GetWidth();
-	UINT h = pDest->GetHeight();
-
-	Status status = pDest->LockBits(&Gdiplus::Rect(0, 0, w, h), ImageLockModeWrite, pDest->GetPixelFormat(), &targetData);
-	if (status != Ok) {
-		cerr << "Cannot write image" << endl;
-		return false;
+	if (lookup.pattern != DitherPattern::Diffusion)
+		m_pOrdered = make_unique<OrderedDither>(lookup.pattern, nMaxColors, hasSemiTransparency);
+	else if (lookup.tileSize) {
+		m_tileSize = lookup.tileSize;
+		m_tileOverlap = lookup.tileOverlap;
 	}
-
-	int pixelIndex = 0;
-
-	auto pRowDest = (LPBYTE)targetData.Scan0;
-	UINT strideDest;
-
-	// Compensate for possible negative stride
-	if (targetData.Stride > 0)
-		strideDest = targetData.Stride;
+	else if (lookup.wavefront)
+		m_pWavefront = make_unique<Wavefront>(width, m_nThreads);
 	else {
-		pRowDest += h * targetData.Stride;
-		strideDest = -targetData.Stride;
+		m_erowErr = make_unique<short[]>(err_len);
+		m_orowErr = make_unique<short[]>(err_len);
 	}
+	if (!m_pColormap)
+		m_lookup = make_unique<short[]>(65536);
+}
 
-	bpp = GetPixelFormatSize(pDest->GetPixelFormat());
+void PackPixels(BYTE* pRowDest, const int strideDest, const UINT width, const UINT height, const UINT bpp, const ColorPalette* pPalette, const unsigned short* qPixels, const bool isARGB1555)
+{
+	size_t pixelIndex = 0;
 	if (bpp == 32) {
-		for (UINT y = 0; y < h; ++y) {	// For each row...
-			for (UINT x = 0; x < w * 4;) {
-				Color c(qPixels[pixelIndex++]);
+		for (UINT y = 0; y < height; ++y) {	// For each row...
+			for (UINT x = 0; x < width * 4;) {
+				Color c(pPalette->Entries[qPixels[pixelIndex++]]);
 				pRowDest[x++] = c.GetB();
 				pRowDest[x++] = c.GetG();
 				pRowDest[x++] = c.GetR();
@@ -709,62 +513,25 @@ bool ProcessImagePixels(Bitmap* pDest, const ARGB* qPixels, const bool& hasSemiT
 			}
 			pRowDest += strideDest;
 		}
+		return;
 	}
-	else if (bpp == 16) {
-		for (UINT y = 0; y < h; ++y) {	// For each row...
-			for (UINT x = 0; x < w * 2;) {
-				auto argb = qPixels[pixelIndex++];
+
+	if (bpp == 16) {
+		for (UINT y = 0; y < height; ++y) {	// For each row...
+			for (UINT x = 0; x < width * 2;) {
+				Color c(pPalette->Entries[qPixels[pixelIndex++]]);
+				auto argb = isARGB1555 ? GetARGB1555(c) : GetARGBIndex(c, false);
 				pRowDest[x++] = static_cast<BYTE>(argb & 0xFF);
 				pRowDest[x++] = static_cast<BYTE>(argb >> 8);
 			}
 			pRowDest += strideDest;
 		}
-	}
-	else {
-		for (UINT y = 0; y < h; ++y) {	// For each row...
-			for (UINT x = 0; x < w; ++x) {
-				auto argb = qPixels[pixelIndex++];
-				pRowDest[x] = static_cast<BYTE>(argb);
-			}
-			pRowDest += strideDest;
-		}
-	}
-
-	status = pDest->UnlockBits(&targetData);
-	return pDest->GetLastStatus() == Ok;
-}
-
-bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels)
-{
-	pDest->SetPalette(pPalette);
-
-	BitmapData targetData;
-	UINT w = pDest->GetWidth();
-	UINT h = pDest->GetHeight();
-
-	Status status = pDest->LockBits(&Gdiplus::Rect(0, 0, w, h), ImageLockModeWrite, pDest->GetPixelFormat(), &targetData);
-	if (status != Ok) {
-		cerr << "Cannot write image" << endl;
-		return false;
-	}
-
-	int pixelIndex = 0;
-
-	auto pRowDest = (LPBYTE)targetData.Scan0;
-	UINT strideDest;
-
-	// Compensate for possible negative stride
-	if (targetData.Stride > 0)
-		strideDest = targetData.Stride;
-	else {
-		pRowDest += h * targetData.Stride;
-		strideDest = -targetData.Stride;
+		return;
 	}
 
-	UINT bpp = GetPixelFormatSize(pDest->GetPixelFormat());
-	// Second loop: fill indexed bitmap
-	for (UINT y = 0; y < h; y++) {	// For each row...
-		for (UINT x = 0; x < w; x++) {	// ...for each pixel...
+	// Fill indexed rows
+	for (UINT y = 0; y < height; y++) {	// For each row...
+		for (UINT x = 0; x < width; x++) {	// ...for each pixel...
 			BYTE nibbles = 0;
 			BYTE index = static_cast<BYTE>(qPixels[pixelIndex++]);
 
@@ -801,12 +568,88 @@ bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsig
 
 		pRowDest += strideDest;
 	}
+}
+
+#ifdef _WIN32
+bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels)
+{
+	pDest->SetPalette(pPalette);
+
+	BitmapData targetData;
+	UINT w = pDest->GetWidth();
+	UINT h = pDest->GetHeight();
+
+	Status status = pDest->LockBits(&Gdiplus::Rect(0, 0, w, h), ImageLockModeWrite, pDest->GetPixelFormat(), &targetData);
+	if (status != Ok) {
+		cerr << "Cannot write image" << endl;
+		return false;
+	}
+
+	auto pRowDest = (LPBYTE)targetData.Scan0;
+	UINT strideDest;
+
+	// Compensate for possible negative stride
+	if (targetData.Stride > 0)
+		strideDest = targetData.Stride;
+	else {
+		pRowDest += h * targetData.Stride;
+		strideDest = -targetData.Stride;
+	}
+
+	PackPixels(pRowDest, strideDest, w, h, GetPixelFormatSize(pDest->GetPixelFormat()), pPalette, qPixels);
+
+	status = pDest->UnlockBits(&targetData);
+	return pDest->GetLastStatus() == Ok;
+}
+
+bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels, const bool& hasSemiTransparency, const long long& transparentPixelIndex)
+{
+	UINT bpp = GetPixelFormatSize(pDest->GetPixelFormat());
+	if (pPalette->Count <= 256) {
+		if (bpp > 8 || pPalette->Count > (1U << bpp))
+			pDest->ConvertFormat(PixelFormat8bppIndexed, DitherTypeSolid, PaletteTypeCustom, const_cast<ColorPalette*>(pPalette), 0);
+		return ProcessImagePixels(pDest, pPalette, qPixels);
+	}
+
+	if (bpp < 16)
+		return false;
+
+	if(hasSemiTransparency && pDest->GetPixelFormat() < PixelFormat32bppARGB)
+		pDest->ConvertFormat(PixelFormat32bppARGB, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
+	else if (transparentPixelIndex >= 0 && pDest->GetPixelFormat() < PixelFormat16bppARGB1555)
+		pDest->ConvertFormat(PixelFormat16bppARGB1555, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
+	else if(pDest->GetPixelFormat() != PixelFormat16bppRGB565)
+		pDest->ConvertFormat(PixelFormat16bppRGB565, DitherTypeSolid, PaletteTypeOptimal, nullptr, 0);
+
+	BitmapData targetData;
+	UINT w = pDest->GetWidth();
+	UINT h = pDest->GetHeight();
+
+	Status status = pDest->LockBits(&Gdiplus::Rect(0, 0, w, h), ImageLockModeWrite, pDest->GetPixelFormat(), &targetData);
+	if (status != Ok) {
+		cerr << "Cannot write image" << endl;
+		return false;
+	}
+
+	auto pRowDest = (LPBYTE)targetData.Scan0;
+	UINT strideDest;
+
+	// Compensate for possible negative stride
+	if (targetData.Stride > 0)
+		strideDest = targetData.Stride;
+	else {
+		pRowDest += h * targetData.Stride;
+		strideDest = -targetData.Stride;
+	}
+
+	const bool isARGB1555 = pDest->GetPixelFormat() == PixelFormat16bppARGB1555;
+	PackPixels(pRowDest, strideDest, w, h, GetPixelFormatSize(pDest->GetPixelFormat()), pPalette, qPixels, isARGB1555);
 
 	status = pDest->UnlockBits(&targetData);
 	return pDest->GetLastStatus() == Ok;
 }
 
-bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor)
+bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, long long& transparentPixelIndex, ARGB& transparentColor)
 {
 	const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
 	const UINT bitmapWidth = pSource->GetWidth();
@@ -815,7 +658,7 @@ bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency
 	hasSemiTransparency = false;
 	transparentPixelIndex = -1;
 
-	int pixelIndex = 0;
+	size_t pixelIndex = 0;
 	if (pSource->GetPixelFormat() & PixelFormatIndexed) {
 		int paletteSize = pSource->GetPaletteSize();
 		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + (1 << bitDepth) * sizeof(ARGB));
@@ -928,6 +771,21 @@ bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency
 	return true;
 }
 
+bool GrabPixels(Bitmap* pSource, SourceImage& source, const bool buildHistogram)
+{
+	source.width = pSource->GetWidth();
+	source.height = pSource->GetHeight();
+	source.buffer.resize((size_t) source.width * source.height);
+	source.pixels = source.buffer;
+	source.histogram.clear();
+	if (!GrabPixels(pSource, source.buffer, source.hasSemiTransparency, source.transparentPixelIndex, source.transparentColor))
+		return false;
+
+	if (buildHistogram)
+		FillHistogram(source);
+	return true;
+}
+
 bool HasTransparency(Bitmap* pSource)
 {
 	const UINT bitDepth = GetPixelFormatSize(pSource->GetPixelFormat());
@@ -1001,4 +859,344 @@ bool HasTransparency(Bitmap* pSource)
 	pSource->UnlockBits(&data);
 
 	return false;
+}
+#endif
+
+bool GrabPixels(const ARGB* pixels, const UINT width, const UINT height, const int stride, SourceImage& source, const bool buildHistogram)
+{
+	const size_t rowBytes = width * sizeof(ARGB);
+	if (pixels == nullptr || (size_t) abs(stride) < rowBytes)
+		return false;
+
+	source.width = width;
+	source.height = height;
+	source.histogram.clear();
+	if (stride == (int) rowBytes) {
+		source.buffer.clear();
+		source.pixels = PixelSpan(pixels, (size_t) width * height);
+	}
+	else {
+		source.buffer.resize((size_t) width * height);
+		auto pRowSource = (const BYTE*) pixels;
+		for (UINT y = 0; y < height; ++y) {
+			memcpy(&source.buffer[(size_t) y * width], pRowSource, rowBytes);
+			pRowSource += stride;
+		}
+		source.pixels = source.buffer;
+	}
+
+	source.hasSemiTransparency = false;
+	source.transparentPixelIndex = -1;
+	size_t pixelIndex = 0;
+	for (const auto& argb : source.pixels) {
+		BYTE pixelAlpha = Color(argb).GetA();
+		if (pixelAlpha < BYTE_MAX) {
+			if (pixelAlpha == 0) {
+				source.transparentColor = argb;
+				source.transparentPixelIndex = (long long) pixelIndex;
+			}
+			else
+				source.hasSemiTransparency = true;
+		}
+		++pixelIndex;
+	}
+
+	if (buildHistogram)
+		FillHistogram(source);
+	return true;
+}
+
+void FillHistogram(SourceImage& source)
+{
+	source.histogram.clear();
+	for (const auto& pixel : source.pixels)
+		++source.histogram[pixel];
+}
+
+bool ScanBands(const ReadBandFn& readBand, const UINT width, const UINT height, const UINT bandHeight, SourceImage& source)
+{
+	if (width == 0 || bandHeight == 0)
+		return false;
+
+	source.width = width;
+	source.height = height;
+	source.buffer.clear();
+	source.pixels = PixelSpan();
+	source.histogram.clear();
+	source.hasSemiTransparency = false;
+	source.transparentPixelIndex = -1;
+
+	auto band = make_unique<ARGB[]>((size_t) width * bandHeight);
+	size_t pixelIndex = 0;
+	for (UINT y = 0; y < height; ) {
+		const UINT rows = min(bandHeight, height - y);
+		if (!readBand(y, rows, band.get()))
+			return false;
+
+		const size_t count = (size_t) width * rows;
+		for (size_t i = 0; i < count; ++i, ++pixelIndex) {
+			auto argb = band[i];
+			BYTE pixelAlpha = Color(argb).GetA();
+			if (pixelAlpha < BYTE_MAX) {
+				if (pixelAlpha == 0) {
+					source.transparentColor = argb;
+					source.transparentPixelIndex = (long long) pixelIndex;
+				}
+				else
+					source.hasSemiTransparency = true;
+			}
+			++source.histogram[argb];
+		}
+		y += rows;
+	}
+	return true;
+}
+
+bool MergeHistograms(const vector<const SourceImage*>& sources, SourceImage& merged)
+{
+	if (sources.empty())
+		return false;
+
+	merged.width = merged.height = 0;
+	merged.buffer.clear();
+	merged.pixels = PixelSpan();
+	merged.histogram.clear();
+	merged.hasSemiTransparency = false;
+	merged.transparentPixelIndex = -1;
+
+	size_t offset = 0;
+	for (auto pSource : sources) {
+		if (pSource->histogram.empty()) {
+			for (const auto& pixel : pSource->pixels)
+				++merged.histogram[pixel];
+		}
+		else {
+			for (const auto& entry : pSource->histogram)
+				merged.histogram[entry.first] += entry.second;
+		}
+
+		if (pSource->hasSemiTransparency)
+			merged.hasSemiTransparency = true;
+		if (pSource->transparentPixelIndex >= 0) {
+			merged.transparentColor = pSource->transparentColor;
+			merged.transparentPixelIndex = (long long) offset + pSource->transparentPixelIndex;
+		}
+		offset += (size_t) pSource->width * pSource->height;
+	}
+	return true;
+}
+
+// The threads ParallelFor hands its loops to, started when a loop first asks
+// for more of them than are idle and kept for the loops after. The calling
+// thread always runs its own loop as well, so a loop gets done however busy
+// the pool is and a loop may start another from within. A loop takes no more
+// than the helpers it asks for, the wavefront counts on that.
+class ThreadPool
+{
+	public:
+		struct Loop
+		{
+			const function<void(size_t)>& fn;
+			const size_t count;
+			UINT helpers;	// pool threads it may still take
+			UINT active = 0;	// pool threads working on it
+			atomic<size_t> nextIndex{ 0 };
+
+			Loop(const function<void(size_t)>& fn, const size_t count, const UINT helpers) : fn(fn), count(count), helpers(helpers) {}
+
+			void Run()
+			{
+				for (size_t i = nextIndex++; i < count; i = nextIndex++)
+					fn(i);
+			}
+		};
+
+	private:
+		mutex m_mutex;
+		condition_variable m_work, m_done;
+		deque<Loop*> m_loops;	// waiting for helpers
+		vector<thread> m_threads;
+		UINT m_idle = 0;
+		bool m_stop = false;
+
+		void work()
+		{
+			unique_lock<mutex> lock(m_mutex);
+			for (;;) {
+				++m_idle;
+				m_work.wait(lock, [this] { return m_stop || !m_loops.empty(); });
+				--m_idle;
+				if (m_stop)
+					return;
+
+				auto& loop = *m_loops.front();
+				if (--loop.helpers == 0)
+					m_loops.pop_front();
+				++loop.active;
+				lock.unlock();
+				loop.Run();
+				lock.lock();
+				if (--loop.active == 0)
+					m_done.notify_all();
+			}
+		}
+
+	public:
+		~ThreadPool()
+		{
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_work.notify_all();
+			for (auto& t : m_threads)
+				t.join();
+		}
+
+		void Run(Loop& loop)
+		{
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_loops.push_back(&loop);
+				for (UINT i = m_idle; i < loop.helpers; ++i)
+					m_threads.emplace_back(&ThreadPool::work, this);
+			}
+			m_work.notify_all();
+			loop.Run();
+
+			unique_lock<mutex> lock(m_mutex);
+			auto waiting = find(m_loops.begin(), m_loops.end(), &loop);
+			if (waiting != m_loops.end())
+				m_loops.erase(waiting);
+			m_done.wait(lock, [&loop] { return loop.active == 0; });
+		}
+};
+
+void ParallelFor(const size_t count, UINT nThreads, const function<void(size_t)>& fn)
+{
+	if (nThreads == 0)
+		nThreads = max(thread::hardware_concurrency(), 1U);
+	if (nThreads > count)
+		nThreads = (UINT) count;
+
+	ThreadPool::Loop loop(fn, count, nThreads > 1 ? nThreads - 1 : 0);
+	if (loop.helpers == 0) {
+		loop.Run();
+		return;
+	}
+
+	static ThreadPool pool;
+	pool.Run(loop);
+}
+
+PaletteCache::PaletteCache(const string& directory) : m_directory(directory)
+{
+}
+
+string PaletteCache::GetFilePath(const string& key) const
+{
+	const auto last = m_directory.back();
+	return m_directory + ((last == '/' || last == '\\') ? "" : "/") + key + ".pal";
+}
+
+bool PaletteCache::Find(const string& key, ColorPalette* pPalette, UINT& nMaxColors)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto got = m_palettes.find(key);
+	if (got == m_palettes.end()) {
+		if (m_directory.empty())
+			return false;
+
+		// count followed by the entries, in native byte order
+		ifstream file(GetFilePath(key), ios::binary);
+		UINT count = 0;
+		if (!file.read((char*) &count, sizeof(count)) || count == 0 || count > nMaxColors)
+			return false;
+
+		vector<ARGB> entries(count);
+		if (!file.read((char*) entries.data(), count * sizeof(ARGB)))
+			return false;
+		got = m_palettes.emplace(key, move(entries)).first;
+	}
+
+	const auto& entries = got->second;
+	if (entries.size() > nMaxColors)
+		return false;
+
+	nMaxColors = pPalette->Count = (UINT) entries.size();
+	for (UINT i = 0; i < nMaxColors; ++i)
+		pPalette->Entries[i] = entries[i];
+	return true;
+}
+
+void PaletteCache::Store(const string& key, const ColorPalette* pPalette)
+{
+	lock_guard<mutex> lock(m_mutex);
+	m_palettes[key].assign(pPalette->Entries, pPalette->Entries + pPalette->Count);
+	if (m_directory.empty())
+		return;
+
+	// written aside first, so another process never reads half a palette
+	const auto filePath = GetFilePath(key);
+	const auto tempPath = filePath + ".tmp";
+	{
+		ofstream file(tempPath, ios::binary | ios::trunc);
+		file.write((const char*) &pPalette->Count, sizeof(pPalette->Count));
+		file.write((const char*) pPalette->Entries, pPalette->Count * sizeof(ARGB));
+		if (!file)
+			return;
+	}
+	remove(filePath.c_str());
+	if (rename(tempPath.c_str(), filePath.c_str()) != 0)
+		remove(tempPath.c_str());
+}
+
+static inline unsigned long long MixColor(const ARGB argb)
+{
+	// splitmix64 finalizer, spreads the bits of each colour over the whole hash
+	unsigned long long z = argb + 0x9E3779B97F4A7C15ULL;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+string PaletteKey(const char* algorithm, const SourceImage& source, const UINT nMaxColors, const vector<int>& params, const bool byPixels)
+{
+	unsigned long long hash = 14695981039346656037ULL, total = 0;
+	if (byPixels) {
+		hash = (hash ^ source.width) * 1099511628211ULL;
+		for (const auto& pixel : source.pixels)
+			hash = (hash ^ MixColor(pixel)) * 1099511628211ULL;
+		total = source.pixels.size();
+	}
+	else {
+		// the colours and their counts are chained in the order of the colours, which is the same for the histogram and for the pixels it counts
+		unordered_map<ARGB, size_t> counted;
+		if (source.histogram.empty()) {
+			for (const auto& pixel : source.pixels)
+				++counted[pixel];
+		}
+		const auto& histogram = source.histogram.empty() ? counted : source.histogram;
+		vector<pair<ARGB, size_t> > entries(histogram.cbegin(), histogram.cend());
+		sort(entries.begin(), entries.end());
+		for (const auto& entry : entries) {
+			hash = (hash ^ MixColor(entry.first)) * 1099511628211ULL;
+			hash = (hash ^ entry.second) * 1099511628211ULL;
+			total += entry.second;
+		}
+	}
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "-%u-%016llx-%llx", nMaxColors, hash, total);
+	string key = algorithm;
+	key += buffer;
+	for (const auto& param : params)
+		key += "-" + to_string(param);
+	if (source.hasSemiTransparency)
+		key += "-s";
+	if (source.transparentPixelIndex >= 0) {
+		snprintf(buffer, sizeof(buffer), "-t%08x", (UINT) source.transparentColor);
+		key += buffer;
+	}
+	return key;
 }
\ No newline at end of file
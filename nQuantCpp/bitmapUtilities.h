@@ -1,9 +1,25 @@
 #pragma once
+#include <atomic>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
+#include "InverseColormap.h"
+#include "NearestMap.h"
+#include "OrderedDither.h"
 using namespace std;
 
+#if defined(_M_X64) || defined(__x86_64__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define DITHER_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
 //////////////////////////////////////////////////////////////////////////
 //
 // GetBitmapHeaderSize
@@ -58,19 +74,476 @@ BOOL FixBitmapHeight(PVOID pDib, ULONG nSize, BOOL bTopDown);
 
 BOOL FillBitmapFileHeader(LPCVOID pDib, PBITMAPFILEHEADER pbmfh);
 
-typedef unsigned short (*DitherFn)(const ColorPalette*, const UINT nMaxColors, const ARGB);
+#endif
+
+struct QuantizeStats;
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Matchers
+//
+// The nearest palette entry search of a remap is a template parameter of
+// dither_image, BandDitherer and RemapBands: anything callable as
+// matcher(pPalette, nMaxColors, argb) that gives an index, usually a lambda
+// over the quantizer, so that it is inlined into the pixel loops rather than
+// called through a function object. MatchPixels maps a run of pixels without
+// dithering by calling the matcher once per pixel. A matcher that does better
+// with a whole row at a time overloads it for its own type.
+//
+
+template <typename Matcher>
+void MatchPixels(const Matcher& matcher, const ColorPalette* pPalette, const UINT nMaxColors, const ARGB* pixels, const size_t count, unsigned short* qPixels);
+
+// the match of each pixel is the likely index of the next one, and a run of one colour is looked up once
+void MatchPixels(const NearestMap& nearestMap, const ColorPalette* pPalette, const UINT nMaxColors, const ARGB* pixels, const size_t count, unsigned short* qPixels);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// RemapBlocks
+//
+// The non-dithered remap of count pixels on up to nThreads threads, 0 for
+// all of them. The pixels are cut into blocks of REMAP_BLOCK, the same
+// blocks on any number of threads, and blockFn(worker, block, first, last)
+// maps each of them. Every thread has its own copy of worker: a copy of the
+// quantizer, whose lookup caches and random tie-break then belong to that
+// thread alone, or a pointer to a quantizer that only reads while it maps.
+// On one thread worker itself maps every block, nothing is copied.
+// The counters of quantizer copies are added to pStats at the end. A blockFn
+// that reseeds the tie-break from the block gives the same indices whatever
+// the number of threads.
+//
+
+const size_t REMAP_BLOCK = 16384;
+
+template <typename Worker, typename BlockFn>
+void RemapBlocks(Worker&& worker, const size_t count, UINT nThreads, QuantizeStats* pStats, const BlockFn& blockFn);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Error diffusion kernel
+//
+// The one loop every error diffusion runs, a template on how the alpha takes
+// part and on the directions of the scan, so that each of them is compiled
+// with its own constants and no test per pixel. Opaque copies the alpha and
+// weighs the errors of red and blue at half those of green, as the RGB565
+// dither lookup does. Diffuse spreads all four channels alike. Visible does
+// as well but matches fully transparent pixels by their own colour, as WU
+// has always done. The errors of a pixel sit in its rows of errors as B, G,
+// R and A, the order of the bytes of an ARGB, so with SSE2 the four of them
+// are moved, clamped and passed on in one go as 16 bit fixed point lanes.
+// Elsewhere the clamp and error bound tables made by the compiler do it.
+//
+
+enum class DitherAlpha { Opaque, Diffuse, Visible };
+
+// Diffuses the error over the width pixels of one row from pixelIndex on, DIR of 1 going right and -1 left.
+// row0 holds the errors of the row at its first pixel, row1 those the row passes on below it, which move by
+// NEXT columns per pixel. stepFn(j) runs before the j-th pixel and indexFn(argb) gives its palette index.
+template <DitherAlpha ALPHA, int DIR, int NEXT, typename IndexFn, typename StepFn>
+void DiffuseRow(const ARGB* pixels, unsigned short* qPixels, size_t pixelIndex, const UINT width, short* row0, short* row1,
+	const ColorPalette* pPalette, const IndexFn& indexFn, const StepFn& stepFn);
+
+// Diffuses rows of width pixels in the serpentine scan, odd rows right to left. erowerr and orowerr hold
+// (width + 2) * 4 errors each and take turns, oddScanline carries the parity of the next row over to the next call.
+template <DitherAlpha ALPHA, typename IndexFn>
+void DiffuseSerpentine(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const UINT width, short* erowerr, short* orowerr,
+	bool& oddScanline, const ColorPalette* pPalette, const IndexFn& indexFn);
+
+// Diffuses the image in square tiles of tileSize pixels on up to nThreads threads, 0 for all of them. Each tile
+// runs the serpentine scan over its own rows of errors from overlap pixels before its edges to overlap pixels past
+// them. Within overlap of a seam a pixel goes to the tile on either side by how its noise compares to its distance
+// from the seam, so the tiles blend into each other. Every pixel goes to one tile, whatever the number of threads.
+// A tileSize of at least width and height gives the indices of DiffuseSerpentine.
+template <DitherAlpha ALPHA, typename IndexFn>
+void DiffuseTiles(const ARGB* pixels, unsigned short* qPixels, const UINT width, const UINT height, const UINT tileSize, const UINT overlap,
+	const UINT nThreads, const ColorPalette* pPalette, const IndexFn& indexFn);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Wavefront
+//
+// Error diffusion whose rows all run left to right, spread over up to
+// nThreads threads, 0 for all of them. A pixel adds to the next one of its
+// row and to three of the row below, so a row can go as far as two pixels
+// short of the row above and its rows of errors are final there. Rows are
+// handed out in order, so no more than nThreads of them are under way and
+// the ErrorRows() rows of errors it keeps, taken in turn by the rows of the
+// image, hold what they need. The indices do not depend on the number of threads.
+//
+
+class Wavefront
+{
+	private:
+		UINT m_width;
+		UINT m_nThreads;
+		unique_ptr<atomic<unsigned long long>[]> m_done;	// for each row of errors, row * (width + 1) plus the pixels done
+		unique_ptr<short[]> m_rowErrs;	// one for each row under way and one for the row below them
+
+	public:
+		// pixels a row does between telling the row below
+		static const UINT STEP = 16;
+
+		Wavefront(const UINT width, const UINT nThreads);
+
+		inline UINT Threads() const { return m_nThreads; }
+		inline UINT ErrorRows() const { return m_nThreads + 1; }
+
+		// returns once the row above row has done pixels of its own, ready holds how many it was last seen to have done
+		inline void Wait(const size_t row, const UINT pixels, UINT& ready) const
+		{
+			if (row == 0) {
+				ready = m_width;
+				return;
+			}
+
+			const auto& done = m_done[(row - 1) % ErrorRows()];
+			const unsigned long long start = (row - 1) * (m_width + 1ull);
+			while (ready < pixels) {
+				const auto value = done.load(memory_order_acquire);
+				if (value > start)
+					ready = (UINT) (value - start);
+				if (ready < pixels)
+					this_thread::yield();
+			}
+		}
+
+		inline void Done(const size_t row, const UINT pixels)
+		{
+			m_done[row % ErrorRows()].store(row * (m_width + 1ull) + pixels, memory_order_release);
+		}
+
+		// rowFn(row) for rows first to first + rows - 1 of the image
+		template <typename RowFn>
+		void Run(const size_t first, const UINT rows, const RowFn& rowFn);
+
+		// diffuses row of the image from within rowFn, pixels and qPixels start at its first pixel
+		template <DitherAlpha ALPHA, typename IndexFn>
+		void DitherRow(const size_t row, const ARGB* pixels, unsigned short* qPixels, const ColorPalette* pPalette, const IndexFn& indexFn);
+};
+
+// pColormap, when given, replaces the lookup table that matcher fills, lookup tells whether the rows run in a wavefront
+// or in tiles, or are dithered by a pattern instead
+template <typename Matcher>
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, const Matcher& matcher, const bool& hasSemiTransparency, const long long& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, QuantizeStats* pStats = nullptr, const InverseColormap* pColormap = nullptr, const DitherLookup& lookup = DitherLookup());
+
+// The error diffusion of dither_image, fed one band of rows at a time.
+// Only the rows of errors and the lookup table are carried from band to band,
+// so every band is to be given the same matcher. The ordered dither only
+// carries the row it has come to, the tiles start over in every band.
+class BandDitherer
+{
+	private:
+		const ColorPalette* m_pPalette;
+		bool m_hasSemiTransparency;
+		UINT m_nMaxColors;
+		UINT m_width;
+		QuantizeStats* m_pStats;
+		const InverseColormap* m_pColormap;
+		bool m_oddScanline = false;
+		unique_ptr<short[]> m_erowErr, m_orowErr;
+		unique_ptr<short[]> m_lookup;
+		unique_ptr<Wavefront> m_pWavefront;
+		unique_ptr<OrderedDither> m_pOrdered;
+		UINT m_tileSize = 0, m_tileOverlap = 0;
+		UINT m_nThreads = 1;	// of the ordered dither and the tiles
+		size_t m_row = 0;	// of the image, at the start of the next band
+
+		template <DitherAlpha ALPHA, typename Matcher>
+		unsigned short nearest(const ARGB argb, const Matcher& matcher);
+		template <DitherAlpha ALPHA, typename Matcher>
+		void ditherRows(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const Matcher& matcher);
+
+	public:
+		BandDitherer(const ColorPalette* pPalette, const bool& hasSemiTransparency, const UINT nMaxColors, const UINT width, QuantizeStats* pStats = nullptr, const InverseColormap* pColormap = nullptr, const DitherLookup& lookup = DitherLookup());
+		template <typename Matcher>
+		void DitherRows(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const Matcher& matcher);
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PixelSpan
+//
+// Read-only view over ARGB pixels owned by someone else, either a caller
+// supplied buffer or SourceImage::buffer. The quantizers only ever read
+// their input, so the view lets them run on a caller's buffer in place.
+//
+
+struct PixelSpan
+{
+	const ARGB* pixels = nullptr;
+	size_t count = 0;
+
+	PixelSpan() = default;
+	PixelSpan(const ARGB* pixels, const size_t count) : pixels(pixels), count(count) {}
+	PixelSpan(const vector<ARGB>& pixels) : pixels(pixels.data()), count(pixels.size()) {}
+
+	const ARGB* data() const { return pixels; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	const ARGB& operator[](const size_t i) const { return pixels[i]; }
+	const ARGB* begin() const { return pixels; }
+	const ARGB* end() const { return pixels + count; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// SourceImage
+//
+// Pixels of a source image decoded once, so that several quantizers can
+// share them. pixels views either the caller's buffer or buffer, which is
+// why a SourceImage cannot be copied. The histogram counts each distinct
+// ARGB value and is only filled when GrabPixels is asked for it.
+//
+
+struct SourceImage
+{
+	UINT width = 0, height = 0;
+	PixelSpan pixels;
+	vector<ARGB> buffer;
+	bool hasSemiTransparency = false;
+	long long transparentPixelIndex = -1;
+	ARGB transparentColor = Color::Transparent;
+	unordered_map<ARGB, size_t> histogram;
+
+	SourceImage() = default;
+	SourceImage(const SourceImage&) = delete;
+	SourceImage& operator=(const SourceImage&) = delete;
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// GrabPixels
+//
+// Wraps a caller owned 32bpp buffer, rows of width pixels stride bytes apart.
+// Each pixel is an ARGB value in native byte order, i.e. B, G, R, A bytes on
+// little-endian machines. Tightly packed rows are used in place, otherwise
+// they are repacked once into source.buffer. The buffer must outlive source.
+//
+
+bool GrabPixels(const ARGB* pixels, const UINT width, const UINT height, const int stride, SourceImage& source, const bool buildHistogram = false);
+
+void FillHistogram(SourceImage& source);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// Banded images
+//
+// Images too large to hold at once are read and written in bands of rows.
+// ReadBandFn fills rows [y, y + rows) into a buffer of rows * width pixels and
+// WriteBandFn receives the palette indices of the same rows, either returns
+// false to stop. Only one band of pixels and one of indices is held at a time.
+//
+
+typedef function<bool(const UINT y, const UINT rows, ARGB* pixels)> ReadBandFn;
+typedef function<bool(const UINT y, const UINT rows, const unsigned short* qPixels)> WriteBandFn;
+
+// Reads every band once to fill the histogram and transparency of source, source.pixels stays empty.
+// transparentPixelIndex is that of the last fully transparent pixel counted over all the bands.
+bool ScanBands(const ReadBandFn& readBand, const UINT width, const UINT height, const UINT bandHeight, SourceImage& source);
+
+// Reads every band again and maps it to palette indices with matcher, diffusing the error across bands when dither is set.
+// transparentIndex receives the palette index of the last fully transparent pixel, or -1.
+// pColormap, when given, serves the dithered colours in place of matcher, lookup tells whether the rows run in a wavefront.
+template <typename Matcher>
+bool RemapBands(const ReadBandFn& readBand, const WriteBandFn& writeBand, const UINT width, const UINT height, const UINT bandHeight,
+	const ColorPalette* pPalette, const Matcher& matcher, const bool dither, const bool& hasSemiTransparency, const UINT nMaxColors, int& transparentIndex, QuantizeStats* pStats = nullptr,
+	const InverseColormap* pColormap = nullptr, const DitherLookup& lookup = DitherLookup());
+
+//////////////////////////////////////////////////////////////////////////
+//
+// MergeHistograms
+//
+// Adds up the histograms of several images, e.g. the frames of an animation
+// or the sprites of a sheet, so that one palette can be built for all of them.
+// An image without a histogram is counted pixel by pixel. merged.pixels stays
+// empty, its transparency is that of the images as if they were stacked.
+//
+
+bool MergeHistograms(const vector<const SourceImage*>& sources, SourceImage& merged);
+
+// Calls fn(0) to fn(count - 1) on up to nThreads threads, 0 means one per logical processor. The calling
+// thread is one of them, the others come from a pool kept for the later calls, and calls may nest.
+void ParallelFor(const size_t count, UINT nThreads, const function<void(size_t)>& fn);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PaletteCache
+//
+// Palettes already built, keyed by PaletteKey, so that the same colour
+// content quantized again with the same algorithm and parameters goes
+// straight to the remap. Kept in memory and, when a directory is given,
+// also as one .pal file per key there, which later runs read back.
+// A single cache may be shared by quantizers on several threads.
+//
+
+class PaletteCache
+{
+	private:
+		mutex m_mutex;
+		string m_directory;
+		unordered_map<string, vector<ARGB> > m_palettes;
+
+		string GetFilePath(const string& key) const;
+
+	public:
+		PaletteCache(const string& directory = "");
+		bool Find(const string& key, ColorPalette* pPalette, UINT& nMaxColors);
+		void Store(const string& key, const ColorPalette* pPalette);
+};
+
+// Names the palette algorithm builds for source with nMaxColors and params.
+// The colours and their counts are hashed in the order of the colours, from the histogram when source has one,
+// unless byPixels is set for algorithms whose palette also depends on the order of the pixels.
+string PaletteKey(const char* algorithm, const SourceImage& source, const UINT nMaxColors, const vector<int>& params = {}, const bool byPixels = false);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// PackPixels
+//
+// Writes palette indices into rows of the given bit depth, stride bytes
+// apart. 1, 4 and 8 bpp store the index itself, 16 bpp stores the palette
+// colour as RGB565 or ARGB1555 and 32 bpp as B, G, R, A bytes.
+//
+
+void PackPixels(BYTE* pRowDest, const int strideDest, const UINT width, const UINT height, const UINT bpp, const ColorPalette* pPalette, const unsigned short* qPixels, const bool isARGB1555 = false);
+
+//////////////////////////////////////////////////////////////////////////
+//
+// FastRandom
+//
+// xoshiro128** generator each quantizer owns in place of rand(), whose
+// hidden global state is shared by every thread. A quantizer starts from
+// the same seed every time unless SetSeed is called, so its output can be
+// reproduced, and a copy of the quantizer carries on with its own state.
+//
+
+class FastRandom
+{
+	private:
+		UINT m_state[4];
+
+		static inline UINT rotl(const UINT x, const int k) { return (x << k) | (x >> (32 - k)); }
+
+	public:
+		FastRandom(const unsigned long long seed = 1) { Seed(seed); }
+
+		void Seed(unsigned long long seed)
+		{
+			// splitmix64 spreads the seed over the state, which must not be all zeros
+			for (int i = 0; i < 4; i += 2) {
+				unsigned long long z = (seed += 0x9E3779B97F4A7C15ULL);
+				z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+				z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+				z ^= z >> 31;
+				m_state[i] = (UINT) z;
+				m_state[i + 1] = (UINT) (z >> 32);
+			}
+		}
+
+		inline UINT Next()
+		{
+			const UINT result = rotl(m_state[1] * 5, 7) * 9;
+			const UINT t = m_state[1] << 9;
+			m_state[2] ^= m_state[0];
+			m_state[3] ^= m_state[1];
+			m_state[1] ^= m_state[2];
+			m_state[0] ^= m_state[3];
+			m_state[2] ^= t;
+			m_state[3] = rotl(m_state[3], 11);
+			return result;
+		}
+
+		// uniform in [0, bound), by a multiply instead of the modulo of rand() % bound
+		inline UINT Next(const UINT bound) { return (UINT) (((unsigned long long) Next() * bound) >> 32); }
+
+		// uniform in [0, 1)
+		inline double NextDouble() { return Next() * (1.0 / 4294967296.0); }
+};
+
+//////////////////////////////////////////////////////////////////////////
+//
+// QuantizeStats
+//
+// Optional figures a quantizer fills in for each QuantizeImage call once
+// it is handed one through SetStats. Times are in milliseconds and add up
+// over calls like the counters do, reset the struct between calls when needed.
+// A counter stays 0 when the algorithm has no such step.
+//
+
+struct QuantizeStats
+{
+	double paletteMs = 0.0;	// building the palette
+	double remapMs = 0.0;	// mapping or dithering the pixels to palette indices
+
+	size_t uniqueColors = 0;	// distinct colours or occupied bins the palette is reduced from
+	size_t nnSearches = 0;	// nearest neighbour searches, find_nn calls
+	size_t merges = 0;	// clusters merged into their nearest neighbour
+	size_t closestHits = 0, closestMisses = 0;	// closestMap and rightMatches lookups
+	size_t ditherHits = 0, ditherFills = 0;	// dither lookup table entries reused or computed
+	size_t iterations = 0;	// viterDoIteration passes, NeuQuant learning steps, MoDE generations, SPA/EAS refinement rounds
+	size_t levels = 0;	// coarse to fine levels visited by SPA and EAS
+	size_t ditherThreads = 0;	// the most threads the dither rows were handed to, 1 where the lazy table kept them on one
+
+	QuantizeStats& operator+=(const QuantizeStats& other)
+	{
+		paletteMs += other.paletteMs;
+		remapMs += other.remapMs;
+		uniqueColors += other.uniqueColors;
+		nnSearches += other.nnSearches;
+		merges += other.merges;
+		closestHits += other.closestHits;
+		closestMisses += other.closestMisses;
+		ditherHits += other.ditherHits;
+		ditherFills += other.ditherFills;
+		iterations += other.iterations;
+		levels += other.levels;
+		ditherThreads = max(ditherThreads, other.ditherThreads);
+		return *this;
+	}
+};
+
+// Splits the time of one QuantizeImage call into its palette and remap phases
+class PhaseTimer
+{
+	private:
+		QuantizeStats* m_pStats;
+		chrono::steady_clock::time_point m_start;
 
-bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height);
+		double Lap()
+		{
+			auto now = chrono::steady_clock::now();
+			auto elapsed = chrono::duration<double, milli>(now - m_start).count();
+			m_start = now;
+			return elapsed;
+		}
 
-bool dithering_image(const ARGB* pixels, ColorPalette* pPalette, DitherFn ditherFn, const bool& hasSemiTransparency, const int& transparentPixelIndex, const UINT nMaxColors, ARGB* qPixels, const UINT width, const UINT height);
+	public:
+		PhaseTimer(QuantizeStats* pStats) : m_pStats(pStats), m_start(chrono::steady_clock::now()) {}
 
-bool ProcessImagePixels(Bitmap* pDest, const ARGB* qPixels, const bool& hasSemiTransparency, const int& transparentPixelIndex);
+		void PaletteBuilt()
+		{
+			if (m_pStats)
+				m_pStats->paletteMs += Lap();
+		}
 
+		~PhaseTimer()
+		{
+			if (m_pStats)
+				m_pStats->remapMs += Lap();
+		}
+};
+
+#ifdef _WIN32
 bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels);
 
-bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, int& transparentPixelIndex, ARGB& transparentColor);
+bool ProcessImagePixels(Bitmap* pDest, const ColorPalette* pPalette, const unsigned short* qPixels, const bool& hasSemiTransparency, const long long& transparentPixelIndex);
+
+bool GrabPixels(Bitmap* pSource, vector<ARGB>& pixels, bool& hasSemiTransparency, long long& transparentPixelIndex, ARGB& transparentColor);
+
+bool GrabPixels(Bitmap* pSource, SourceImage& source, const bool buildHistogram = false);
 
 bool HasTransparency(Bitmap* pSource);
+#endif
 
 inline int GetARGBIndex(const Color& c, const bool& hasSemiTransparency)
 {
@@ -84,3 +557,377 @@ inline int GetARGB1555(const Color& c)
 	return (c.GetA() & 0x80) << 8 | (c.GetR() & 0xF8) << 7 | (c.GetG() & 0xF8) << 2 | (c.GetB() >> 3);
 }
 
+//////////////////////////////////////////////////////////////////////////
+//
+// Remap templates
+//
+// Defined here after QuantizeStats and GetARGBIndex, which they use.
+//
+
+template <typename Matcher>
+void MatchPixels(const Matcher& matcher, const ColorPalette* pPalette, const UINT nMaxColors, const ARGB* pixels, const size_t count, unsigned short* qPixels)
+{
+	for (size_t i = 0; i < count; ++i)
+		qPixels[i] = matcher(pPalette, nMaxColors, pixels[i]);
+}
+
+template <typename Worker>
+inline void SetWorkerStats(Worker& worker, QuantizeStats* pStats)
+{
+	worker.SetStats(pStats);
+}
+
+template <typename Worker>
+inline void SetWorkerStats(Worker*, QuantizeStats*)
+{
+}
+
+template <typename Worker, typename BlockFn>
+void RemapBlocks(Worker&& worker, const size_t count, UINT nThreads, QuantizeStats* pStats, const BlockFn& blockFn)
+{
+	const size_t nBlocks = (count + REMAP_BLOCK - 1) / REMAP_BLOCK;
+	if (nThreads == 0)
+		nThreads = max(thread::hardware_concurrency(), 1U);
+	if (nThreads > nBlocks)
+		nThreads = (UINT) max(nBlocks, (size_t) 1);
+
+	// a single thread maps with the caller's own worker, which counts into pStats already
+	if (nThreads == 1) {
+		for (size_t block = 0; block < nBlocks; ++block)
+			blockFn(worker, block, block * REMAP_BLOCK, min(count, (block + 1) * REMAP_BLOCK));
+		return;
+	}
+
+	vector<typename decay<Worker>::type> workers(nThreads, worker);
+	vector<QuantizeStats> stats(pStats ? nThreads : 0);
+	for (UINT i = 0; i < nThreads; ++i)
+		SetWorkerStats(workers[i], pStats ? &stats[i] : nullptr);
+
+	atomic<size_t> nextBlock(0);
+	ParallelFor(nThreads, nThreads, [&](size_t i) {
+		for (size_t block = nextBlock++; block < nBlocks; block = nextBlock++)
+			blockFn(workers[i], block, block * REMAP_BLOCK, min(count, (block + 1) * REMAP_BLOCK));
+	});
+
+	for (const auto& workerStats : stats)
+		*pStats += workerStats;
+}
+
+template <typename RowFn>
+void Wavefront::Run(const size_t first, const UINT rows, const RowFn& rowFn)
+{
+	ParallelFor(rows, m_nThreads, [&](size_t i) {
+		rowFn(first + i);
+	});
+}
+
+// The clamp of a colour moved by its error from index 256 on and the bound on the error a pixel passes on
+// from index 256 on, both made by the compiler
+struct DitherTables
+{
+	static const int DITHER_MAX = 20;
+	BYTE clamp[4 * 256];
+	char limtb[512];
+
+	constexpr DitherTables() : clamp(), limtb()
+	{
+		for (int i = 0; i < 256; ++i) {
+			clamp[i] = 0;
+			clamp[i + 256] = static_cast<BYTE>(i);
+			clamp[i + 512] = BYTE_MAX;
+			clamp[i + 768] = BYTE_MAX;
+
+			limtb[i] = -DITHER_MAX;
+			limtb[i + 256] = DITHER_MAX;
+		}
+		for (int i = -DITHER_MAX; i <= DITHER_MAX; ++i)
+			limtb[i + 256] = i;
+	}
+};
+
+constexpr DitherTables DITHER_TABLES;
+
+template <DitherAlpha ALPHA, int DIR, int NEXT, typename IndexFn, typename StepFn>
+void DiffuseRow(const ARGB* pixels, unsigned short* qPixels, size_t pixelIndex, const UINT width, short* row0, short* row1,
+	const ColorPalette* pPalette, const IndexFn& indexFn, const StepFn& stepFn)
+{
+	const int DJ = 4;
+#ifdef DITHER_SSE2
+	// the opaque dither leaves the alpha lane alone, the errors in the lanes of blue and red count half
+	const short RB_ROUND = ALPHA == DitherAlpha::Opaque ? 0x2010 : 0x1008;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_setr_epi16(RB_ROUND, 0x1008, RB_ROUND, 0x1008, 0, 0, 0, 0);
+	const __m128i half = _mm_setr_epi16(-1, 0, -1, 0, 0, 0, 0, 0);
+	const __m128i alphaLane = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, 0);
+	const __m128i bias = _mm_set1_epi16(256);
+	const __m128i minErr = _mm_set1_epi16(-DitherTables::DITHER_MAX), maxErr = _mm_set1_epi16(DitherTables::DITHER_MAX);
+
+	for (UINT j = 0; j < width; ++j) {
+		stepFn(j);
+		const ARGB pixel = pixels[pixelIndex];
+		const __m128i c = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) pixel), zero);
+
+		// the errors in 1/16 or 1/32 with the 256 of the clamp table and a half to round, saturated to bytes
+		const __m128i sum = _mm_add_epi16(_mm_loadl_epi64((const __m128i*) row0), round);
+		__m128i moved = _mm_srai_epi16(sum, 4);
+		if (ALPHA == DitherAlpha::Opaque)
+			moved = _mm_or_si128(_mm_and_si128(half, _mm_srai_epi16(sum, 5)), _mm_andnot_si128(half, moved));
+		__m128i pix = _mm_add_epi16(_mm_sub_epi16(moved, bias), c);
+		if (ALPHA == DitherAlpha::Opaque)
+			pix = _mm_or_si128(_mm_and_si128(alphaLane, c), _mm_andnot_si128(alphaLane, pix));
+		const __m128i packed = _mm_packus_epi16(pix, pix);
+
+		const ARGB argb = (ARGB) _mm_cvtsi128_si32(packed);
+		qPixels[pixelIndex] = indexFn(ALPHA == DitherAlpha::Visible && !(pixel >> 24) ? pixel : argb);
+
+		const __m128i entry = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) pPalette->Entries[qPixels[pixelIndex]]), zero);
+		__m128i err = _mm_sub_epi16(_mm_unpacklo_epi8(packed, zero), entry);
+		err = _mm_min_epi16(_mm_max_epi16(err, minErr), maxErr);
+		if (ALPHA == DitherAlpha::Opaque)
+			err = _mm_andnot_si128(alphaLane, err);
+
+		const __m128i k = _mm_add_epi16(err, err);
+		const __m128i err3 = _mm_add_epi16(err, k), err5 = _mm_add_epi16(err3, k), err7 = _mm_add_epi16(err5, k);
+		_mm_storel_epi64((__m128i*) &row1[NEXT * DJ], err);
+		_mm_storel_epi64((__m128i*) &row1[-NEXT * DJ], _mm_add_epi16(_mm_loadl_epi64((const __m128i*) &row1[-NEXT * DJ]), err3));
+		_mm_storel_epi64((__m128i*) row1, _mm_add_epi16(_mm_loadl_epi64((const __m128i*) row1), err5));
+		_mm_storel_epi64((__m128i*) &row0[DJ], _mm_add_epi16(_mm_loadl_epi64((const __m128i*) &row0[DJ]), err7));
+
+		row0 += DJ;
+		row1 += NEXT * DJ;
+		pixelIndex += DIR;
+	}
+#else
+	// the opaque dither leaves the alpha alone, the errors of blue and red count half
+	const int CHANNELS = ALPHA == DitherAlpha::Opaque ? 3 : 4;
+	const int RB_ROUND = ALPHA == DitherAlpha::Opaque ? 0x2010 : 0x1008, RB_SHIFT = ALPHA == DitherAlpha::Opaque ? 5 : 4;
+	const BYTE* clamp = DITHER_TABLES.clamp;
+	const char* lim = &DITHER_TABLES.limtb[256];
+
+	for (UINT j = 0; j < width; ++j) {
+		stepFn(j);
+		Color c(pixels[pixelIndex]);
+
+		int pix[4];
+		pix[0] = clamp[((row0[0] + RB_ROUND) >> RB_SHIFT) + c.GetB()];
+		pix[1] = clamp[((row0[1] + 0x1008) >> 4) + c.GetG()];
+		pix[2] = clamp[((row0[2] + RB_ROUND) >> RB_SHIFT) + c.GetR()];
+		pix[3] = ALPHA == DitherAlpha::Opaque ? c.GetA() : clamp[((row0[3] + 0x1008) >> 4) + c.GetA()];
+
+		const ARGB argb = Color::MakeARGB(pix[3], pix[2], pix[1], pix[0]);
+		qPixels[pixelIndex] = indexFn(ALPHA == DitherAlpha::Visible && !c.GetA() ? pixels[pixelIndex] : argb);
+
+		Color c2(pPalette->Entries[qPixels[pixelIndex]]);
+		pix[0] -= c2.GetB();
+		pix[1] -= c2.GetG();
+		pix[2] -= c2.GetR();
+		pix[3] -= c2.GetA();
+		for (int ch = 0; ch < CHANNELS; ++ch) {
+			int err = lim[pix[ch]];
+			const int k = err * 2;
+			row1[ch + NEXT * DJ] = err;
+			row1[ch - NEXT * DJ] += (err += k);
+			row1[ch] += (err += k);
+			row0[ch + DJ] += (err += k);
+		}
+
+		row0 += DJ;
+		row1 += NEXT * DJ;
+		pixelIndex += DIR;
+	}
+#endif
+}
+
+template <DitherAlpha ALPHA, typename IndexFn>
+void DiffuseSerpentine(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const UINT width, short* erowerr, short* orowerr,
+	bool& oddScanline, const ColorPalette* pPalette, const IndexFn& indexFn)
+{
+	const int DJ = 4;
+	auto noStep = [](const UINT) {};
+	for (UINT i = 0; i < rows; ++i) {
+		const size_t pixelIndex = (size_t) i * width;
+		if (oddScanline) {
+			auto row1 = &erowerr[width * DJ];
+			row1[0] = row1[1] = row1[2] = row1[3] = 0;
+			DiffuseRow<ALPHA, -1, -1>(pixels, qPixels, pixelIndex + width - 1, width, &orowerr[DJ], row1, pPalette, indexFn, noStep);
+		}
+		else {
+			auto row1 = &orowerr[width * DJ];
+			row1[0] = row1[1] = row1[2] = row1[3] = 0;
+			DiffuseRow<ALPHA, 1, -1>(pixels, qPixels, pixelIndex, width, &erowerr[DJ], row1, pPalette, indexFn, noStep);
+		}
+		oddScanline = !oddScanline;
+	}
+}
+
+// interleaved gradient noise after Jimenez, in [0, 1) and without the low frequencies that would show along a seam
+inline double SeamNoise(const UINT x, const UINT y)
+{
+	const double f = .06711056 * x + .00583715 * y;
+	const double g = 52.9829189 * (f - floor(f));
+	return g - floor(g);
+}
+
+// of the nTiles along one axis, the one position p goes to, near a seam the side its noise picks,
+// the more likely the further p lies on that side
+inline UINT TileOf(const UINT p, const UINT tileSize, const UINT overlap, const UINT nTiles, const double noise)
+{
+	const UINT k = p / tileSize, u = p % tileSize;
+	if (u < overlap && k > 0)
+		return noise < (u + overlap + .5) / (2 * overlap) ? k : k - 1;
+	if (u + overlap >= tileSize && k + 1 < nTiles)
+		return noise < (u + overlap - tileSize + .5) / (2 * overlap) ? k + 1 : k;
+	return k;
+}
+
+template <DitherAlpha ALPHA, typename IndexFn>
+void DiffuseTiles(const ARGB* pixels, unsigned short* qPixels, const UINT width, const UINT height, const UINT tileSize, const UINT overlap,
+	const UINT nThreads, const ColorPalette* pPalette, const IndexFn& indexFn)
+{
+	const UINT tile = max(tileSize, 2U), margin = min(overlap, tile / 2);
+	const UINT nCols = (width + tile - 1) / tile, nRows = (height + tile - 1) / tile;
+	ParallelFor((size_t) nCols * nRows, nThreads, [&](size_t t) {
+		const UINT tx = (UINT) (t % nCols), ty = (UINT) (t / nCols);
+		const UINT x0 = tx ? tx * tile - margin : 0, x1 = min(width, (tx + 1) * tile + margin);
+		const UINT y0 = ty ? ty * tile - margin : 0, y1 = min(height, (ty + 1) * tile + margin);
+		const UINT tileWidth = x1 - x0;
+
+		const int DJ = 4;
+		auto erowErr = make_unique<short[]>((tileWidth + 2) * DJ);
+		auto orowErr = make_unique<short[]>((tileWidth + 2) * DJ);
+		auto qRow = make_unique<unsigned short[]>(tileWidth);
+		bool oddScanline = false;
+		for (UINT y = y0; y < y1; ++y) {
+			DiffuseSerpentine<ALPHA>(pixels + (size_t) y * width + x0, qRow.get(), 1, tileWidth, erowErr.get(), orowErr.get(), oddScanline, pPalette, indexFn);
+
+			// only the pixels of the tile and those the seams hand it are its own
+			const bool nearRowSeam = margin && (y < ty * tile + margin || y + margin >= (ty + 1) * tile);
+			for (UINT x = x0; x < x1; ++x) {
+				const bool nearColSeam = margin && (x < tx * tile + margin || x + margin >= (tx + 1) * tile);
+				if (nearRowSeam || nearColSeam) {
+					const double noise = SeamNoise(x, y);
+					if (TileOf(x, tile, margin, nCols, noise) != tx || TileOf(y, tile, margin, nRows, noise) != ty)
+						continue;
+				}
+				qPixels[(size_t) y * width + x] = qRow[x - x0];
+			}
+		}
+	});
+}
+
+template <DitherAlpha ALPHA, typename IndexFn>
+void Wavefront::DitherRow(const size_t row, const ARGB* pixels, unsigned short* qPixels, const ColorPalette* pPalette, const IndexFn& indexFn)
+{
+	// the same spread of the error as the serpentine scan takes from left to right
+	const int DJ = 4;
+	const size_t errLen = (m_width + 2) * DJ;
+	auto row0 = &m_rowErrs[row % ErrorRows() * errLen + DJ];
+	auto row1 = &m_rowErrs[(row + 1) % ErrorRows() * errLen + DJ];
+	for (int i = -DJ; i < DJ; ++i)
+		row1[i] = 0;
+
+	UINT ready = 0;
+	DiffuseRow<ALPHA, 1, 1>(pixels, qPixels, 0, m_width, row0, row1, pPalette, indexFn, [&](const UINT j) {
+		if (j % STEP == 0)
+			Done(row, j);
+		Wait(row, min(j + 3, m_width), ready);
+	});
+	Done(row, m_width);
+}
+
+template <DitherAlpha ALPHA, typename Matcher>
+inline unsigned short BandDitherer::nearest(const ARGB argb, const Matcher& matcher)
+{
+	if (m_pColormap)
+		return m_pColormap->Nearest(argb);
+
+	const int offset = GetARGBIndex(Color(argb), ALPHA != DitherAlpha::Opaque);
+	if (!m_lookup[offset]) {
+		m_lookup[offset] = matcher(m_pPalette, m_nMaxColors, argb) + 1;
+		if (m_pStats)
+			++m_pStats->ditherFills;
+	}
+	else if (m_pStats)
+		++m_pStats->ditherHits;
+	return m_lookup[offset] - 1;
+}
+
+template <DitherAlpha ALPHA, typename Matcher>
+void BandDitherer::ditherRows(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const Matcher& matcher)
+{
+	auto indexFn = [&](const ARGB argb) {
+		return nearest<ALPHA>(argb, matcher);
+	};
+
+	if (m_pOrdered) {
+		ParallelFor(rows, m_nThreads, [&](size_t i) {
+			const size_t pixelIndex = i * m_width;
+			m_pOrdered->MapRow(pixels + pixelIndex, m_row + i, m_width, qPixels + pixelIndex, indexFn);
+		});
+	}
+	else if (m_tileSize)
+		DiffuseTiles<ALPHA>(pixels, qPixels, m_width, rows, m_tileSize, m_tileOverlap, m_nThreads, m_pPalette, indexFn);
+	else if (m_pWavefront) {
+		m_pWavefront->Run(m_row, rows, [&](const size_t row) {
+			const size_t pixelIndex = (row - m_row) * m_width;
+			m_pWavefront->DitherRow<ALPHA>(row, pixels + pixelIndex, qPixels + pixelIndex, m_pPalette, indexFn);
+		});
+	}
+	else
+		DiffuseSerpentine<ALPHA>(pixels, qPixels, rows, m_width, m_erowErr.get(), m_orowErr.get(), m_oddScanline, m_pPalette, indexFn);
+	m_row += rows;
+}
+
+template <typename Matcher>
+void BandDitherer::DitherRows(const ARGB* pixels, unsigned short* qPixels, const UINT rows, const Matcher& matcher)
+{
+	if (m_hasSemiTransparency)
+		ditherRows<DitherAlpha::Diffuse>(pixels, qPixels, rows, matcher);
+	else
+		ditherRows<DitherAlpha::Opaque>(pixels, qPixels, rows, matcher);
+}
+
+template <typename Matcher>
+bool dither_image(const ARGB* pixels, const ColorPalette* pPalette, const Matcher& matcher, const bool& hasSemiTransparency, const long long&, const UINT nMaxColors, unsigned short* qPixels, const UINT width, const UINT height, QuantizeStats* pStats, const InverseColormap* pColormap, const DitherLookup& lookup)
+{
+	BandDitherer ditherer(pPalette, hasSemiTransparency, nMaxColors, width, pStats, pColormap, lookup);
+	ditherer.DitherRows(pixels, qPixels, height, matcher);
+	return true;
+}
+
+template <typename Matcher>
+bool RemapBands(const ReadBandFn& readBand, const WriteBandFn& writeBand, const UINT width, const UINT height, const UINT bandHeight,
+	const ColorPalette* pPalette, const Matcher& matcher, const bool dither, const bool& hasSemiTransparency, const UINT nMaxColors, int& transparentIndex, QuantizeStats* pStats,
+	const InverseColormap* pColormap, const DitherLookup& lookup)
+{
+	transparentIndex = -1;
+	if (width == 0 || bandHeight == 0)
+		return false;
+
+	auto band = make_unique<ARGB[]>((size_t) width * bandHeight);
+	auto qBand = make_unique<unsigned short[]>((size_t) width * bandHeight);
+	BandDitherer ditherer(pPalette, hasSemiTransparency, nMaxColors, width, pStats, pColormap, lookup);
+	for (UINT y = 0; y < height; ) {
+		const UINT rows = min(bandHeight, height - y);
+		if (!readBand(y, rows, band.get()))
+			return false;
+
+		const size_t count = (size_t) width * rows;
+		if (dither)
+			ditherer.DitherRows(band.get(), qBand.get(), rows, matcher);
+		else
+			MatchPixels(matcher, pPalette, nMaxColors, band.get(), count, qBand.get());
+
+		for (size_t i = count; i-- > 0; ) {
+			if (Color(band[i]).GetA() == 0) {
+				transparentIndex = qBand[i];
+				break;
+			}
+		}
+
+		if (!writeBand(y, rows, qBand.get()))
+			return false;
+		y += rows;
+	}
+	return true;
+}
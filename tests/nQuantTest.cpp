@@ -0,0 +1,258 @@
+// nQuantTest.cpp
+//
+// Checks of the library that need no reference images: each one compares two
+// ways of getting the same result and prints what differs. Exits with 1 when
+// any check fails, ctest runs it as the units test.
+
+#include "stdafx.h"
+#include <iostream>
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "PnnQuantizer.h"
+#include "WuQuantizer.h"
+#include "bitmapUtilities.h"
+
+using namespace std;
+
+// a noisy gradient, so that the error diffusion has something to carry
+vector<ARGB> MakePixels(const UINT width, const UINT height, const unsigned seed)
+{
+	vector<ARGB> pixels((size_t) width * height);
+	mt19937 rng(seed);
+	for (UINT y = 0; y < height; ++y) {
+		for (UINT x = 0; x < width; ++x) {
+			const int r = (x * 255 / width + rng() % 24) & 255, g = (y * 255 / height + rng() % 24) & 255, b = ((x + y) * 127 / (width + height) + rng() % 64) & 255;
+			pixels[(size_t) y * width + x] = Color::MakeARGB(255, r, g, b);
+		}
+	}
+	return pixels;
+}
+
+// a tile at least as large as the image both ways diffuses it as the serpentine scan does
+bool CheckOneTile()
+{
+	bool ok = true;
+	const UINT sizes[][2] = { { 301, 203 }, { 203, 301 }, { 64, 64 }, { 1, 97 } };
+	for (const auto& size : sizes) {
+		const UINT width = size[0], height = size[1];
+		const auto pixels = MakePixels(width, height, width * 31 + height);
+
+		auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + 16 * sizeof(ARGB));
+		auto pPalette = (ColorPalette*) pPaletteBytes.get();
+		pPalette->Count = 16;
+		for (UINT i = 0; i < pPalette->Count; ++i)
+			pPalette->Entries[i] = pixels[(size_t) i * pixels.size() / pPalette->Count];
+		auto indexFn = [&](const ARGB argb) -> unsigned short {
+			Color c(argb);
+			unsigned short k = 0;
+			int best = INT_MAX;
+			for (UINT i = 0; i < pPalette->Count; ++i) {
+				Color p(pPalette->Entries[i]);
+				const int dr = c.GetR() - p.GetR(), dg = c.GetG() - p.GetG(), db = c.GetB() - p.GetB();
+				const int d = dr * dr + dg * dg + db * db;
+				if (d < best) {
+					best = d;
+					k = (unsigned short) i;
+				}
+			}
+			return k;
+		};
+
+		vector<unsigned short> serpentine(pixels.size()), tiled(pixels.size());
+		const int err_len = (width + 2) * 4;
+		auto erowErr = make_unique<short[]>(err_len);
+		auto orowErr = make_unique<short[]>(err_len);
+		bool oddScanline = false;
+		DiffuseSerpentine<DitherAlpha::Opaque>(pixels.data(), serpentine.data(), height, width, erowErr.get(), orowErr.get(), oddScanline, pPalette, indexFn);
+		DiffuseTiles<DitherAlpha::Opaque>(pixels.data(), tiled.data(), width, height, max(width, height), 32, 1, pPalette, indexFn);
+
+		size_t differ = 0;
+		for (size_t i = 0; i < pixels.size(); ++i)
+			differ += serpentine[i] != tiled[i];
+		if (differ) {
+			cerr << "one tile of " << width << "x" << height << ": " << differ << " indices differ from the serpentine scan" << endl;
+			ok = false;
+		}
+	}
+
+	// and through a quantizer, on its lazy table with nThreads of 1 and of the default 0
+	const UINT width = 301, height = 203;
+	auto pixels = MakePixels(width, height, 7);
+	for (const UINT nThreads : { 1U, 0U }) {
+		vector<unsigned short> qPixels[2];
+		for (int tiles = 0; tiles < 2; ++tiles) {
+			DitherLookup lookup;
+			lookup.nThreads = nThreads;
+			lookup.tileSize = tiles ? max(width, height) : 0;
+			auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + 256 * sizeof(ARGB));
+			UINT nMaxColors = 256;
+			qPixels[tiles].resize(pixels.size());
+			PnnQuant::PnnQuantizer quantizer;
+			quantizer.SetDitherLookup(lookup);
+			if (!quantizer.QuantizeImage(pixels.data(), width, height, width * sizeof(ARGB), (ColorPalette*) pPaletteBytes.get(), qPixels[tiles].data(), nMaxColors, true)) {
+				cerr << "PNN failed" << endl;
+				return false;
+			}
+		}
+		if (qPixels[0] != qPixels[1]) {
+			cerr << "PNN with one tile and nThreads " << nThreads << " differs from the serpentine scan" << endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// WU read in bands builds the palette of QuantizeImages over the same image and maps it alike without dithering
+bool CheckWuBands()
+{
+	const UINT width = 301, height = 203;
+	auto pixels = MakePixels(width, height, 11);
+	for (size_t i = 0; i < pixels.size(); i += 97)
+		pixels[i] &= 0x7FFFFFFF;	// some semi-transparency for the fader
+
+	bool ok = true;
+	for (const UINT nColors : { 16U, 256U }) {
+		SourceImage source;
+		if (!GrabPixels(pixels.data(), width, height, width * sizeof(ARGB), source))
+			return false;
+		FillHistogram(source);
+
+		auto pWholeBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nColors * sizeof(ARGB));
+		auto pBandBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + nColors * sizeof(ARGB));
+		auto pWhole = (ColorPalette*) pWholeBytes.get(), pBand = (ColorPalette*) pBandBytes.get();
+		vector<unsigned short> whole(pixels.size()), banded(pixels.size());
+		UINT nWhole = nColors, nBand = nColors;
+
+		nQuant::WuQuantizer wholeQuantizer, bandQuantizer;
+		unsigned short* qPixels = whole.data();
+		const bool wholeOk = wholeQuantizer.QuantizeImages({ &source }, pWhole, { qPixels }, nWhole, false, 0, 3, 1);
+		auto readBand = [&](const UINT y, const UINT rows, ARGB* band) {
+			copy_n(pixels.data() + (size_t) y * width, (size_t) rows * width, band);
+			return true;
+		};
+		auto writeBand = [&](const UINT y, const UINT rows, const unsigned short* qBand) {
+			copy_n(qBand, (size_t) rows * width, banded.data() + (size_t) y * width);
+			return true;
+		};
+		const bool bandOk = bandQuantizer.QuantizeImage(readBand, width, height, pBand, writeBand, nBand, false, 0, 3, 37);
+
+		if (!wholeOk || !bandOk || nWhole != nBand || !equal(pWhole->Entries, pWhole->Entries + nWhole, pBand->Entries) || whole != banded) {
+			cerr << "WU in bands of 37 rows at " << nColors << " colors differs from QuantizeImages" << endl;
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+// counts of an image above 2^32 pixels, taken from histograms of a width and height that are never allocated
+bool CheckWideCounts()
+{
+	const UINT width = 70000, height = 70000;
+	const size_t area = (size_t) width * height;
+	const ARGB black = Color::MakeARGB(255, 0, 0, 0), red = Color::MakeARGB(255, 255, 0, 0);
+	const ARGB white = Color::MakeARGB(255, 255, 255, 255), nearWhite = Color::MakeARGB(255, 250, 250, 250);
+	const ARGB clear = Color::MakeARGB(0, 0, 0, 0);
+
+	SourceImage frames[2];
+	for (auto& frame : frames) {
+		frame.width = width;
+		frame.height = height;
+		frame.histogram[black] = 1000000000;
+		frame.histogram[red] = 1000000000;
+		frame.histogram[white] = 2200000000;
+		frame.histogram[nearWhite] = area - 4200000001ULL;
+		frame.histogram[clear] = 1;
+	}
+	frames[1].transparentPixelIndex = (long long) area - 1;
+	frames[1].transparentColor = clear;
+
+	bool ok = true;
+	SourceImage merged;
+	if (!MergeHistograms({ &frames[0], &frames[1] }, merged))
+		return false;
+	size_t total = 0;
+	for (const auto& entry : merged.histogram)
+		total += entry.second;
+	if (total != 2 * area || merged.histogram[white] != 4400000000ULL || merged.transparentPixelIndex != (long long) (2 * area - 1)) {
+		cerr << "merged " << total << " pixels, " << merged.histogram[white] << " white, transparent at " << merged.transparentPixelIndex << endl;
+		ok = false;
+	}
+
+	// PNN merges the two whites of the counted image, with no pixels to map, weighing each by the root of its count
+	SourceImage counted;
+	counted.histogram = merged.histogram;
+	counted.histogram.erase(clear);
+	auto pPaletteBytes = make_unique<BYTE[]>(sizeof(ColorPalette) + 3 * sizeof(ARGB));
+	auto pPalette = (ColorPalette*) pPaletteBytes.get();
+	UINT nMaxColors = 3;
+	PnnQuant::PnnQuantizer quantizer;
+	if (!quantizer.QuantizeImages({ &counted }, pPalette, { nullptr }, nMaxColors, false, 1))
+		return false;
+	const double whites = sqrt((double) merged.histogram[white]), nearWhites = sqrt((double) merged.histogram[nearWhite]);
+	const double grey = (255 * whites + 250 * nearWhites) / (whites + nearWhites);
+	bool hasBlack = false, hasRed = false, hasWhite = false;
+	for (UINT i = 0; i < nMaxColors; ++i) {
+		Color c(pPalette->Entries[i]);
+		hasBlack |= pPalette->Entries[i] == black;
+		hasRed |= pPalette->Entries[i] == red;
+		hasWhite |= fabs(c.GetR() - grey) <= 1 && c.GetR() == c.GetG() && c.GetG() == c.GetB();
+	}
+	if (nMaxColors != 3 || !hasBlack || !hasRed || !hasWhite) {
+		cerr << "PNN palette of " << 2 * area << " counted pixels lost a color" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+// a palette key is the same for the pixels and for their histogram, and tells apart colours that trade their counts
+bool CheckPaletteKey()
+{
+	const ARGB a = Color::MakeARGB(255, 10, 20, 30), b = Color::MakeARGB(255, 200, 100, 0), c = Color::MakeARGB(255, 0, 0, 255);
+	const vector<ARGB> first = { a, b, b, c, c, c }, second = { c, b, c, a, c, b }, traded = { a, a, b, c, c, c };
+
+	SourceImage images[3];
+	const vector<ARGB>* pixels[] = { &first, &second, &traded };
+	for (int i = 0; i < 3; ++i) {
+		if (!GrabPixels(pixels[i]->data(), 3, 2, 3 * sizeof(ARGB), images[i]))
+			return false;
+	}
+	const auto key = PaletteKey("PNN", images[0], 256);
+	FillHistogram(images[1]);
+	FillHistogram(images[2]);
+
+	bool ok = true;
+	if (PaletteKey("PNN", images[1], 256) != key) {
+		cerr << "the histogram of the same colors gives another key than their pixels" << endl;
+		ok = false;
+	}
+	if (PaletteKey("PNN", images[2], 256) == key) {
+		cerr << "two colors that trade their counts give the same key" << endl;
+		ok = false;
+	}
+	return ok;
+}
+
+int main()
+{
+	const vector<pair<string, function<bool()> > > checks = {
+		{ "one tile", CheckOneTile },
+		{ "WU bands", CheckWuBands },
+		{ "wide counts", CheckWideCounts },
+		{ "palette key", CheckPaletteKey },
+	};
+
+	int failed = 0;
+	for (const auto& check : checks) {
+		const bool ok = check.second();
+		cerr << check.first << (ok ? ": ok" : ": FAILED") << endl;
+		failed += !ok;
+	}
+	return failed ? 1 : 0;
+}